@@ -0,0 +1,66 @@
+// libFuzzer target of the SFF readers and decoders, built by make fuzz. Every input is a
+// whole file to indexSff(), which reads its header, palettes and sprite headers, and
+// decodeSprites() decodes every sprite, PNG formats included. An input without the SFF
+// signature is also one encoded sprite behind a 7 byte header (format, width, height
+// and PCX bytes per line) for sffcli_decode_batch(). Seed it with real SFF files:
+//   ./sff_fuzz.exe -max_len=1048576 corpus/
+// Built with -DSFF_FUZZ_REPLAY (make fuzz_replay) it runs the files it is given once,
+// for replaying a crash where there is no libFuzzer
+
+#include "../src/libsffcli.cpp"
+
+#define FUZZ_MAX_SIDE 1024  // sprites of the decoder inputs are at most this wide and high
+
+static void fuzzSff(const uint8_t* data, size_t size) {
+    MappedFile mf = {};
+    mf.data = data;
+    mf.size = size;
+    Sff sff{};
+    sff.out = stderr;
+    snprintf(sff.filename, sizeof(sff.filename), "fuzz.sff");
+    std::vector<SpriteJob> jobs;
+    if (indexSff(&sff, &mf, jobs) == 0) decodeSprites(&sff, &mf, jobs);
+    freeSff(&sff);
+    // The pool would grow with the palettes of every input
+    palettePool.colors.clear();
+    palettePool.byHash.clear();
+}
+
+static void fuzzDecoder(const uint8_t* data, size_t size) {
+    if (size < 7) return;
+    SffcliDecodeJob job = {};
+    job.format = 1 + data[0] % 4;
+    job.width = (data[1] | data[2] << 8) % (FUZZ_MAX_SIDE + 1);
+    job.height = (data[3] | data[4] << 8) % (FUZZ_MAX_SIDE + 1);
+    job.bpl = data[5] | data[6] << 8;
+    job.srcOffset = 7;
+    job.srcLen = size - 7;
+    std::vector<uint8_t> pixels((size_t) job.width * job.height + 1);
+    sffcli_decode_batch(&job, 1, data, pixels.data());
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    opt_threads = 1;
+    fuzzSff(data, size);
+    if (size < 12 || memcmp(data, "ElecbyteSpr\0", 12) != 0) fuzzDecoder(data, size);
+    return 0;
+}
+
+#ifdef SFF_FUZZ_REPLAY
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        FILE* f = fopen(argv[i], "rb");
+        if (!f) {
+            fprintf(stderr, "Error opening file %s\n", argv[i]);
+            return 1;
+        }
+        std::vector<uint8_t> data;
+        uint8_t buffer[65536];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) data.insert(data.end(), buffer, buffer + n);
+        fclose(f);
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    return 0;
+}
+#endif
@@ -1,6 +1,8 @@
 --[[
 Love2D lua script for loading animation from mugen file *.air (animation definition).
 It will load atlas image in PNG format with file *.tsv for atlas data.
+Atlases made with --max-atlas-size have a page number in an extra last column and one image per page (name_<page>.png).
+With sffcli --bin-meta the atlas data is read from the binary *.bin file instead (LuaJIT FFI, no text parsing).
 The image and atlas data is generated using sffcli.exe  (https://github.com/leonkasovan/go-sffcli)
 File atlas data has to be edited in last coloumn "Filename_GroupID_ImageNoID" => "GroupID_ImageNoID"
 
@@ -21,6 +23,17 @@ local actionKeys = {}
 -- default_actions = {0,5,6,10,11,12,20,21,40,41,42,43,47,100,105,120,121,122,130,131,132,140,141,142,150,151,152,5000,5001,5002,5005,5006,5007,5010,5011,5012,5015,5016,5017,5020,5021,5022,5025,5026,5027,5030,5040,5050,5070,5080,5090,5100,5160,5170,5110,5120,5200,5210,5300}
 -- default_actions = {11, 11, 11, 11, 11, 11, 11}
 
+local ffi = require("ffi")
+ffi.cdef[[
+typedef struct {
+	char magic[4];
+	uint16_t version, flags;
+	uint32_t count;
+	uint16_t pages;
+	int16_t palette;
+} sfat_header;
+]]
+
 local gw, gh = love.graphics.getDimensions()
 --~ local shader_mask = love.graphics.newCanvas()
 
@@ -62,38 +75,139 @@ function loadAtlasImage(filename)
 	return i.image
 end
 
+-- Read atlas data written by sffcli --bin-meta: 16 byte header, then 13 columns of count
+-- 16 bit values (group, number, x, y, w, h, crop x, crop y, w, h, axis x, axis y, page),
+-- sorted by group and number, and from version 2 a (group, number) hash table.
+-- Returns nil when the file is missing or not this format
+function loadAtlasBin(filename)
+	local f = io.open(filename, "rb")
+	if f == nil then return nil end
+	local data = f:read("*a")
+	f:close()
+	if #data < 16 then return nil end
+	local hdr = ffi.cast("const sfat_header*", data)
+	if ffi.string(hdr.magic, 4) ~= "SFAT" or hdr.version < 1 or hdr.version > 2 or #data < 16 + hdr.count * 26 then return nil end
+	local bin = { data = data, count = hdr.count, pages = hdr.pages, paged = bit.band(hdr.flags, 2) ~= 0 }
+	bin.u16 = ffi.cast("const uint16_t*", ffi.cast("const char*", data) + 16)
+	bin.s16 = ffi.cast("const int16_t*", bin.u16)
+	local table_pos = 16 + hdr.count * 26
+	if hdr.version >= 2 and #data >= table_pos + 4 then
+		bin.slots = ffi.cast("const uint32_t*", ffi.cast("const char*", data) + table_pos)[0]
+		bin.table = ffi.cast("const int32_t*", ffi.cast("const char*", data) + table_pos + 4)
+		if #data < table_pos + 4 + bin.slots * 4 then bin.table = nil end
+	end
+	return bin
+end
+
+function atlasBinRecord(bin, k)
+	local n, u16, s16 = bin.count, bin.u16, bin.s16
+	return { u16[2 * n + k], u16[3 * n + k], u16[4 * n + k], u16[5 * n + k], u16[6 * n + k], u16[7 * n + k],
+		u16[8 * n + k], u16[9 * n + k], s16[10 * n + k], s16[11 * n + k], u16[12 * n + k] }
+end
+
+-- Find the (group, number) record: through the hash table when the file has one
+-- (slot = (group * 40503 + number * 31161) mod slots, linear probing), else by
+-- binary search of the sorted columns. Returns the record as in atlas_dat or nil
+function findAtlasBin(bin, group, number)
+	local n, u16 = bin.count, bin.u16
+	if bin.table ~= nil then
+		local slot = (group * 40503 + number * 31161) % bin.slots
+		while bin.table[slot] >= 0 do
+			local k = bin.table[slot]
+			if u16[k] == group and u16[n + k] == number then
+				return atlasBinRecord(bin, k)
+			end
+			slot = (slot + 1) % bin.slots
+		end
+		return nil
+	end
+	local lo, hi = 0, n - 1
+	while lo <= hi do
+		local mid = math.floor((lo + hi) / 2)
+		local g, no = u16[mid], u16[n + mid]
+		if g == group and no == number then
+			return atlasBinRecord(bin, mid)
+		elseif g < group or (g == group and no < number) then
+			lo = mid + 1
+		else
+			hi = mid - 1
+		end
+	end
+	return nil
+end
+
+-- Image and sprite batch of one atlas page
+function loadAtlasPage(player, page, paged)
+	if player.pages[page] == nil then
+		local filename = player.name .. ".png"
+		if paged then
+			filename = string.format("%s_%d.png", player.name, page)
+		end
+		-- player.atlas_img = love.graphics.newImage(filename)
+		local img = loadAtlasImage(filename)
+		local w, h = img:getDimensions()
+		player.pages[page] = { image = img, w = w, h = h, sprites = love.graphics.newSpriteBatch(img) }
+	end
+	return player.pages[page]
+end
+
+-- Atlas record of a sprite: { src_x, src_y, src_w, src_h, dst_x, dst_y, dst_w, dst_h, spr_off_x, spr_off_y, page }
+function getAtlasRecord(player, group, number)
+	if player.atlas_bin ~= nil then
+		local rec = player.atlas_dat[group] and player.atlas_dat[group][number]
+		if rec == nil then
+			rec = findAtlasBin(player.atlas_bin, group, number)
+			if rec == nil then return nil end
+			if player.atlas_dat[group] == nil then player.atlas_dat[group] = {} end
+			player.atlas_dat[group][number] = rec
+		end
+		return rec
+	end
+	if player.atlas_dat[group] == nil then return nil end
+	return player.atlas_dat[group][number]
+end
+
 function loadChar(name, x, y)
 	player = {}
 	player.name = name
 	-- player.atlas_img = love.graphics.newImage(player.name .. ".png")
-	player.atlas_img = loadAtlasImage(player.name .. ".png")
+	player.pages = {}
 	player.atlas_dat = {}
-	for line in io.lines(player.name .. ".txt") do -- Iterate through each line of player.tsv (tab separated values)
-		if #line > 0 then
-			src_x, src_y, src_w, src_h, dst_x, dst_y, dst_w, dst_h, spr_off_x, spr_off_y, spr_group_id, spr_img_no = line:match(
-				"(%d+)\t(%d+)\t(%d+)\t(%d+)\t(%d+)\t(%d+)\t(%d+)\t(%d+)\t([%-%d]+)\t([%-%d]+)\t(%d+)%D(%d+)")
-			src_x = tonumber(src_x)
-			src_y = tonumber(src_y)
-			src_w = tonumber(src_w)
-			src_h = tonumber(src_h)
-			dst_x = tonumber(dst_x)
-			dst_y = tonumber(dst_y)
-			dst_w = tonumber(dst_w)
-			dst_h = tonumber(dst_h)
-			spr_off_x = tonumber(spr_off_x)
-			spr_off_y = tonumber(spr_off_y)
-			spr_group_id = tonumber(spr_group_id)
-			spr_img_no = tonumber(spr_img_no)
+	player.atlas_bin = loadAtlasBin(player.name .. ".bin")
+	if player.atlas_bin ~= nil then
+		for page = 0, player.atlas_bin.pages - 1 do
+			loadAtlasPage(player, page, player.atlas_bin.paged)
+		end
+	else
+		for line in io.lines(player.name .. ".txt") do -- Iterate through each line of player.tsv (tab separated values)
+			if #line > 0 then
+				src_x, src_y, src_w, src_h, dst_x, dst_y, dst_w, dst_h, spr_off_x, spr_off_y, spr_group_id, spr_img_no = line:match(
+					"(%d+)\t(%d+)\t(%d+)\t(%d+)\t(%d+)\t(%d+)\t(%d+)\t(%d+)\t([%-%d]+)\t([%-%d]+)\t(%d+)%D(%d+)")
+				src_x = tonumber(src_x)
+				src_y = tonumber(src_y)
+				src_w = tonumber(src_w)
+				src_h = tonumber(src_h)
+				dst_x = tonumber(dst_x)
+				dst_y = tonumber(dst_y)
+				dst_w = tonumber(dst_w)
+				dst_h = tonumber(dst_h)
+				spr_off_x = tonumber(spr_off_x)
+				spr_off_y = tonumber(spr_off_y)
+				spr_group_id = tonumber(spr_group_id)
+				spr_img_no = tonumber(spr_img_no)
+				-- page column of a multi-page atlas, a single page atlas has none
+				local page_field = line:match("\t(%d+)$")
+				local page = tonumber(page_field) or 0
+				loadAtlasPage(player, page, page_field ~= nil)
 
-			-- Ensure atlas_dat[group_id] is a table before assigning values
-			if player.atlas_dat[spr_group_id] == nil then
-				player.atlas_dat[spr_group_id] = {} -- Create a new table for this key
+				-- Ensure atlas_dat[group_id] is a table before assigning values
+				if player.atlas_dat[spr_group_id] == nil then
+					player.atlas_dat[spr_group_id] = {} -- Create a new table for this key
+				end
+				player.atlas_dat[spr_group_id][spr_img_no] = { src_x, src_y, src_w, src_h, dst_x, dst_y, dst_w, dst_h,spr_off_x, spr_off_y, page }
 			end
-			player.atlas_dat[spr_group_id][spr_img_no] = { src_x, src_y, src_w, src_h, dst_x, dst_y, dst_w, dst_h,spr_off_x, spr_off_y }
 		end
 	end
-	player.atlas_img_w, player.atlas_img_h = player.atlas_img:getDimensions()
-	player.sprites = love.graphics.newSpriteBatch(player.atlas_img)
 	player.state = 0
 	player.x = x
 	player.y = y
@@ -176,7 +290,9 @@ function love.update(dt)
 	local dt, anim
 
 	for k, player in pairs(players) do
-		player.sprites:clear()
+		for _, page in pairs(player.pages) do
+			page.sprites:clear()
+		end
 		player.tick = player.tick + 1
 		if player.anims[player.state] == nil then
 			print("error: player.anims[player.state] is nil", player.state)
@@ -199,8 +315,8 @@ function love.update(dt)
 					if player.state == nil or player.frame_no == nil then
 						print("error: player.state or player.frame_no is nil", player.state, player.frame_no)
 					else
-						if player.atlas_dat[anim.spr_group_id] ~= nil then
-							dt = player.atlas_dat[anim.spr_group_id][anim.spr_img_no]
+						if player.atlas_bin ~= nil or player.atlas_dat[anim.spr_group_id] ~= nil then
+							dt = getAtlasRecord(player, anim.spr_group_id, anim.spr_img_no)
 						else
 							print(string.format("player.atlas_dat[%d] is nil", anim.spr_group_id))
 							players[1].state = 0
@@ -210,8 +326,9 @@ function love.update(dt)
 					end
 
 					if dt ~= nil then
-						player.sprites:add(
-							love.graphics.newQuad(dt[1], dt[2], dt[3], dt[4], player.atlas_img_w, player.atlas_img_h),
+						local page = player.pages[dt[11]]
+						page.sprites:add(
+							love.graphics.newQuad(dt[1], dt[2], dt[3], dt[4], page.w, page.h),
 							player.x + dt[5] + anim.spr_x - dt[9], player.y + dt[6] + anim.spr_y - dt[10])
 					else
 						print(string.format("%s atlas_dat is nil, state=%d group=%d img_no=%d", player.name, player.state, anim.spr_group_id, anim.spr_img_no))
@@ -233,7 +350,9 @@ function love.draw()
 
 	-- Finally, draw the sprite batch to the screen.
 	for k, player in pairs(players) do
-		love.graphics.draw(player.sprites)
+		for _, page in pairs(player.pages) do
+			love.graphics.draw(page.sprites)
+		end
 		love.graphics.print("Action: " .. tostring(player.state), player.x + 5, player.y + 5)
 	end
 	love.graphics.print("Current FPS: " .. tostring(love.timer.getFPS()), 5, 0)
@@ -0,0 +1,87 @@
+package main
+
+import (
+	"fmt"
+	"hash/fnv"
+	"time"
+)
+
+// -B: decode benchmark of the batched formats, the same table as sffcli.exe -B prints
+// for them, "Pixels FNV" included, so the two front ends can be compared on one file set
+type benchStats struct {
+	sprites   int
+	inBytes   int
+	outBytes  int
+	ns        int64
+	pixelHash uint64 // sum of the FNV-1a of every sprite's pixels, first iteration
+}
+
+var benchFormats = []struct {
+	format int
+	name   string
+}{{1, "PCX"}, {2, "RLE8"}, {3, "RLE5"}, {4, "LZ5"}}
+
+// Decode the sprites sff queued iterations times, one batch per format
+func benchSff(sff *Sff, iterations int, stats map[int]*benchStats) {
+	b := sff.batch
+	for _, bf := range benchFormats {
+		sub := spriteBatch{src: b.src}
+		for _, j := range b.jobs {
+			if j.format == bf.format {
+				sub.jobs = append(sub.jobs, j)
+			}
+		}
+		if len(sub.jobs) == 0 {
+			continue
+		}
+		st := stats[bf.format]
+		if st == nil {
+			st = &benchStats{}
+			stats[bf.format] = st
+		}
+		for it := 0; it < iterations; it++ {
+			t0 := time.Now()
+			decodeBatch(&sub)
+			st.ns += time.Since(t0).Nanoseconds()
+			for _, j := range sub.jobs {
+				st.sprites++
+				st.inBytes += j.srcLen
+				st.outBytes += len(j.px)
+				if it == 0 && len(j.px) > 0 {
+					h := fnv.New64a()
+					h.Write(j.px)
+					st.pixelHash += h.Sum64()
+				}
+			}
+		}
+	}
+	releaseBatch(b)
+	sff.batch = nil
+}
+
+func printBench(stats map[int]*benchStats, files int, iterations int) {
+	fmt.Printf("Decode benchmark: %v file(s), %v iteration(s), %v, batches of all sprites of a format\n", files, iterations, decodeKernels)
+	fmt.Printf("%-8s %10s %10s %10s %12s %16s\n", "Format", "Sprites", "In MB/s", "Out MB/s", "Sprites/s", "Pixels FNV")
+	var all benchStats
+	line := func(name string, st *benchStats) {
+		sec := float64(st.ns) / 1e9
+		if sec <= 0 {
+			sec = 1e-9
+		}
+		fmt.Printf("%-8s %10d %10.1f %10.1f %12.0f %016x\n", name, st.sprites,
+			float64(st.inBytes)/sec/1e6, float64(st.outBytes)/sec/1e6, float64(st.sprites)/sec, st.pixelHash)
+	}
+	for _, bf := range benchFormats {
+		if st := stats[bf.format]; st != nil {
+			line(bf.name, st)
+			all.sprites += st.sprites
+			all.inBytes += st.inBytes
+			all.outBytes += st.outBytes
+			all.ns += st.ns
+			all.pixelHash += st.pixelHash
+		}
+	}
+	if all.sprites > 0 {
+		line("Total", &all)
+	}
+}
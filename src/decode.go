@@ -0,0 +1,88 @@
+package main
+
+import (
+	"io"
+	"sync"
+)
+
+// Sprites of a file wait in a batch until decodeBatchSize of them are read, then
+// decode in one go and are saved in the order they were read. Built with
+// -tags sffcli_native the batch is one call into the libsffcli decoders
+// (decode_native.go), else the Go decoders run on it (decode_go.go)
+const decodeBatchSize = 64
+
+type decodeJob struct {
+	s      *Sprite
+	format int // 1 PCX, 2 RLE8, 3 RLE5, 4 LZ5
+	bpl    int // PCX bytes per line
+	srcOfs int // encoded data in the batch src
+	srcLen int
+	px     []byte // decoded pixels, set by decodeBatch
+}
+
+type spriteBatch struct {
+	jobs []decodeJob
+	src  []byte // encoded data of the jobs, back to back
+	px   []byte // decoded pixels of the jobs, back to back (native decoders)
+}
+
+// Batches go back to the pool with their buffers, the next file reuses them
+var batchPool = sync.Pool{New: func() any { return new(spriteBatch) }}
+
+func growBytes(b []byte, n int) []byte {
+	if cap(b) < n {
+		nb := make([]byte, n, 2*n)
+		copy(nb, b)
+		return nb
+	}
+	return b[:n]
+}
+
+// Read n bytes of encoded data of sprite s from r as the next job
+func (b *spriteBatch) read(r io.Reader, s *Sprite, format int, n int) error {
+	ofs := len(b.src)
+	b.src = growBytes(b.src, ofs+n)
+	if _, err := io.ReadFull(r, b.src[ofs:]); err != nil {
+		b.src = b.src[:ofs]
+		return err
+	}
+	b.jobs = append(b.jobs, decodeJob{s: s, format: format, srcOfs: ofs, srcLen: n})
+	return nil
+}
+
+// Queue encoded data already in memory
+func (b *spriteBatch) add(s *Sprite, format int, bpl int, data []byte) {
+	ofs := len(b.src)
+	b.src = append(b.src, data...)
+	b.jobs = append(b.jobs, decodeJob{s: s, format: format, bpl: bpl, srcOfs: ofs, srcLen: len(data)})
+}
+
+func (b *spriteBatch) reset() {
+	clear(b.jobs)
+	b.jobs = b.jobs[:0]
+	b.src = b.src[:0]
+	b.px = b.px[:0]
+}
+
+// Decode the queued sprites and save them as PNG
+func (b *spriteBatch) flush(sff *Sff) error {
+	if len(b.jobs) == 0 {
+		return nil
+	}
+	decodeBatch(b)
+	var err error
+	for i := range b.jobs {
+		if err == nil {
+			err = saveImageToPNG(sff, b.jobs[i].s, b.jobs[i].px)
+		}
+	}
+	b.reset()
+	return err
+}
+
+func releaseBatch(b *spriteBatch) {
+	if b != nil {
+		b.reset()
+		batchPool.Put(b)
+	}
+}
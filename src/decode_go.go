@@ -0,0 +1,27 @@
+//go:build !sffcli_native
+
+package main
+
+const decodeKernels = "Go decoders"
+
+func decodeBatch(b *spriteBatch) {
+	for i := range b.jobs {
+		j := &b.jobs[i]
+		src := b.src[j.srcOfs : j.srcOfs+j.srcLen]
+		switch j.format {
+		case 1:
+			j.s.rle = j.bpl
+			j.px = j.s.RlePcxDecode(src)
+		case 2:
+			j.px = j.s.Rle8Decode(src)
+		case 3:
+			j.px = j.s.Rle5Decode(src)
+		case 4:
+			j.px = j.s.Lz5Decode(src)
+		}
+	}
+}
+
+func decodePcx(s *Sprite, px []byte) []byte {
+	return s.RlePcxDecode(px)
+}
@@ -0,0 +1,80 @@
+//go:build sffcli_native
+
+package main
+
+/*
+// libsffcli.a comes from make lib, it holds its own libpng and PhysFS, hidden
+#cgo CFLAGS: -I${SRCDIR}
+#cgo LDFLAGS: ${SRCDIR}/../libsffcli.a -lstdc++ -lz -lm -lpthread
+
+#include "sffcli.h"
+*/
+import "C"
+import (
+	"sync"
+	"unsafe"
+)
+
+const decodeKernels = "libsffcli decoders"
+
+var decodeJobPool = sync.Pool{New: func() any { return new([]C.SffcliDecodeJob) }}
+
+// Sprites the C decoders have work for, the others get what the Go decoders give
+func (j *decodeJob) native() bool {
+	return j.srcLen > 0 && j.s.Size[0] > 0 && j.s.Size[1] > 0 && (j.format != 1 || j.bpl > 0)
+}
+
+func decodeBatch(b *spriteBatch) {
+	pooled := decodeJobPool.Get().(*[]C.SffcliDecodeJob)
+	jobs := (*pooled)[:0]
+	size := 0
+	for i := range b.jobs {
+		j := &b.jobs[i]
+		if !j.native() {
+			if j.srcLen > 0 && (j.format != 1 || j.bpl > 0) {
+				j.px = []byte{} // no pixels
+			} else {
+				j.px = b.src[j.srcOfs : j.srcOfs+j.srcLen] // raw PCX, or nothing to decode
+			}
+			continue
+		}
+		jobs = append(jobs, C.SffcliDecodeJob{
+			srcOffset:    C.size_t(j.srcOfs),
+			srcLen:       C.size_t(j.srcLen),
+			pixelsOffset: C.size_t(size),
+			width:        C.uint16_t(j.s.Size[0]),
+			height:       C.uint16_t(j.s.Size[1]),
+			bpl:          C.uint16_t(j.bpl),
+			format:       C.uint8_t(j.format),
+		})
+		size += int(j.s.Size[0]) * int(j.s.Size[1])
+	}
+	if len(jobs) > 0 {
+		b.px = growBytes(b.px, size)
+		C.sffcli_decode_batch(&jobs[0], C.int(len(jobs)),
+			(*C.uint8_t)(unsafe.Pointer(&b.src[0])), (*C.uint8_t)(unsafe.Pointer(&b.px[0])))
+	}
+	k := 0
+	for i := range b.jobs {
+		j := &b.jobs[i]
+		if !j.native() {
+			continue
+		}
+		ofs := int(jobs[k].pixelsOffset)
+		end := ofs + int(j.s.Size[0])*int(j.s.Size[1])
+		j.px = b.px[ofs:end:end]
+		if j.format == 1 {
+			j.s.rle = 0
+		}
+		k++
+	}
+	*pooled = jobs
+	decodeJobPool.Put(pooled)
+}
+
+// One PCX sprite of SFF v1, with fresh pixels as the PNG of the caller keeps them
+func decodePcx(s *Sprite, px []byte) []byte {
+	b := spriteBatch{jobs: []decodeJob{{s: s, format: 1, bpl: s.rle, srcLen: len(px)}}, src: px}
+	decodeBatch(&b)
+	return b.jobs[0].px
+}
@@ -0,0 +1,458 @@
+// libsffcli, see sffcli.h. The SFF readers and decoders are those of sffcli itself:
+// main.cpp is compiled into this file without its main()
+
+#define SFFCLI_LIBRARY
+#include "main.cpp"
+#include "sffcli.h"
+#include <tuple>
+
+struct SffcliFile {
+    Sff sff;
+    MappedFile mf;
+    std::vector<SpriteJob> jobs;
+    std::vector<int32_t> jobOf;     // sprite index -> job with its pixels (of the sprite it links to), -1 = none
+};
+
+extern "C" {
+
+SffcliFile* sffcli_open(const char* filename) {
+    SffcliFile* f = new SffcliFile();
+    f->sff.out = stderr;
+    if (openMappedFile(&f->mf, filename) != 0) {
+        fprintf(stderr, "Error opening file %s\n", filename);
+        delete f;
+        return NULL;
+    }
+    strncpy(f->sff.filename, filename, sizeof(f->sff.filename) - 1);
+    get_basename_no_ext(f->sff.filename, f->sff.basename, sizeof(f->sff.basename));
+    if (indexSff(&f->sff, &f->mf, f->jobs) != 0) {
+        sffcli_close(f);
+        return NULL;
+    }
+
+    // The jobs follow the sprite order, linked sprites always point back
+    uint32_t num = f->sff.header.NumberOfSprites;
+    f->jobOf.assign(num, -1);
+    size_t k = 0;
+    for (uint32_t i = 0; i < num; i++) {
+        const Sprite* s = f->sff.sprites[i];
+        if (k < f->jobs.size() && f->jobs[k].sprite == s) {
+            f->jobOf[i] = (int32_t) k++;
+        } else if (s->link >= 0) {
+            f->jobOf[i] = f->jobOf[s->link];
+        }
+    }
+    return f;
+}
+
+void sffcli_close(SffcliFile* sff) {
+    if (!sff) return;
+    freeSff(&sff->sff);
+    closeMappedFile(&sff->mf);
+    delete sff;
+}
+
+int sffcli_version(const SffcliFile* sff) {
+    return sff->sff.header.Ver0;
+}
+
+int sffcli_sprite_count(const SffcliFile* sff) {
+    return (int) sff->sff.header.NumberOfSprites;
+}
+
+int sffcli_palette_count(const SffcliFile* sff) {
+    return (int) sff->sff.palettes.size();
+}
+
+int sffcli_find_sprite(const SffcliFile* sff, uint16_t group, uint16_t number) {
+    return findSprite(&sff->sff, group, number);
+}
+
+// Format code of a sprite, as in the -i report
+static int spriteFormat(const SffcliFile* sff, const Sprite* s) {
+    return sff->sff.header.Ver0 == 1 ? 1 : -s->rle;
+}
+
+int sffcli_sprite_info(const SffcliFile* sff, int index, SffcliSprite* info) {
+    if (index < 0 || (uint32_t) index >= sff->sff.header.NumberOfSprites) {
+        fprintf(stderr, "Invalid sprite index %d\n", index);
+        return -1;
+    }
+    const Sprite* s = sff->sff.sprites[index];
+    info->group = s->Group;
+    info->number = s->Number;
+    info->width = s->Size[0];
+    info->height = s->Size[1];
+    info->x = s->Offset[0];
+    info->y = s->Offset[1];
+    info->format = spriteFormat(sff, s);
+    info->bytesPerPixel = isRgbaSprite(s) ? 4 : 1;
+    info->palette = info->bytesPerPixel == 4 ? -1 : s->palidx;
+    info->link = s->link;
+    return 0;
+}
+
+int sffcli_decode_sprite(const SffcliFile* sff, int index, void* pixels, size_t size) {
+    SffcliSprite info;
+    if (sffcli_sprite_info(sff, index, &info) != 0) return -1;
+    size_t len = (size_t) info.width * info.height * info.bytesPerPixel;
+    if (size < len) {
+        fprintf(stderr, "Buffer of %zu bytes is too small for sprite %d,%d (%zu bytes)\n", size, info.group, info.number, len);
+        return -1;
+    }
+    if (len == 0) return 0;
+    uint8_t* dstPx = (uint8_t*) pixels;
+    int k = sff->jobOf[index];
+    if (k < 0) {
+        // No pixel data and nothing to link to: blank, like sffcli leaves it
+        memset(dstPx, 0, len);
+        return 0;
+    }
+
+    // The decoders take the size from the sprite and may change its rle field,
+    // they work on a copy so the file stays read-only
+    const SpriteJob* job = &sff->jobs[k];
+    Sprite s = *job->sprite;
+    uint8_t* px = NULL;
+    if (sff->sff.header.Ver0 == 1) {
+        s.rle = job->bpl;
+        px = RlePcxDecode(&s, job->srcPx, job->srcLen, dstPx);
+    } else {
+        MemReader reader = { sff->mf.data, sff->mf.size, 0 };
+        const uint8_t* srcPx;
+        size_t srcLen;
+        if (s.rle == 0) {
+            // Raw indices, whatever the data lacks stays 0
+            mseek(&reader, job->offset, SEEK_SET);
+            srcLen = std::min((size_t) job->datasize, len);
+            srcPx = mpeek(&reader, srcLen);
+            if (srcPx) {
+                memcpy(dstPx, srcPx, srcLen);
+                memset(dstPx + srcLen, 0, len - srcLen);
+                px = dstPx;
+            }
+        } else {
+            // The data starts with its uncompressed length
+            mseek(&reader, job->offset + 4, SEEK_SET);
+            srcLen = job->datasize < 4 ? 0 : job->datasize - 4;
+            srcPx = mpeek(&reader, srcLen);
+        }
+        if (!srcPx) {
+            fprintf(stderr, "Error reading V2 sprite data (len=%zu)\n", srcLen);
+            return -1;
+        }
+        switch (-s.rle) {
+        case 0: break;
+        case 2: px = Rle8Decode(&s, srcPx, srcLen, dstPx); break;
+        case 3: px = Rle5Decode(&s, srcPx, srcLen, dstPx); break;
+        case 4: px = Lz5Decode(&s, srcPx, srcLen, dstPx); break;
+        case 10: px = Indexed_PngDecode_FromMemory(&s, srcPx, srcLen, dstPx); break;
+        case 11:
+        case 12: px = RGBA_PngDecode(&s, srcPx, srcLen, dstPx); break;
+        default:
+            fprintf(stderr, "Unsupported sprite format %d\n", -s.rle);
+            return -1;
+        }
+    }
+    if (!px) {
+        fprintf(stderr, "Error decoding %s sprite %d,%d\n", formatName(info.format), info.group, info.number);
+        return -1;
+    }
+    return 0;
+}
+
+int sffcli_find_palette(const SffcliFile* sff, uint16_t group, uint16_t number) {
+    for (size_t i = 0; i < sff->sff.paletteIds.size(); i++) {
+        const std::array<int, 3>& id = sff->sff.paletteIds[i];
+        if ((uint16_t) id[1] == group && (uint16_t) id[2] == number) return (int) i;
+    }
+    return -1;
+}
+
+int sffcli_palette(const SffcliFile* sff, int palidx, uint8_t rgba[1024]) {
+    if (palidx < 0 || (size_t) palidx >= sff->sff.palettes.size()) {
+        fprintf(stderr, "Invalid palette index %d\n", palidx);
+        return -1;
+    }
+    const uint32_t* colors = sff->sff.palettes[palidx];
+    for (int i = 0; i < 256; i++) {
+        rgba[i * 4 + 0] = (colors[i] >> 0) & 0xFF;
+        rgba[i * 4 + 1] = (colors[i] >> 8) & 0xFF;
+        rgba[i * 4 + 2] = (colors[i] >> 16) & 0xFF;
+        rgba[i * 4 + 3] = i == 0 ? 0 : 255;
+    }
+    return 0;
+}
+
+int sffcli_decode_batch(SffcliDecodeJob* jobs, int count, const uint8_t* src, uint8_t* pixels) {
+    int failed = 0;
+    for (int k = 0; k < count; k++) {
+        SffcliDecodeJob* job = &jobs[k];
+        Sprite s = {};
+        s.Size[0] = job->width;
+        s.Size[1] = job->height;
+        const uint8_t* srcPx = src + job->srcOffset;
+        uint8_t* dstPx = pixels + job->pixelsOffset;
+        uint8_t* px = NULL;
+        switch (job->format) {
+        case 1:
+            s.rle = job->bpl;
+            px = RlePcxDecode(&s, srcPx, job->srcLen, dstPx);
+            break;
+        case 2: px = Rle8Decode(&s, srcPx, job->srcLen, dstPx); break;
+        case 3: px = Rle5Decode(&s, srcPx, job->srcLen, dstPx); break;
+        case 4: px = Lz5Decode(&s, srcPx, job->srcLen, dstPx); break;
+        default:
+            fprintf(stderr, "Unsupported sprite format %d\n", job->format);
+            break;
+        }
+        job->result = px ? 0 : -1;
+        if (!px) failed++;
+    }
+    return failed;
+}
+
+// Sprite cache: SPRITE_CACHE_SHARDS independent LRU lists, a sprite goes to the shard
+// its file and (Group, Number) hash to, and each shard keeps within its share of the budget
+#define SPRITE_CACHE_SHARDS 16
+
+typedef std::tuple<const SffcliFile*, uint16_t, uint16_t, int, int> SpriteCacheKey; // file, group, number, palidx, flags
+
+typedef struct SpriteCacheEntry {
+    SffcliPixels pixels;            // first member, the pointer sffcli_cache_acquire() hands out
+    const SffcliFile* sff;
+    int palidx;
+    int flags;
+    uint8_t* data;
+    size_t bytes;
+    int refs;                       // acquired and not yet released
+    bool dropped;                   // sffcli_cache_drop() while acquired, freed on its last release
+    struct SpriteCacheEntry* prev;  // LRU list of the shard, head = most recently used
+    struct SpriteCacheEntry* next;
+} SpriteCacheEntry;
+
+typedef struct {
+    std::mutex lock;
+    std::map<SpriteCacheKey, SpriteCacheEntry*> entries;
+    SpriteCacheEntry* head;
+    SpriteCacheEntry* tail;
+    size_t bytes;
+    size_t budget;
+    uint64_t hits, misses, evictions;
+} SpriteCacheShard;
+
+struct SffcliCache {
+    SpriteCacheShard shards[SPRITE_CACHE_SHARDS];
+};
+
+static SpriteCacheKey spriteCacheKey(const SpriteCacheEntry* e) {
+    return SpriteCacheKey(e->sff, e->pixels.sprite.group, e->pixels.sprite.number, e->palidx, e->flags);
+}
+
+static SpriteCacheShard* spriteCacheShard(SffcliCache* cache, const SffcliFile* sff, uint16_t group, uint16_t number) {
+    uint32_t h = spriteKeyHash(group, number) ^ (uint32_t) ((uintptr_t) sff >> 4);
+    return &cache->shards[(h ^ h >> 16) % SPRITE_CACHE_SHARDS];
+}
+
+static void freeSpriteCacheEntry(SpriteCacheEntry* e) {
+    free(e->data);
+    delete e;
+}
+
+static void lruUnlink(SpriteCacheShard* shard, SpriteCacheEntry* e) {
+    if (e->prev) e->prev->next = e->next; else shard->head = e->next;
+    if (e->next) e->next->prev = e->prev; else shard->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lruPushFront(SpriteCacheShard* shard, SpriteCacheEntry* e) {
+    e->prev = NULL;
+    e->next = shard->head;
+    if (shard->head) shard->head->prev = e; else shard->tail = e;
+    shard->head = e;
+}
+
+// Evict least recently used sprites that are not acquired until the shard fits its budget
+static void trimSpriteCacheShard(SpriteCacheShard* shard) {
+    SpriteCacheEntry* e = shard->tail;
+    while (e && shard->bytes > shard->budget) {
+        SpriteCacheEntry* prev = e->prev;
+        if (e->refs == 0) {
+            lruUnlink(shard, e);
+            shard->entries.erase(spriteCacheKey(e));
+            shard->bytes -= e->bytes;
+            shard->evictions++;
+            freeSpriteCacheEntry(e);
+        }
+        e = prev;
+    }
+}
+
+// Decode a sprite for the cache, outside of any lock. The full sprite decodes into a
+// buffer of the thread, the entry gets the (cropped, expanded) copy
+static SpriteCacheEntry* decodeSpriteCacheEntry(const SffcliFile* sff, int index, int palidx, int flags) {
+    static thread_local std::vector<uint8_t> scratch;
+    SffcliSprite info;
+    sffcli_sprite_info(sff, index, &info);
+    int bpp = info.bytesPerPixel;
+    size_t len = (size_t) info.width * info.height * bpp;
+    if (scratch.size() < len) scratch.resize(len);
+    if (sffcli_decode_sprite(sff, index, scratch.data(), len) != 0) return NULL;
+
+    int left = 0, top = 0, right = info.width - 1, bottom = info.height - 1;
+    if ((flags & SFFCLI_CACHE_CROP) && !cropBounds(scratch.data(), info.width, info.height, bpp, &left, &top, &right, &bottom)) {
+        left = top = 0;
+        right = bottom = -1;
+    }
+    size_t w = right - left + 1, h = bottom - top + 1;
+    // True colour sprites are RGBA already, the palette is for indexed ones
+    int outBpp = palidx >= 0 ? 4 : bpp;
+    SpriteCacheEntry* e = new SpriteCacheEntry();
+    e->bytes = w * h * outBpp;
+    e->data = (uint8_t*) malloc(e->bytes > 0 ? e->bytes : 1);
+    if (!e->data) {
+        fprintf(stderr, "Error allocating memory for cached sprite %d,%d\n", info.group, info.number);
+        delete e;
+        return NULL;
+    }
+    bool premultiplied = (flags & SFFCLI_CACHE_PREMULTIPLIED) != 0;
+    uint32_t lut[256];
+    bool expand = palidx >= 0 && bpp == 1;
+    if (expand) {
+        png_color palette[256];
+        pngPalette(sffPalette(&sff->sff, palidx), palette);
+        rgbaLut(palette, premultiplied, lut);
+    }
+    for (size_t y = 0; y < h; y++) {
+        const uint8_t* src = scratch.data() + ((top + y) * info.width + left) * bpp;
+        uint8_t* dst = e->data + y * w * outBpp;
+        if (expand) {
+            expandIndexed(src, w, lut, dst);
+            continue;
+        }
+        memcpy(dst, src, w * bpp);
+        if (bpp == 4 && premultiplied) premultiplyRgba(dst, w);
+    }
+    e->pixels.pixels = e->data;
+    e->pixels.x = (uint16_t) left;
+    e->pixels.y = (uint16_t) top;
+    e->pixels.width = (uint16_t) w;
+    e->pixels.height = (uint16_t) h;
+    e->pixels.bytesPerPixel = outBpp;
+    e->pixels.sprite = info;
+    e->sff = sff;
+    e->palidx = palidx;
+    e->flags = flags;
+    return e;
+}
+
+SffcliCache* sffcli_cache_create(size_t budget) {
+    SffcliCache* cache = new SffcliCache();
+    for (SpriteCacheShard& shard : cache->shards) {
+        shard.budget = budget / SPRITE_CACHE_SHARDS;
+    }
+    return cache;
+}
+
+void sffcli_cache_destroy(SffcliCache* cache) {
+    if (!cache) return;
+    for (SpriteCacheShard& shard : cache->shards) {
+        for (auto& pair : shard.entries) freeSpriteCacheEntry(pair.second);
+    }
+    delete cache;
+}
+
+const SffcliPixels* sffcli_cache_acquire(SffcliCache* cache, const SffcliFile* sff,
+    uint16_t group, uint16_t number, int palidx, int flags) {
+    int index = sffcli_find_sprite(sff, group, number);
+    if (index < 0) return NULL;
+    // True colour sprites have no palette to go through
+    if (isRgbaSprite(sff->sff.sprites[index]) || palidx < 0) palidx = -1;
+    if (palidx >= (int) sff->sff.palettes.size()) {
+        fprintf(stderr, "Invalid palette index %d\n", palidx);
+        return NULL;
+    }
+    flags &= SFFCLI_CACHE_CROP | SFFCLI_CACHE_PREMULTIPLIED;
+    SpriteCacheKey key(sff, group, number, palidx, flags);
+    SpriteCacheShard* shard = spriteCacheShard(cache, sff, group, number);
+    {
+        std::lock_guard<std::mutex> lock(shard->lock);
+        auto it = shard->entries.find(key);
+        if (it != shard->entries.end()) {
+            SpriteCacheEntry* e = it->second;
+            shard->hits++;
+            e->refs++;
+            lruUnlink(shard, e);
+            lruPushFront(shard, e);
+            return &e->pixels;
+        }
+        shard->misses++;
+    }
+
+    // Decoded without the lock, a thread that decoded the same sprite meanwhile wins
+    SpriteCacheEntry* e = decodeSpriteCacheEntry(sff, index, palidx, flags);
+    if (!e) return NULL;
+    std::lock_guard<std::mutex> lock(shard->lock);
+    auto it = shard->entries.find(key);
+    if (it != shard->entries.end()) {
+        freeSpriteCacheEntry(e);
+        e = it->second;
+        lruUnlink(shard, e);
+    } else {
+        shard->entries[key] = e;
+        shard->bytes += e->bytes;
+    }
+    e->refs++;
+    lruPushFront(shard, e);
+    trimSpriteCacheShard(shard);
+    return &e->pixels;
+}
+
+void sffcli_cache_release(SffcliCache* cache, const SffcliPixels* pixels) {
+    if (!pixels) return;
+    SpriteCacheEntry* e = (SpriteCacheEntry*) pixels;
+    SpriteCacheShard* shard = spriteCacheShard(cache, e->sff, e->pixels.sprite.group, e->pixels.sprite.number);
+    std::lock_guard<std::mutex> lock(shard->lock);
+    e->refs--;
+    if (e->dropped) {
+        if (e->refs == 0) freeSpriteCacheEntry(e);
+        return;
+    }
+    // Sprites held while the shard was over its budget can go now
+    if (e->refs == 0) trimSpriteCacheShard(shard);
+}
+
+void sffcli_cache_drop(SffcliCache* cache, const SffcliFile* sff) {
+    for (SpriteCacheShard& shard : cache->shards) {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+            SpriteCacheEntry* e = it->second;
+            if (e->sff != sff) {
+                ++it;
+                continue;
+            }
+            lruUnlink(&shard, e);
+            shard.bytes -= e->bytes;
+            it = shard.entries.erase(it);
+            if (e->refs == 0) {
+                freeSpriteCacheEntry(e);
+            } else {
+                e->dropped = true;
+            }
+        }
+    }
+}
+
+void sffcli_cache_stats(SffcliCache* cache, SffcliCacheStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (SpriteCacheShard& shard : cache->shards) {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        stats->hits += shard.hits;
+        stats->misses += shard.misses;
+        stats->evictions += shard.evictions;
+        stats->entries += shard.entries.size();
+        stats->bytes += shard.bytes;
+    }
+}
+
+}
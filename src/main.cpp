@@ -4,6 +4,8 @@ SFF CLI tool to extract sprites (into PNG format) and palettes (into ACT format)
 
 RELEASE BUILD: make cxx_release
 DEBUG BUILD: make cxx_debug
+TRACE BUILD: make cxx_trace
+LIBRARY BUILD: make lib (libsffcli.a and libsffcli.so, API in sffcli.h)
 */
 
 #include <stdio.h>
@@ -19,11 +21,27 @@ DEBUG BUILD: make cxx_debug
 #include <filesystem>
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <getopt.h>
 #include "png.h"
+#include "png_profile.h"
+#include "zip_writer.h"
+#include "texture_writer.h"
+#include "sff_writer.h"
+#include "../packages/physfs/physfs.h"
 #define STB_RECT_PACK_IMPLEMENTATION
 #include "stb_rect_pack.h"
 
 #ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
 #include <direct.h>
 #include <sys/stat.h>
 #define MKDIR(dir) _mkdir(dir)
@@ -33,6 +51,9 @@ DEBUG BUILD: make cxx_debug
 #else
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include <unistd.h>
 #define MKDIR(dir) mkdir(dir, 0755)
 #define STAT_STRUCT struct stat
@@ -40,7 +61,8 @@ DEBUG BUILD: make cxx_debug
 #define SEP "/"
 #endif
 
-#define MAX_PAL_NO 256
+// Size of the slabs an Arena carves its allocations from
+#define ARENA_BLOCK_SIZE (4 << 20)
 
 // Constants for the hash function
 #define PRIME 0x9E3779B1
@@ -53,34 +75,62 @@ typedef struct {
     uint32_t NumberOfPalettes;
 } SffHeader;
 
+// One entry of the sprite table, 48 bytes, every file keeps them in one array (newSprites).
+// The fields the whole-table passes read (key, size, palette, format) share the first 32 bytes
 typedef struct {
-    uint32_t palettes[MAX_PAL_NO][256];
-    int paletteMap[MAX_PAL_NO];
-    int numPalettes;
-} PaletteList;
-
-typedef struct {
-    uint32_t* Pal;
+    uint8_t* data;
+    int32_t link;           // linked sprite (size 0): index of the sprite it shares pixels with, else -1
+    int32_t palidx;
+    int32_t rle;            // SFF v2: -format; SFF v1: PCX bytes per line until decoded, then 0
     uint16_t Group;
     uint16_t Number;
     uint16_t Size[2];
     int16_t Offset[2];
-    int palidx;
-    int rle;
+    uint16_t atlas_x, atlas_y;  // top left of the visible part, what the atlas rect holds
+    uint16_t dataX, dataY;  // part of the sprite held in data, all of it unless --trim
+    uint16_t dataW, dataH;
     uint8_t coldepth;
-    uint8_t* data;
-    size_t atlas_x, atlas_y;
 } Sprite;
 
+// One slab of an Arena, the allocations follow the (padded) header
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+// Bump allocator: allocations are never freed one by one, the whole arena goes at once
 typedef struct {
+    ArenaBlock* head;
+    size_t numAllocs;
+    size_t numBlocks;
+    size_t bytesUsed;
+    size_t bytesReserved;
+} Arena;
+
+typedef struct Sff {
     SffHeader header;
     Sprite** sprites;
     char filename[256];
-    PaletteList palList;    // SFF v2
-    std::vector<png_color*> palettes;   // SFF v1
+    char basename[256];     // filename without directory and extension
+    char spritePrefix[512]; // "<output dir>/<basename>/<basename>", start of the -x file names
+    std::vector<const uint32_t*> palettes;      // colours of every palette index, held by palettePool
+    std::vector<std::array<int, 3>> paletteIds; // palettePool entry, group and number of every palette index
     std::map<int, int> palette_usage;
     std::map<int, int> format_usage;
     size_t numLinkedSprites;
+    int palidx;             // palette index of the atlas (-p, or palette of sprite 0,0)
+    FILE* out;              // where per-file messages are printed
+    Arena arena;            // sprite table
+    std::vector<Arena> pixelArenas; // decoded pixels, one arena per decode thread
+    struct EncodeQueue* encoder;    // -x: pool writing the sprite PNGs, NULL = write inline
+    ZipWriter* zip;         // -X: archive all output goes into, NULL = plain files
+    std::vector<std::array<int, 3>> actPalettes; // palette index, group and number of every distinct palette
+    std::vector<int32_t> spriteTable;   // (Group, Number) -> sprite index, see findSprite()
+    const struct CacheEntry* cached;    // --cache: entry of the previous run with the same options, or NULL
+    struct CacheEntry* cache;           // --cache: entry of this run, NULL = no cache
+    const struct Sff* resident;         // --watch: decode of the file before it changed, NULL = decode every sprite
+    std::vector<uint64_t> spriteHashes; // --watch: what the pixels of every sprite decode from, 0 = no data
 } Sff;
 
 typedef struct {
@@ -88,20 +138,284 @@ typedef struct {
     struct stbrp_rect* rects;
     Sff* sff;
     int usePalette;
+    bool rgba;          // true colour page holding the PNG11/PNG12 sprites
+    int* page;          // --max-atlas-size: page of every sprite, -1 = none
+    int numPages;
+    int* dupOf;         // sprite whose atlas rect is shared (linked or identical bitmap), -1 = own rect
+    char packing[32];   // packing strategy that won, for the report
+    struct AtlasLayout* layout; // --watch: places of the previous refresh, NULL = pack from scratch
 } Atlas;
 
-Sprite* newSprite() {
-    Sprite* sprite = (Sprite*) malloc(sizeof(Sprite));
-    memset(sprite, 0, sizeof(Sprite));
-    sprite->palidx = -1;
-    return sprite;
+// --watch: the slot every sprite of an atlas holds, kept from one refresh to the next
+typedef struct AtlasLayout {
+    std::map<std::pair<uint16_t, uint16_t>, stbrp_rect> slots;  // (Group, Number) -> place and size
+    uint64_t packedArea;    // page of the last pack from scratch, the limit a refresh may grow to
+} AtlasLayout;
+
+// Where to find the encoded pixels of a sprite, collected by the header pass
+typedef struct {
+    Sprite* sprite;
+    uint64_t offset;        // SFF v2: offset of the sprite data
+    uint32_t datasize;
+    const uint8_t* srcPx;   // SFF v1: PCX pixel data inside the input view
+    size_t srcLen;
+    uint16_t bpl;           // SFF v1: PCX bytes per line
+} SpriteJob;
+
+// Usage counters filled by one decode thread, merged into the Sff afterwards,
+// and the arena that thread carves decoded pixels from
+typedef struct {
+    std::map<int, int> palette_usage;
+    std::map<int, int> format_usage;
+    Arena* arena;
+    std::vector<uint8_t> scratch;   // --trim: decode buffer reused for every sprite
+} UsageCounters;
+
+// Read-only view of a whole input file: memory-mapped when possible,
+// otherwise loaded with stdio into a heap buffer
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    bool mapped;
+#ifdef _WIN32
+    HANDLE hFile;
+    HANDLE hMap;
+#endif
+} MappedFile;
+
+// Cursor over a MappedFile, used in place of FILE* by the parsers
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+} MemReader;
+
+// A sprite PNG waiting for the encoder pool. The pixels are handed over, not
+// copied: they stay in the pixel arena, which lives until freeSff()
+typedef struct {
+    char filename[512];
+    int width, height;
+    png_byte* data;
+    png_color palette[256];
+    bool rgba;
+} EncodeJob;
+
+// Bounded queue of EncodeJobs drained by a pool of encoder threads. A full
+// queue blocks the decode threads, so they never run far ahead of the encoders
+typedef struct EncodeQueue {
+    std::mutex lock;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<EncodeJob> jobs;
+    size_t capacity;
+    bool closed;
+    std::vector<std::thread> threads;
+} EncodeQueue;
+
+// Allocate size bytes (16-byte aligned) from the arena, NULL when out of memory
+void* arenaAlloc(Arena* arena, size_t size) {
+    const size_t header = (sizeof(ArenaBlock) + 15) & ~(size_t) 15;
+    size = (size + 15) & ~(size_t) 15;
+
+    ArenaBlock* b = arena->head;
+    if (!b || b->size - b->used < size) {
+        // Big buffers get a block of their own so the current slab keeps serving small ones
+        bool dedicated = size > ARENA_BLOCK_SIZE / 2;
+        size_t blockSize = dedicated ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock* nb = (ArenaBlock*) malloc(header + blockSize);
+        if (!nb) return NULL;
+        nb->size = blockSize;
+        nb->used = 0;
+        if (dedicated && b) {
+            nb->next = b->next;
+            b->next = nb;
+        } else {
+            nb->next = b;
+            arena->head = nb;
+        }
+        arena->numBlocks++;
+        arena->bytesReserved += blockSize;
+        b = nb;
+    }
+
+    void* p = (uint8_t*) b + header + b->used;
+    b->used += size;
+    arena->numAllocs++;
+    arena->bytesUsed += size;
+    return p;
+}
+
+// Release every block of the arena
+void arenaFree(Arena* arena) {
+    ArenaBlock* b = arena->head;
+    while (b) {
+        ArenaBlock* next = b->next;
+        free(b);
+        b = next;
+    }
+    memset(arena, 0, sizeof(Arena));
+}
+
+// Allocate the sprite table of a file as one contiguous array
+Sprite** newSprites(Arena* arena, uint32_t num) {
+    Sprite** sprites = (Sprite**) arenaAlloc(arena, num * sizeof(Sprite*));
+    Sprite* pool = (Sprite*) arenaAlloc(arena, num * sizeof(Sprite));
+    if (!sprites || !pool) return NULL;
+    memset(pool, 0, num * sizeof(Sprite));
+    for (uint32_t i = 0; i < num; i++) {
+        pool[i].palidx = -1;
+        pool[i].link = -1;
+        sprites[i] = &pool[i];
+    }
+    return sprites;
+}
+
+// Name of a sprite format code (1 is SFF v1 PCX, the others are SFF v2 formats)
+const char* formatName(int format) {
+    switch (format) {
+    case 1: return "PCX";
+    case 2: return "RLE8";
+    case 3: return "RLE5";
+    case 4: return "LZ5";
+    case 10: return "PNG10";
+    case 11: return "PNG11";
+    case 12: return "PNG12";
+    }
+    return "";
+}
+
+#ifdef SFFCLI_TRACE
+// Stage timing recorder, built with -DSFFCLI_TRACE (make cxx_trace). Every scope
+// becomes a complete event in a Chrome trace-event file written at exit
+typedef struct {
+    std::string name;
+    std::string file;
+    uint64_t ts, dur;   // microseconds
+    uint32_t tid;
+} TraceEvent;
+
+std::mutex traceLock;
+std::vector<TraceEvent> traceEvents;
+std::atomic<uint32_t> traceNextTid(1);
+const auto traceStart = std::chrono::steady_clock::now();
+thread_local const char* traceFile = "";    // SFF file the calling thread works on
+thread_local uint32_t traceTid = traceNextTid++;
+
+uint64_t traceNow() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - traceStart).count();
+}
+
+struct TraceScope {
+    std::string name;
+    uint64_t ts;
+    TraceScope(std::string n) : name(std::move(n)), ts(traceNow()) {}
+    ~TraceScope() {
+        TraceEvent e = { std::move(name), traceFile, ts, traceNow() - ts, traceTid };
+        std::lock_guard<std::mutex> lock(traceLock);
+        traceEvents.push_back(std::move(e));
+    }
+};
+
+void traceWriteString(FILE* f, const std::string& str) {
+    fputc('"', f);
+    for (char c : str) {
+        if (c == '"' || c == '\\') fputc('\\', f);
+        fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+void traceWrite() {
+    const char* filename = "sffcli_trace.json";
+    FILE* f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "Error creating trace file %s\n", filename);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(traceLock);
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < traceEvents.size(); i++) {
+        const TraceEvent& e = traceEvents[i];
+        fprintf(f, "{\"name\":");
+        traceWriteString(f, e.name);
+        fprintf(f, ",\"cat\":\"sffcli\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%u,\"args\":{\"file\":",
+            (unsigned long long) e.ts, (unsigned long long) e.dur, e.tid);
+        traceWriteString(f, e.file);
+        fprintf(f, "}}%s\n", i + 1 < traceEvents.size() ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+    fprintf(stderr, "Trace saved to %s\n", filename);
+}
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_FILE(filename) (traceFile = (filename))
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_FILE(filename)
+#endif
+
+// PNG11/PNG12 sprites are true colour and decode to RGBA instead of palette indices
+bool isRgbaSprite(const Sprite* s) {
+    return s->rle == -11 || s->rle == -12;
+}
+
+// Peak resident set size of the process in KB
+size_t peakRssKB() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return pmc.PeakWorkingSetSize / 1024;
+    }
+    return 0;
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;
+#else
+    return ru.ru_maxrss;
+#endif
+#endif
 }
 
 // Global variables for command line arguments
 bool opt_extract = false;
 bool opt_verbose = false;
 bool opt_sff_info = false;
+bool opt_atlas = true;  // false (-n): extract only, PNG sprites are not decoded
 int opt_palidx = 0;
+int opt_threads = 0;    // 0 = share the CPUs between the jobs
+int opt_jobs = 1;
+int opt_prefetch = 1;   // --prefetch: input files read ahead of the ones being processed, 0 = none
+PngProfile opt_sprite_profile = PNG_PROFILE_DEFAULT;  // -z, PNGs written by -x
+PngProfile opt_atlas_profile = PNG_PROFILE_DEFAULT;   // -Z, atlas pages
+int opt_bench = 0;      // > 0: decode benchmark with this many iterations
+int opt_encoders = 0;   // PNG encoder threads of -x, 0 = share the CPUs between the jobs
+const char* opt_outdir = NULL;  // -o, root of all output files, NULL = current directory
+int opt_max_atlas = 0;  // --max-atlas-size: largest atlas page side, 0 = one page of any size
+bool opt_bin_meta = false;  // --bin-meta: binary atlas metadata next to the .txt
+bool opt_trim = false;  // --trim: keep only the visible part of each sprite after its decode
+const char* opt_cache = NULL;    // --cache: manifest of the incremental rebuild cache
+const char* opt_golden = NULL;   // --golden: manifest of pixel and output hashes the run is checked against
+bool opt_golden_update = false;  // --golden-update: record the manifest instead of checking it
+int opt_golden_slack = 20;       // --golden-slack: percent of decode throughput a format may lose
+bool opt_palette_table = false; // --palette-table: one palette texture for all SFFs of the run
+bool opt_all_palettes = false;  // --all-palettes: an indexed atlas for every used palette index
+int opt_texture = -1;           // --texture: TextureContainer the atlas pages are also written in, -1 = none
+TextureFormat opt_texture_rgba = TEXTURE_BC7;   // --texture-rgba: format of the true colour pages
+bool opt_mips = false;          // --mips: textures carry their full mip chain
+int opt_write_sff = -1;         // --write-sff: SffPolicy of the SFF v2 copy written of every input, -1 = none
+// --rgba: indexed sprites and atlas pages expanded to RGBA8 through their palette
+enum { RGBA_STRAIGHT, RGBA_PREMULTIPLIED };
+enum { RGBA_OUTPUT_PNG, RGBA_OUTPUT_RAW, RGBA_OUTPUT_DDS };
+int opt_rgba = -1;              // --rgba: RGBA_STRAIGHT or RGBA_PREMULTIPLIED, -1 = keep indexed
+int opt_rgba_output = RGBA_OUTPUT_PNG;  // --rgba-output: file the -x sprites are written as
+bool opt_zip = false;   // -X: -x output, palettes and atlas go into one <name>.zip per SFF
+bool opt_watch = false; // --watch: stay resident and refresh the outputs of every input that changes
+bool archivesMounted = false;   // PhysFS is initialised and holds the input archives
 
 int createDirectory(const char* name) {
     STAT_STRUCT st;
@@ -127,6 +441,271 @@ int createDirectory(const char* name) {
     return 0; // Success
 }
 
+// Load the whole file with stdio, used when the file can not be mapped
+static int loadFileToMemory(MappedFile* mf, const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (len < 0) {
+        fclose(file);
+        return -1;
+    }
+    uint8_t* buffer = (uint8_t*) malloc(len > 0 ? len : 1);
+    if (!buffer) {
+        fprintf(stderr, "Error allocating memory for file %s\n", filename);
+        fclose(file);
+        return -1;
+    }
+    if (len > 0 && fread(buffer, len, 1, file) != 1) {
+        free(buffer);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    mf->data = buffer;
+    mf->size = len;
+    mf->mapped = false;
+    return 0;
+}
+
+// Inflate an SFF inside a mounted archive into a heap buffer, reading the
+// member front to back; nothing is unpacked to disk
+static int loadArchiveFile(MappedFile* mf, const char* filename) {
+    PHYSFS_File* file = PHYSFS_openRead(filename);
+    if (!file) {
+        return -1;
+    }
+    PHYSFS_sint64 len = PHYSFS_fileLength(file);
+    if (len < 0) {
+        PHYSFS_close(file);
+        return -1;
+    }
+    uint8_t* buffer = (uint8_t*) malloc(len > 0 ? len : 1);
+    if (!buffer) {
+        fprintf(stderr, "Error allocating memory for file %s\n", filename);
+        PHYSFS_close(file);
+        return -1;
+    }
+    if (PHYSFS_readBytes(file, buffer, len) != len) {
+        fprintf(stderr, "Error reading %s: %s\n", filename, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+        free(buffer);
+        PHYSFS_close(file);
+        return -1;
+    }
+    PHYSFS_close(file);
+    mf->data = buffer;
+    mf->size = len;
+    mf->mapped = false;
+    return 0;
+}
+
+// Open a file as a read-only memory view (mmap / MapViewOfFile, FILE* as fallback).
+// Names inside a mounted archive are read through PhysFS
+int openMappedFile(MappedFile* mf, const char* filename) {
+    memset(mf, 0, sizeof(MappedFile));
+    if (archivesMounted && PHYSFS_exists(filename)) {
+        return loadArchiveFile(mf, filename);
+    }
+#ifdef _WIN32
+    HANDLE hFile = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER len;
+        if (GetFileSizeEx(hFile, &len) && len.QuadPart > 0) {
+            HANDLE hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (hMap) {
+                void* p = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+                if (p) {
+                    mf->data = (const uint8_t*) p;
+                    mf->size = (size_t) len.QuadPart;
+                    mf->mapped = true;
+                    mf->hFile = hFile;
+                    mf->hMap = hMap;
+                    return 0;
+                }
+                CloseHandle(hMap);
+            }
+        }
+        CloseHandle(hFile);
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                close(fd);
+                mf->data = (const uint8_t*) p;
+                mf->size = st.st_size;
+                mf->mapped = true;
+                return 0;
+            }
+        }
+        close(fd);
+    }
+#endif
+    return loadFileToMemory(mf, filename);
+}
+
+void closeMappedFile(MappedFile* mf) {
+    if (!mf->data) return;
+    if (mf->mapped) {
+#ifdef _WIN32
+        UnmapViewOfFile(mf->data);
+        CloseHandle(mf->hMap);
+        CloseHandle(mf->hFile);
+#else
+        munmap((void*) mf->data, mf->size);
+#endif
+    } else {
+        free((void*) mf->data);
+    }
+    memset(mf, 0, sizeof(MappedFile));
+}
+
+// --prefetch: a reader thread walks the input files in order, maps each and faults
+// its pages in, at most opt_prefetch files ahead of the ones taken. The disk streams
+// the next file while the current ones decode, pack and encode, one file at a time
+// so -j does not make it seek between files
+enum { PREFETCH_QUEUED, PREFETCH_LOADING, PREFETCH_READY, PREFETCH_TAKEN };
+
+typedef struct {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<std::string> names;
+    std::vector<int> state;
+    std::vector<MappedFile> files;  // READY entries, data NULL when the open failed
+    int ready;                      // READY entries not taken yet
+    bool stop;
+    std::thread thread;
+} Prefetcher;
+
+Prefetcher prefetcher;
+
+// Bring every page of a mapped file into memory
+static void faultIn(const MappedFile* mf) {
+    if (!mf->mapped) return;
+#ifndef _WIN32
+    madvise((void*) mf->data, mf->size, MADV_WILLNEED);
+#endif
+    volatile uint8_t sink = 0;
+    for (size_t i = 0; i < mf->size; i += 4096) {
+        sink ^= mf->data[i];
+    }
+    (void) sink;
+}
+
+void prefetchWorker() {
+    Prefetcher* p = &prefetcher;
+    for (size_t i = 0; i < p->names.size(); i++) {
+        {
+            std::unique_lock<std::mutex> lock(p->lock);
+            p->cv.wait(lock, [&]() { return p->stop || p->ready < opt_prefetch; });
+            if (p->stop) return;
+            if (p->state[i] != PREFETCH_QUEUED) continue;
+            p->state[i] = PREFETCH_LOADING;
+        }
+        TRACE_SCOPE("prefetch");
+        MappedFile mf;
+        if (openMappedFile(&mf, p->names[i].c_str()) == 0) {
+            faultIn(&mf);
+        }
+        std::lock_guard<std::mutex> lock(p->lock);
+        p->files[i] = mf;
+        p->state[i] = PREFETCH_READY;
+        p->ready++;
+        p->cv.notify_all();
+    }
+}
+
+void stopPrefetch() {
+    Prefetcher* p = &prefetcher;
+    if (!p->thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(p->lock);
+        p->stop = true;
+        p->cv.notify_all();
+    }
+    p->thread.join();
+    for (size_t i = 0; i < p->names.size(); i++) {
+        if (p->state[i] == PREFETCH_READY) closeMappedFile(&p->files[i]);
+    }
+}
+
+void startPrefetch(const std::vector<std::string>& files) {
+    Prefetcher* p = &prefetcher;
+    p->names = files;
+    p->state.assign(files.size(), PREFETCH_QUEUED);
+    p->files.assign(files.size(), MappedFile());
+    p->ready = 0;
+    p->stop = false;
+    p->thread = std::thread(prefetchWorker);
+    // The thread is joined before it is destroyed, even when an error exits the run
+    atexit(stopPrefetch);
+}
+
+// Hand the prefetched view of filename over to the caller, waiting while the reader
+// thread is on it. Returns false when it has none, a file the reader did not reach yet
+// is then left to the caller
+static bool takePrefetched(MappedFile* mf, const char* filename) {
+    Prefetcher* p = &prefetcher;
+    if (!p->thread.joinable()) return false;
+    std::unique_lock<std::mutex> lock(p->lock);
+    for (size_t i = 0; i < p->names.size(); i++) {
+        if (p->names[i] != filename || p->state[i] == PREFETCH_TAKEN) continue;
+        p->cv.wait(lock, [&]() { return p->state[i] != PREFETCH_LOADING; });
+        bool ready = p->state[i] == PREFETCH_READY;
+        if (ready) p->ready--;
+        p->state[i] = PREFETCH_TAKEN;
+        *mf = p->files[i];
+        p->cv.notify_all();
+        return ready && mf->data;
+    }
+    return false;
+}
+
+// openMappedFile() that takes the view the prefetch thread made when there is one
+int openInput(MappedFile* mf, const char* filename) {
+    if (takePrefetched(mf, filename)) return 0;
+    return openMappedFile(mf, filename);
+}
+
+// An input that is skipped gives its prefetched view back
+void dropPrefetched(const char* filename) {
+    MappedFile mf;
+    if (takePrefetched(&mf, filename)) closeMappedFile(&mf);
+}
+
+// fread() equivalent for MemReader, returns the number of complete items read
+size_t mread(void* ptr, size_t size, size_t count, MemReader* r) {
+    if (size == 0 || count == 0 || r->pos >= r->size) return 0;
+    size_t avail = (r->size - r->pos) / size;
+    if (count > avail) count = avail;
+    memcpy(ptr, r->data + r->pos, size * count);
+    r->pos += size * count;
+    return count;
+}
+
+// fseek() equivalent for MemReader, seeking past the end makes the next mread fail
+int mseek(MemReader* r, long offset, int whence) {
+    if (whence == SEEK_CUR) {
+        offset += (long) r->pos;
+    }
+    if (offset < 0) return -1;
+    r->pos = (size_t) offset;
+    return 0;
+}
+
+// Pointer to 'len' bytes at the current position, or NULL if the view is too short
+const uint8_t* mpeek(MemReader* r, size_t len) {
+    if (r->pos > r->size || r->size - r->pos < len) return NULL;
+    return r->data + r->pos;
+}
+
 // Extracts basename without extension from a given path
 // The result is written into 'out', which must be at least 'out_size' bytes
 /*
@@ -176,14 +755,23 @@ void get_basename_no_ext(const char* path, char* out, size_t out_size) {
     out[len] = '\0';
 }
 
+// Path of the output file name + ext: inside the -o directory, or as it is
+void outputPath(char* out, size_t out_size, const char* name, const char* ext) {
+    if (opt_outdir) {
+        snprintf(out, out_size, "%s%s%s%s", opt_outdir, SEP, name, ext);
+    } else {
+        snprintf(out, out_size, "%s%s", name, ext);
+    }
+}
+
 #define PNG_SIG_BYTES 8
 
 // Helper to write 4-byte big-endian integer
-void write_be32(FILE* f, uint32_t val) {
-    fputc((val >> 24) & 0xFF, f);
-    fputc((val >> 16) & 0xFF, f);
-    fputc((val >> 8) & 0xFF, f);
-    fputc(val & 0xFF, f);
+void write_be32(std::vector<uint8_t>& out, uint32_t val) {
+    out.push_back((val >> 24) & 0xFF);
+    out.push_back((val >> 16) & 0xFF);
+    out.push_back((val >> 8) & 0xFF);
+    out.push_back(val & 0xFF);
 }
 
 // Helper to compute CRC (uses zlib)
@@ -192,26 +780,21 @@ uint32_t crc(const uint8_t* type_and_data, size_t len) {
 }
 
 // Write a PNG chunk
-void write_chunk(FILE* f, const char* type, const uint8_t* data, size_t length) {
-    write_be32(f, (uint32_t) length);
-    fwrite(type, 1, 4, f);
-    if (length > 0) fwrite(data, 1, length, f);
-    uint8_t* crc_buf = (uint8_t*) malloc(4 + length);
-    memcpy(crc_buf, type, 4);
-    if (length > 0) memcpy(crc_buf + 4, data, length);
-    uint32_t c = crc(crc_buf, 4 + length);
-    write_be32(f, c);
-    free(crc_buf);
+void write_chunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t length) {
+    write_be32(out, (uint32_t) length);
+    out.insert(out.end(), type, type + 4);
+    if (length > 0) out.insert(out.end(), data, data + length);
+    uint32_t c = crc((const uint8_t*) type, 4);
+    if (length > 0) c = crc32(c, data, length);
+    write_be32(out, c);
 }
 
 // Check PNG signature
-int check_png_signature(FILE* in) {
-    uint8_t sig[PNG_SIG_BYTES];
-    fread(sig, 1, PNG_SIG_BYTES, in);
+int check_png_signature(const uint8_t* sig, size_t len) {
     const uint8_t expected_sig[PNG_SIG_BYTES] = {
         137, 80, 78, 71, 13, 10, 26, 10
     };
-    return memcmp(sig, expected_sig, PNG_SIG_BYTES) == 0;
+    return len >= PNG_SIG_BYTES && memcmp(sig, expected_sig, PNG_SIG_BYTES) == 0;
 }
 
 // Convert PNG Palette format into SFF v2 Palette
@@ -244,6 +827,113 @@ uint32_t fast_hash_v2(const uint32_t* data, size_t len) {
     return h;
 }
 
+// Every distinct palette of the run is stored once: identical palettes of one SFF and
+// of different SFFs share the entry. Colours are 0x00BBGGRR, as SFF v2 stores them
+// with the unused fourth byte cleared
+typedef struct {
+    std::deque<std::array<uint32_t, 256>> colors;   // a deque, entries never move
+    std::multimap<uint32_t, int> byHash;            // fast_hash_v2() of the colours -> entry
+    std::mutex lock;                                // -j indexes several SFFs at once
+} PalettePool;
+
+PalettePool palettePool;
+
+// The pool's copy of these colours, added when new; *entry is its index in the pool
+const uint32_t* poolPalette(const uint32_t colors[256], int* entry) {
+    uint32_t h = fast_hash_v2(colors, 256);
+    std::lock_guard<std::mutex> lock(palettePool.lock);
+    auto range = palettePool.byHash.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+        const uint32_t* c = palettePool.colors[it->second].data();
+        if (memcmp(c, colors, 256 * sizeof(uint32_t)) == 0) {
+            *entry = it->second;
+            return c;
+        }
+    }
+    *entry = (int) palettePool.colors.size();
+    palettePool.colors.emplace_back();
+    memcpy(palettePool.colors.back().data(), colors, 256 * sizeof(uint32_t));
+    palettePool.byHash.emplace(h, *entry);
+    return palettePool.colors.back().data();
+}
+
+// Give the next palette index of the SFF these colours, returns that index
+int addSffPalette(Sff* sff, const uint32_t colors[256], int group, int number) {
+    int entry;
+    sff->palettes.push_back(poolPalette(colors, &entry));
+    sff->paletteIds.push_back({ entry, group, number });
+    return (int) sff->palettes.size() - 1;
+}
+
+// Colours of a palette index, all black for an index the SFF has no palette for
+const uint32_t* sffPalette(const Sff* sff, int palidx) {
+    static const uint32_t none[256] = {};
+    if (palidx < 0 || (size_t) palidx >= sff->palettes.size()) return none;
+    return sff->palettes[palidx];
+}
+
+// Append a palette as one 256 x 1 RGBA image row, colour 0 transparent
+void appendPaletteRow(std::vector<uint8_t>& image, const uint32_t* colors) {
+    for (int i = 0; i < 256; i++) {
+        image.push_back((colors[i] >> 0) & 0xFF);
+        image.push_back((colors[i] >> 8) & 0xFF);
+        image.push_back((colors[i] >> 16) & 0xFF);
+        image.push_back(i == 0 ? 0 : 255);
+    }
+}
+
+void pngPalette(const uint32_t* colors, png_color out[256]) {
+    for (int i = 0; i < 256; i++) {
+        out[i].red = (colors[i] >> 0) & 0xFF;
+        out[i].green = (colors[i] >> 8) & 0xFF;
+        out[i].blue = (colors[i] >> 16) & 0xFF;
+    }
+}
+
+// A palette as the RGBA8 pixel of each index, colour 0 transparent as in the PNGs. The
+// premultiplied one has colour 0 black, all the other colours are opaque anyway
+void rgbaLut(const png_color palette[256], bool premultiplied, uint32_t lut[256]) {
+    for (int i = 0; i < 256; i++) {
+        uint8_t px[4] = { palette[i].red, palette[i].green, palette[i].blue, (uint8_t) (i == 0 ? 0 : 255) };
+        if (i == 0 && premultiplied) px[0] = px[1] = px[2] = 0;
+        memcpy(&lut[i], px, 4);
+    }
+}
+
+// Expand n palette indices to RGBA8 through lut. One lookup per pixel, 4 pixels go out
+// in one 16 byte store
+void expandIndexed(const uint8_t* src, size_t n, const uint32_t lut[256], uint8_t* dst) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        uint32_t q[4] = { lut[src[i]], lut[src[i + 1]], lut[src[i + 2]], lut[src[i + 3]] };
+        memcpy(dst + i * 4, q, 16);
+    }
+    for (; i < n; i++) memcpy(dst + i * 4, &lut[src[i]], 4);
+}
+
+// Multiply the colour of n RGBA8 pixels by their alpha, opaque pixels are left as they are
+void premultiplyRgba(uint8_t* px, size_t n) {
+    for (size_t i = 0; i < n; i++, px += 4) {
+        unsigned a = px[3];
+        if (a == 255) continue;
+        px[0] = (uint8_t) ((px[0] * a + 127) / 255);
+        px[1] = (uint8_t) ((px[1] * a + 127) / 255);
+        px[2] = (uint8_t) ((px[2] * a + 127) / 255);
+    }
+}
+
+// 64-bit FNV-1a, h carries the state to hash a region row by row
+#define FNV1A_64_INIT 0xcbf29ce484222325ULL
+
+uint64_t fnv1a_64(const void* data, size_t len, uint64_t h) {
+    const uint8_t* p = (const uint8_t*) data;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
 // Save SFF v2 (format) Palette in ACT format
 void saveSffPalette(uint32_t* palette, const char* filename) {
     FILE* file = fopen(filename, "wb");
@@ -279,88 +969,89 @@ void saveSffPalette_txt(uint32_t* palette, const char* filename) {
     fclose(file);
 }
 
-int readSffHeader(Sff* sff, FILE* file, uint32_t* lofs, uint32_t* tofs) {
+int readSffHeader(Sff* sff, MemReader* file, uint32_t* lofs, uint32_t* tofs) {
+    TRACE_SCOPE("header");
 
     // Validate header by comparing 12 first bytes with "ElecbyteSpr\x0"
-    char headerCheck[12];
-    fread(headerCheck, 12, 1, file);
-    if (memcmp(headerCheck, "ElecbyteSpr\0", 12) != 0) {
-        fprintf(stderr, "Invalid SFF file [%s]\n", headerCheck);
+    // The signature is not NUL terminated, and missing from a file that is too short
+    char headerCheck[12] = {};
+    if (mread(headerCheck, 12, 1, file) != 1 || memcmp(headerCheck, "ElecbyteSpr\0", 12) != 0) {
+        fprintf(stderr, "Invalid SFF file [%.12s]\n", headerCheck);
         return -1;
     }
 
     // Read versions in the header
-    if (fread(&sff->header.Ver3, 1, 1, file) != 1) {
+    if (mread(&sff->header.Ver3, 1, 1, file) != 1) {
         fprintf(stderr, "Error reading version\n");
         return -1;
     }
-    if (fread(&sff->header.Ver2, 1, 1, file) != 1) {
+    if (mread(&sff->header.Ver2, 1, 1, file) != 1) {
         fprintf(stderr, "Error reading version\n");
         return -1;
     }
-    if (fread(&sff->header.Ver1, 1, 1, file) != 1) {
+    if (mread(&sff->header.Ver1, 1, 1, file) != 1) {
         fprintf(stderr, "Error reading version\n");
         return -1;
     }
-    if (fread(&sff->header.Ver0, 1, 1, file) != 1) {
+    if (mread(&sff->header.Ver0, 1, 1, file) != 1) {
         fprintf(stderr, "Error reading version\n");
         return -1;
     }
     uint32_t dummy;
-    if (fread(&dummy, sizeof(uint32_t), 1, file) != 1) {
+    if (mread(&dummy, sizeof(uint32_t), 1, file) != 1) {
         fprintf(stderr, "Error reading dummy\n");
         return -1;
     }
 
     if (sff->header.Ver0 == 2) {
         for (int i = 0; i < 4; i++) {
-            if (fread(&dummy, sizeof(uint32_t), 1, file) != 1) {
+            if (mread(&dummy, sizeof(uint32_t), 1, file) != 1) {
                 fprintf(stderr, "Error reading dummy\n");
                 return -1;
             }
         }
         // read FirstSpriteHeaderOffset
-        if (fread(&sff->header.FirstSpriteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
+        if (mread(&sff->header.FirstSpriteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
             fprintf(stderr, "Error reading FirstSpriteHeaderOffset\n");
             return -1;
         }
         // read NumberOfSprites
-        if (fread(&sff->header.NumberOfSprites, sizeof(uint32_t), 1, file) != 1) {
+        if (mread(&sff->header.NumberOfSprites, sizeof(uint32_t), 1, file) != 1) {
             fprintf(stderr, "Error reading NumberOfSprites\n");
             return -1;
         }
         // read FirstPaletteHeaderOffset
-        if (fread(&sff->header.FirstPaletteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
+        if (mread(&sff->header.FirstPaletteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
             fprintf(stderr, "Error reading FirstPaletteHeaderOffset\n");
             return -1;
         }
         // read NumberOfPalettes
-        if (fread(&sff->header.NumberOfPalettes, sizeof(uint32_t), 1, file) != 1) {
+        if (mread(&sff->header.NumberOfPalettes, sizeof(uint32_t), 1, file) != 1) {
             fprintf(stderr, "Error reading NumberOfPalettes\n");
             return -1;
         }
         // read lofs
-        if (fread(lofs, sizeof(uint32_t), 1, file) != 1) {
+        if (mread(lofs, sizeof(uint32_t), 1, file) != 1) {
             fprintf(stderr, "Error reading lofs\n");
             return -1;
         }
-        if (fread(&dummy, sizeof(uint32_t), 1, file) != 1) {
+        if (mread(&dummy, sizeof(uint32_t), 1, file) != 1) {
             fprintf(stderr, "Error reading dummy\n");
             return -1;
         }
         // read tofs
-        if (fread(tofs, sizeof(uint32_t), 1, file) != 1) {
+        if (mread(tofs, sizeof(uint32_t), 1, file) != 1) {
             fprintf(stderr, "Error reading tofs\n");
             return -1;
         }
     } else if (sff->header.Ver0 == 1) {
         // read NumberOfSprites
-        if (fread(&sff->header.NumberOfSprites, sizeof(uint32_t), 1, file) != 1) {
+        if (mread(&sff->header.NumberOfSprites, sizeof(uint32_t), 1, file) != 1) {
             fprintf(stderr, "Error reading NumberOfSprites\n");
             return -1;
         }
         // read FirstSpriteHeaderOffset
-        if (fread(&sff->header.FirstSpriteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
+        if (mread(&sff->header.FirstSpriteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
             fprintf(stderr, "Error reading FirstSpriteHeaderOffset\n");
             return -1;
         }
@@ -376,36 +1067,36 @@ int readSffHeader(Sff* sff, FILE* file, uint32_t* lofs, uint32_t* tofs) {
     return 0;
 }
 
-int readSpriteHeaderV1(Sprite* sprite, FILE* file, uint32_t* ofs, uint32_t* size, uint16_t* link) {
+int readSpriteHeaderV1(Sprite* sprite, MemReader* file, uint32_t* ofs, uint32_t* size, uint16_t* link) {
     // Read ofs
-    if (fread(ofs, sizeof(uint32_t), 1, file) != 1) {
+    if (mread(ofs, sizeof(uint32_t), 1, file) != 1) {
         fprintf(stderr, "Error reading ofs\n");
         return -1;
     }
     // Read size
-    if (fread(size, sizeof(uint32_t), 1, file) != 1) {
+    if (mread(size, sizeof(uint32_t), 1, file) != 1) {
         fprintf(stderr, "Error reading size\n");
         return -1;
     }
-    if (fread(&sprite->Offset[0], sizeof(int16_t), 1, file) != 1) {
+    if (mread(&sprite->Offset[0], sizeof(int16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite offset\n");
         return -1;
     }
-    if (fread(&sprite->Offset[1], sizeof(int16_t), 1, file) != 1) {
+    if (mread(&sprite->Offset[1], sizeof(int16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite offset\n");
         return -1;
     }
     // Read sprite header
-    if (fread(&sprite->Group, sizeof(int16_t), 1, file) != 1) {
+    if (mread(&sprite->Group, sizeof(int16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite group\n");
         return -1;
     }
-    if (fread(&sprite->Number, sizeof(int16_t), 1, file) != 1) {
+    if (mread(&sprite->Number, sizeof(int16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite number\n");
         return -1;
     }
     // Read the link to the next sprite header
-    if (fread(link, sizeof(uint16_t), 1, file) != 1) {
+    if (mread(link, sizeof(uint16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite link\n");
         return -1;
     }
@@ -414,67 +1105,67 @@ int readSpriteHeaderV1(Sprite* sprite, FILE* file, uint32_t* ofs, uint32_t* size
     return 0;
 }
 
-int readSpriteHeaderV2(Sprite* sprite, FILE* file, uint32_t* ofs, uint32_t* size, uint32_t lofs, uint32_t tofs, uint16_t* link) {
+int readSpriteHeaderV2(Sprite* sprite, MemReader* file, uint32_t* ofs, uint32_t* size, uint32_t lofs, uint32_t tofs, uint16_t* link) {
     // Read sprite header
-    if (fread(&sprite->Group, sizeof(int16_t), 1, file) != 1) {
+    if (mread(&sprite->Group, sizeof(int16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite group\n");
         return -1;
     }
-    if (fread(&sprite->Number, sizeof(int16_t), 1, file) != 1) {
+    if (mread(&sprite->Number, sizeof(int16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite number\n");
         return -1;
     }
-    if (fread(&sprite->Size[0], sizeof(int16_t), 1, file) != 1) {
+    if (mread(&sprite->Size[0], sizeof(int16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite size\n");
         return -1;
     }
-    if (fread(&sprite->Size[1], sizeof(int16_t), 1, file) != 1) {
+    if (mread(&sprite->Size[1], sizeof(int16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite size\n");
         return -1;
     }
-    if (fread(&sprite->Offset[0], sizeof(int16_t), 1, file) != 1) {
+    if (mread(&sprite->Offset[0], sizeof(int16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite offset\n");
         return -1;
     }
-    if (fread(&sprite->Offset[1], sizeof(int16_t), 1, file) != 1) {
+    if (mread(&sprite->Offset[1], sizeof(int16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite offset\n");
         return -1;
     }
     // Read the link to the next sprite header
-    if (fread(link, sizeof(uint16_t), 1, file) != 1) {
+    if (mread(link, sizeof(uint16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite link\n");
         return -1;
     }
     char format;
-    if (fread(&format, sizeof(char), 1, file) != 1) {
+    if (mread(&format, sizeof(char), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite format\n");
         return -1;
     }
     sprite->rle = -format;
     // Read color depth
-    if (fread(&sprite->coldepth, sizeof(uint8_t), 1, file) != 1) {
+    if (mread(&sprite->coldepth, sizeof(uint8_t), 1, file) != 1) {
         fprintf(stderr, "Error reading color depth\n");
         return -1;
     }
     // Read ofs
-    if (fread(ofs, sizeof(uint32_t), 1, file) != 1) {
+    if (mread(ofs, sizeof(uint32_t), 1, file) != 1) {
         fprintf(stderr, "Error reading ofs\n");
         return -1;
     }
     // Read size
-    if (fread(size, sizeof(uint32_t), 1, file) != 1) {
+    if (mread(size, sizeof(uint32_t), 1, file) != 1) {
         fprintf(stderr, "Error reading size\n");
         return -1;
     }
     uint16_t tmp;
     // Read tmp
-    if (fread(&tmp, sizeof(uint16_t), 1, file) != 1) {
+    if (mread(&tmp, sizeof(uint16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading tmp\n");
         return -1;
     }
     sprite->palidx = tmp;
     // Read tmp
-    if (fread(&tmp, sizeof(uint16_t), 1, file) != 1) {
+    if (mread(&tmp, sizeof(uint16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading tmp\n");
         return -1;
     }
@@ -494,19 +1185,12 @@ int readSpriteHeaderV2(Sprite* sprite, FILE* file, uint32_t* ofs, uint32_t* size
     return 0;
 }
 
-uint8_t* TestDecode(Sprite* s, uint8_t* srcPx, size_t srcLen) {
+uint8_t* TestDecode(Sprite* s, const uint8_t* srcPx, size_t srcLen, uint8_t* dstPx) {
     if (srcLen == 0) {
         fprintf(stderr, "Warning LZ5 data length is zero\n");
         return NULL;
     }
 
-    int dstLen = s->Size[0] * s->Size[1];
-    uint8_t* dstPx = (uint8_t*) malloc(dstLen);
-    if (!dstPx) {
-        fprintf(stderr, "Error allocating memory for LZ5 decoded data\n");
-        return NULL;
-    }
-
     for (int y = 0; y < s->Size[1]; y++) {
         uint8_t col = 24 + rand() % 5;
         for (int x = 0; x < s->Size[0]; x++) {
@@ -517,200 +1201,288 @@ uint8_t* TestDecode(Sprite* s, uint8_t* srcPx, size_t srcLen) {
     return dstPx;
 }
 
-uint8_t* Lz5Decode(Sprite* s, uint8_t* srcPx, size_t srcLen) {
+// Copy an LZ5 back-reference of count bytes at distance d to dstPx + j. Overlapping
+// copies repeat the last d bytes, references before the buffer start read as 0
+static inline void lz5CopyMatch(uint8_t* dstPx, size_t j, size_t d, size_t count) {
+    if (d > j) {
+        size_t z = std::min(count, d - j);
+        memset(dstPx + j, 0, z);
+        j += z;
+        count -= z;
+    }
+    uint8_t* dst = dstPx + j;
+    const uint8_t* src = dst - d;
+    if (d == 1) {
+        memset(dst, src[0], count);
+        return;
+    }
+    size_t k = 0;
+    if (d >= 16) {
+        for (; k + 16 <= count; k += 16) memcpy(dst + k, src + k, 16);
+    }
+    if (d >= 8) {
+        for (; k + 8 <= count; k += 8) memcpy(dst + k, src + k, 8);
+    }
+    for (; k < count; k++) dst[k] = src[k];
+}
+
+// The decoders below read srcLen bytes at most and write dstPx only inside the
+// Size[0] x Size[1] sprite. Data that ends before the sprite is full ends the
+// decode, token cut short included, and the pixels it does not reach are 0
+
+uint8_t* Lz5Decode(Sprite* s, const uint8_t* srcPx, size_t srcLen, uint8_t* dstPx) {
     if (srcLen == 0) {
         fprintf(stderr, "Warning LZ5 data length is zero\n");
         return NULL;
     }
 
-    int dstLen = s->Size[0] * s->Size[1];
-    uint8_t* dstPx = (uint8_t*) malloc(dstLen);
-    if (!dstPx) {
-        fprintf(stderr, "Error allocating memory for LZ5 decoded data\n");
-        return NULL;
-    }
+    size_t dstLen = (size_t) s->Size[0] * s->Size[1];
 
     // Decode the LZ5 data
-    long i = 0, j = 0, n = 0;
-    uint8_t ct = srcPx[i], cts = 0, rb = 0, rbc = 0;
-    if (i < srcLen - 1) {
-        i++;
-    }
-
-    while (j < dstLen) {
-        int d = (int) srcPx[i];
-        if (i < srcLen - 1) {
-            i++;
-        }
-
+    size_t i = 1, j = 0, n = 0;
+    uint8_t ct = srcPx[0], cts = 0, rb = 0, rbc = 0;
+
+    // Fast path: a token reads at most 4 bytes (long back-reference plus the next
+    // control byte), so while that many are left no read needs a bounds check.
+    // Runs are clamped to the output once per token
+    while (j < dstLen && i + 4 <= srcLen) {
+        size_t d = srcPx[i++];
         if (ct & (1 << cts)) {
             if ((d & 0x3f) == 0) {
-                d = (d << 2 | (int) srcPx[i]) + 1;
-                if (i < srcLen - 1) {
-                    i++;
-                }
-                n = (int) srcPx[i] + 2;
-                if (i < srcLen - 1) {
-                    i++;
-                }
+                d = (d << 2 | srcPx[i++]) + 1;
+                n = (size_t) srcPx[i++] + 2;
             } else {
                 rb |= (uint8_t) ((d & 0xc0) >> rbc);
                 rbc += 2;
-                n = (int) (d & 0x3f);
+                n = d & 0x3f;
                 if (rbc < 8) {
-                    d = (int) srcPx[i] + 1;
-                    if (i < srcLen - 1) {
-                        i++;
-                    }
+                    d = (size_t) srcPx[i++] + 1;
                 } else {
-                    d = (int) rb + 1;
+                    d = (size_t) rb + 1;
                     rb = rbc = 0;
                 }
             }
-            for (;;) {
-                if (j < dstLen) {
-                    dstPx[j] = dstPx[j - d];
-                    j++;
-                }
-                n--;
-                if (n < 0) {
-                    break;
+            n = std::min(n + 1, dstLen - j);
+            lz5CopyMatch(dstPx, j, d, n);
+            j += n;
+        } else {
+            if ((d & 0xe0) == 0) {
+                n = (size_t) srcPx[i++] + 8;
+            } else {
+                n = d >> 5;
+                d &= 0x1f;
+            }
+            n = std::min(n, dstLen - j);
+            memset(dstPx + j, (int) d, n);
+            j += n;
+        }
+        cts++;
+        if (cts >= 8) {
+            ct = srcPx[i++];
+            cts = 0;
+        }
+    }
+
+    // Tail: the last bytes, each token checks once that its bytes are there
+    while (j < dstLen && i < srcLen) {
+        size_t d = srcPx[i++];
+        if (ct & (1 << cts)) {
+            if ((d & 0x3f) == 0) {
+                if (srcLen - i < 2) break;
+                d = (d << 2 | srcPx[i++]) + 1;
+                n = (size_t) srcPx[i++] + 2;
+            } else {
+                rb |= (uint8_t) ((d & 0xc0) >> rbc);
+                rbc += 2;
+                n = d & 0x3f;
+                if (rbc < 8) {
+                    if (i == srcLen) break;
+                    d = (size_t) srcPx[i++] + 1;
+                } else {
+                    d = (size_t) rb + 1;
+                    rb = rbc = 0;
                 }
             }
+            n = std::min(n + 1, dstLen - j);
+            lz5CopyMatch(dstPx, j, d, n);
+            j += n;
         } else {
             if ((d & 0xe0) == 0) {
-                n = (int) srcPx[i] + 8;
-                if (i < srcLen - 1) {
-                    i++;
-                }
+                if (i == srcLen) break;
+                n = (size_t) srcPx[i++] + 8;
             } else {
                 n = d >> 5;
                 d &= 0x1f;
             }
-            while (n-- > 0 && j < dstLen) {
-                dstPx[j] = (uint8_t) d;
-                j++;
-            }
+            n = std::min(n, dstLen - j);
+            memset(dstPx + j, (int) d, n);
+            j += n;
         }
         cts++;
         if (cts >= 8) {
-            ct = srcPx[i];
+            if (i == srcLen) break;
+            ct = srcPx[i++];
             cts = 0;
-            if (i < srcLen - 1) {
-                i++;
-            }
         }
     }
+    memset(dstPx + j, 0, dstLen - j);
 
     return dstPx;
 }
 
-uint8_t* Rle8Decode(Sprite* s, uint8_t* srcPx, int srcLen) {
+// Append a run of n pixels of colour c at dstPx + *j, clamped to the output once.
+// memset picks the widest stores the CPU supports at run time
+static inline void fillRun(uint8_t* dstPx, size_t* j, size_t dstLen, uint8_t c, size_t n) {
+    if (n > dstLen - *j) n = dstLen - *j;
+    if (n == 1) {
+        dstPx[*j] = c;
+    } else {
+        memset(dstPx + *j, c, n);
+    }
+    *j += n;
+}
+
+uint8_t* Rle8Decode(Sprite* s, const uint8_t* srcPx, size_t srcLen, uint8_t* dstPx) {
     if (srcLen == 0) {
         fprintf(stderr, "Warning RLE8 data length is zero\n");
         return NULL;
     }
 
-    size_t dstLen = s->Size[0] * s->Size[1];
-    uint8_t* dstPx = (uint8_t*) malloc(dstLen);
-    if (!dstPx) {
-        fprintf(stderr, "Error allocating memory for RLE decoded data\n");
-        return NULL;
-    }
-    long i = 0, j = 0;
-    // Decode the RLE data
-    while (j < dstLen) {
-        long n = 1;
-        uint8_t d = srcPx[i];
-        if (i < (srcLen - 1)) {
-            i++;
-        }
+    size_t dstLen = (size_t) s->Size[0] * s->Size[1];
+    size_t i = 0, j = 0;
+    // Decode the RLE data, a token is a pixel or a run header and its colour
+    while (j < dstLen && i < srcLen) {
+        size_t n = 1;
+        uint8_t d = srcPx[i++];
         if ((d & 0xc0) == 0x40) {
+            if (i == srcLen) break;
             n = d & 0x3f;
-            d = srcPx[i];
-            if (i < (srcLen - 1)) {
-                i++;
-            }
-        }
-        for (; n > 0; n--) {
-            if (j < dstLen) {
-                dstPx[j] = d;
-                j++;
-            }
+            d = srcPx[i++];
         }
+        fillRun(dstPx, &j, dstLen, d, n);
     }
+    memset(dstPx + j, 0, dstLen - j);
     return dstPx;
 }
 
-uint8_t* Rle5Decode(Sprite* s, uint8_t* srcPx, size_t srcLen) {
+uint8_t* Rle5Decode(Sprite* s, const uint8_t* srcPx, size_t srcLen, uint8_t* dstPx) {
     if (srcLen == 0) {
         fprintf(stderr, "Warning RLE5 data length is zero\n");
         return NULL;
     }
 
-    int dstLen = s->Size[0] * s->Size[1];
-    uint8_t* dstPx = (uint8_t*) malloc(dstLen);
-    if (!dstPx) {
-        fprintf(stderr, "Error allocating memory for RLE decoded data\n");
-        return NULL;
-    }
+    size_t dstLen = (size_t) s->Size[0] * s->Size[1];
 
     size_t i = 0, j = 0;
-    while (j < dstLen) {
-        int rl = (int) srcPx[i];
-        if (i < srcLen - 1) {
-            i++;
-        }
-        int dl = (int) (srcPx[i] & 0x7f);
+    while (j < dstLen && srcLen - i >= 2) {
+        // Run length - 1, literal count and the run colour if it is not 0
+        size_t rl = srcPx[i];
+        size_t dl = srcPx[i + 1] & 0x7f;
         uint8_t c = 0;
-        if (srcPx[i] >> 7 != 0) {
-            if (i < srcLen - 1) {
-                i++;
-            }
-            c = srcPx[i];
-        }
-        if (i < srcLen - 1) {
-            i++;
+        if (srcPx[i + 1] >> 7 != 0) {
+            if (srcLen - i < 3) break;
+            c = srcPx[i + 2];
+            i += 3;
+        } else {
+            i += 2;
         }
-        while (1) {
-            if (j < dstLen) {
-                dstPx[j] = c;
-                j++;
-            }
-            rl--;
-            if (rl < 0) {
-                dl--;
-                if (dl < 0) {
-                    break;
-                }
-                c = srcPx[i] & 0x1f;
-                rl = (int) (srcPx[i] >> 5);
-                if (i < srcLen - 1) {
-                    i++;
-                }
+        fillRun(dstPx, &j, dstLen, c, rl + 1);
+
+        // dl packed literals: 3-bit run length - 1 and 5-bit colour, as many as the
+        // data holds. With room for a whole 8-byte store the run is written at once,
+        // the next run overwrites whatever it wrote past its end
+        size_t end = i + std::min(dl, srcLen - i);
+        for (; i < end; i++) {
+            c = srcPx[i] & 0x1f;
+            rl = srcPx[i] >> 5;
+            if (dstLen - j >= 8) {
+                uint64_t v = c * 0x0101010101010101ULL;
+                memcpy(dstPx + j, &v, 8);
+                j += rl + 1;
+            } else {
+                fillRun(dstPx, &j, dstLen, c, rl + 1);
             }
         }
     }
+    memset(dstPx + j, 0, dstLen - j);
 
     return dstPx;
 }
 
 
-// Decode PNG data from FILE
-uint8_t* Indexed_PngDecode(Sprite* s, FILE* fp) {
-    // Check PNG signature
-    uint8_t header[8];
-    fread(header, 1, 8, fp);
-    if (png_sig_cmp(header, 0, 8)) {
-        fprintf(stderr, "Error: File not a valid PNG\n");
-        return NULL;
-    }
+// Read cursor handed to libpng when decoding from memory
+typedef struct {
+    const uint8_t* ptr;
+    const uint8_t* end;
+} PngMemoryReader;
+
+// Custom read function for libpng to read from memory
+void png_memory_read(png_structp png_ptr, png_bytep out_bytes, png_size_t byte_count_to_read) {
+    PngMemoryReader* io = (PngMemoryReader*) png_get_io_ptr(png_ptr);
+    if ((size_t) (io->end - io->ptr) < byte_count_to_read) {
+        png_longjmp(png_ptr, 1); // Read beyond end of PNG data
+    }
+    memcpy(out_bytes, io->ptr, byte_count_to_read);
+    io->ptr += byte_count_to_read;
+}
+
+// libpng memory of the PNG decoders comes from a per-thread block reused for every
+// sprite, freeing into it is a no-op. What does not fit falls back to malloc, and the
+// block grows to what the sprite wanted before the next one, so once warm a decode
+// makes no heap allocation
+typedef struct {
+    std::vector<uint8_t> block;
+    size_t used;
+    size_t wanted;      // bytes requested by the current decode
+} PngScratch;
+
+static thread_local PngScratch pngScratch;
+
+static png_voidp png_scratch_malloc(png_structp png_ptr, png_alloc_size_t size) {
+    PngScratch* sc = (PngScratch*) png_get_mem_ptr(png_ptr);
+    size = (size + 15) & ~(png_alloc_size_t) 15;
+    sc->wanted += size;
+    if (sc->block.size() - sc->used >= size) {
+        png_voidp p = sc->block.data() + sc->used;
+        sc->used += size;
+        return p;
+    }
+    return malloc(size);
+}
+
+static void png_scratch_free(png_structp png_ptr, png_voidp ptr) {
+    PngScratch* sc = (PngScratch*) png_get_mem_ptr(png_ptr);
+    const uint8_t* p = (const uint8_t*) ptr;
+    if (p >= sc->block.data() && p < sc->block.data() + sc->block.size()) return;
+    free(ptr);
+}
+
+// png_create_read_struct() drawing from this thread's scratch block
+static png_structp createPngReader() {
+    PngScratch* sc = &pngScratch;
+    if (sc->wanted > sc->block.size()) sc->block.resize(sc->wanted);
+    sc->used = 0;
+    sc->wanted = 0;
+    return png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, sc, png_scratch_malloc, png_scratch_free);
+}
+
+// Decode PNG data from memory srcPx into dstPx, which holds Size[0] x Size[1] pixels
+uint8_t* Indexed_PngDecode_FromMemory(Sprite* s, const uint8_t* srcPx, size_t srcLen, uint8_t* dstPx) {
+    if (srcPx == NULL || srcLen < 8) {
+        fprintf(stderr, "Error: Invalid PNG buffer\n");
+        return NULL;
+    }
+
+    // Check PNG signature
+    if (png_sig_cmp(srcPx, 0, 8)) {
+        fprintf(stderr, "Error: Buffer is not a valid PNG\n");
+        return NULL;
+    }
 
     // Initialize libpng structures
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_structp png = createPngReader();
     if (!png) {
         fprintf(stderr, "Error: Failed to create png read struct\n");
-        fclose(fp);
         return NULL;
     }
 
@@ -718,22 +1490,22 @@ uint8_t* Indexed_PngDecode(Sprite* s, FILE* fp) {
     if (!info) {
         fprintf(stderr, "Error: Failed to create png info struct\n");
         png_destroy_read_struct(&png, NULL, NULL);
-        fclose(fp);
         return NULL;
     }
 
     if (setjmp(png_jmpbuf(png))) {
         fprintf(stderr, "Error: Failed during PNG read\n");
         png_destroy_read_struct(&png, &info, NULL);
-        fclose(fp);
         return NULL;
     }
 
-    png_init_io(png, fp);
-    png_set_sig_bytes(png, 8);
+    // Set up custom read function
+    PngMemoryReader io = { srcPx, srcPx + srcLen };
+    png_set_read_fn(png, &io, png_memory_read);
 
     // Read PNG info
     png_read_info(png, info);
+
     auto width = png_get_image_width(png, info);
     auto height = png_get_image_height(png, info);
     auto color_type = png_get_color_type(png, info);
@@ -747,243 +1519,653 @@ uint8_t* Indexed_PngDecode(Sprite* s, FILE* fp) {
         return NULL;
     }
 
-    size_t dstLen = width * height;
-    uint8_t* dstPx = (uint8_t*) malloc(dstLen);
-    if (!dstPx) {
-        fprintf(stderr, "Error allocating memory for PNG decoded data\n");
+    if (width != s->Size[0] || height != s->Size[1]) {
+        fprintf(stderr, "Error: PNG size %ux%u does not match sprite size %ux%u\n", width, height, s->Size[0], s->Size[1]);
         png_destroy_read_struct(&png, &info, NULL);
         return NULL;
     }
 
-    // Read image data
-    png_bytep* row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
-    for (int y = 0; y < height; y++) {
-        row_pointers[y] = dstPx + y * row_bytes;
+    // Read image data row by row, interlaced images take several passes
+    int passes = png_set_interlace_handling(png);
+    for (int pass = 0; pass < passes; pass++) {
+        for (png_uint_32 y = 0; y < height; y++) {
+            png_read_row(png, dstPx + y * row_bytes, NULL);
+        }
     }
-    png_read_image(png, row_pointers);
 
     // Clean up
-    free(row_pointers);
     png_destroy_read_struct(&png, &info, NULL);
 
     return dstPx;
 }
 
-// Custom read function for libpng to read from memory
-void png_memory_read(png_structp png_ptr, png_bytep out_bytes, png_size_t byte_count_to_read) {
-    png_bytep* io_ptr = (png_bytep*) png_get_io_ptr(png_ptr);
-    memcpy(out_bytes, *io_ptr, byte_count_to_read);
-    *io_ptr += byte_count_to_read;
-}
-
-// Decode PNG data from memory srcPx
-uint8_t* Indexed_PngDecode_FromMemory(Sprite* s, uint8_t* srcPx, size_t srcLen) {
-    if (srcPx == NULL || srcLen < 8) {
-        fprintf(stderr, "Error: Invalid PNG buffer\n");
-        return NULL;
-    }
-
-    // Check PNG signature
-    if (png_sig_cmp(srcPx, 0, 8)) {
+// Decode a true colour PNG (PNG11/PNG12) from memory srcPx into dstPx as 8-bit RGBA,
+// Size[0] x Size[1] x 4 bytes. Rows are read straight into dstPx and expanded in place
+// from the right, the bundled libpng is built without read transforms
+uint8_t* RGBA_PngDecode(Sprite* s, const uint8_t* srcPx, size_t srcLen, uint8_t* dstPx) {
+    if (srcPx == NULL || srcLen < 8 || png_sig_cmp(srcPx, 0, 8)) {
         fprintf(stderr, "Error: Buffer is not a valid PNG\n");
         return NULL;
     }
 
-    // Initialize libpng structures
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_structp png = createPngReader();
     if (!png) {
         fprintf(stderr, "Error: Failed to create png read struct\n");
         return NULL;
     }
-
     png_infop info = png_create_info_struct(png);
     if (!info) {
         fprintf(stderr, "Error: Failed to create png info struct\n");
         png_destroy_read_struct(&png, NULL, NULL);
         return NULL;
     }
-
     if (setjmp(png_jmpbuf(png))) {
         fprintf(stderr, "Error: Failed during PNG read\n");
         png_destroy_read_struct(&png, &info, NULL);
         return NULL;
     }
 
-    // Set up custom read function
-    png_bytep io_ptr = (png_bytep) srcPx;
-    png_set_read_fn(png, &io_ptr, png_memory_read);
-
-    // Read PNG info
+    PngMemoryReader io = { srcPx, srcPx + srcLen };
+    png_set_read_fn(png, &io, png_memory_read);
     png_read_info(png, info);
 
-    auto width = png_get_image_width(png, info);
-    auto height = png_get_image_height(png, info);
-    auto color_type = png_get_color_type(png, info);
-    auto bit_depth = png_get_bit_depth(png, info);
-    auto row_bytes = png_get_rowbytes(png, info);
-
-    // Check color type and bit depth
-    if (color_type != PNG_COLOR_TYPE_PALETTE || bit_depth != 8) {
-        fprintf(stderr, "Error: Unsupported PNG format (color type: %d, bit depth: %d)\n", color_type, bit_depth);
+    png_uint_32 width = png_get_image_width(png, info);
+    png_uint_32 height = png_get_image_height(png, info);
+    int color_type = png_get_color_type(png, info);
+    int bit_depth = png_get_bit_depth(png, info);
+    if (width != s->Size[0] || height != s->Size[1]) {
+        fprintf(stderr, "Error: PNG size %ux%u does not match sprite size %ux%u\n", width, height, s->Size[0], s->Size[1]);
         png_destroy_read_struct(&png, &info, NULL);
         return NULL;
     }
-
-    size_t dstLen = width * height;
-    uint8_t* dstPx = (uint8_t*) malloc(dstLen);
-    if (!dstPx) {
-        fprintf(stderr, "Error allocating memory for PNG decoded data\n");
+    if (bit_depth != 8 || png_get_rowbytes(png, info) > (size_t) width * 4) {
+        fprintf(stderr, "Error: Unsupported PNG format (color type: %d, bit depth: %d)\n", color_type, bit_depth);
         png_destroy_read_struct(&png, &info, NULL);
         return NULL;
     }
 
-    // Read image data
-    png_bytep* row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
-    for (int y = 0; y < height; y++) {
-        row_pointers[y] = dstPx + y * row_bytes;
+    // Palette images expand through the PLTE and tRNS chunks
+    uint8_t lut[256][4];
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_colorp plte = NULL;
+        int numPlte = 0;
+        png_bytep trns = NULL;
+        int numTrns = 0;
+        png_get_PLTE(png, info, &plte, &numPlte);
+        png_get_tRNS(png, info, &trns, &numTrns, NULL);
+        for (int i = 0; i < 256; i++) {
+            lut[i][0] = i < numPlte ? plte[i].red : 0;
+            lut[i][1] = i < numPlte ? plte[i].green : 0;
+            lut[i][2] = i < numPlte ? plte[i].blue : 0;
+            lut[i][3] = i < numTrns ? trns[i] : 255;
+        }
     }
-    png_read_image(png, row_pointers);
 
-    // Clean up
-    free(row_pointers);
-    png_destroy_read_struct(&png, &info, NULL);
+    size_t stride = (size_t) width * 4;
+    int passes = png_set_interlace_handling(png);
+    for (int pass = 0; pass < passes; pass++) {
+        for (png_uint_32 y = 0; y < height; y++) {
+            png_read_row(png, dstPx + y * stride, NULL);
+        }
+    }
 
-    return dstPx;
-}
+    for (png_uint_32 y = 0; y < height; y++) {
+        uint8_t* row = dstPx + y * stride;
+        switch (color_type) {
+        case PNG_COLOR_TYPE_RGB_ALPHA:
+            break;
+        case PNG_COLOR_TYPE_RGB:
+            for (png_int_32 x = width - 1; x >= 0; x--) {
+                row[x * 4 + 2] = row[x * 3 + 2];
+                row[x * 4 + 1] = row[x * 3 + 1];
+                row[x * 4 + 0] = row[x * 3 + 0];
+                row[x * 4 + 3] = 255;
+            }
+            break;
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+            for (png_int_32 x = width - 1; x >= 0; x--) {
+                uint8_t g = row[x * 2], a = row[x * 2 + 1];
+                row[x * 4 + 0] = row[x * 4 + 1] = row[x * 4 + 2] = g;
+                row[x * 4 + 3] = a;
+            }
+            break;
+        case PNG_COLOR_TYPE_GRAY:
+            for (png_int_32 x = width - 1; x >= 0; x--) {
+                uint8_t g = row[x];
+                row[x * 4 + 0] = row[x * 4 + 1] = row[x * 4 + 2] = g;
+                row[x * 4 + 3] = 255;
+            }
+            break;
+        case PNG_COLOR_TYPE_PALETTE:
+            for (png_int_32 x = width - 1; x >= 0; x--) {
+                memcpy(row + x * 4, lut[row[x]], 4);
+            }
+            break;
+        }
+    }
 
-uint8_t* RGBA_PngDecode(Sprite* s, uint8_t* srcPx, size_t srcLen) {
-    return NULL;
+    png_destroy_read_struct(&png, &info, NULL);
+    return dstPx;
 }
 
-uint8_t* RlePcxDecode(Sprite* s, uint8_t* srcPx, size_t srcLen) {
+uint8_t* RlePcxDecode(Sprite* s, const uint8_t* srcPx, size_t srcLen, uint8_t* dstPx) {
     if (srcLen == 0) {
         fprintf(stderr, "Warning PCX data length is zero\n");
         return NULL;
     }
 
-    int dstLen = s->Size[0] * s->Size[1];
-    // printf("Allocating memory for PCX decoded data dstLen=%ld srcLen=%ld %dx%d\n", dstLen, srcLen, s->Size[0], s->Size[1]);
-    // printf("[DEBUG] src/main.cpp:%d\n", __LINE__);
-    uint8_t* dstPx = (uint8_t*) malloc(dstLen);
-    // uint8_t* dstPx;
-    // printf("[DEBUG] src/main.cpp:%d\n", __LINE__);
-    // dstPx = (uint8_t*) malloc(dstLen * sizeof(uint8_t));
-    // printf("[DEBUG] src/main.cpp:%d\n", __LINE__);
-    if (!dstPx) {
-        fprintf(stderr, "Error allocating memory for PCX decoded data dstLen=%ld srcLen=%ld %dx%d\n", dstLen, srcLen, s->Size[0], s->Size[1]);
-        return NULL;
-    }
-    // printf("[DEBUG] src/main.cpp:%d\n", __LINE__);
+    size_t dstLen = (size_t) s->Size[0] * s->Size[1];
 
-    size_t i = 0, j = 0, k = 0, w = s->Size[0];
-    while (j < dstLen) {
-        int n = 1, d = srcPx[i];
-        if (i < (srcLen - 1)) {
-            i++;
-        }
+    // An encoded line holds at least the w pixels, a shorter bpl (0 for an
+    // uncompressed PCX) is taken as w
+    size_t i = 0, j = 0, k = 0, w = s->Size[0], bpl = std::max((size_t) s->rle, w);
+    while (j < dstLen && i < srcLen) {
+        size_t n = 1;
+        uint8_t d = srcPx[i++];
         if (d >= 0xc0) {
+            if (i == srcLen) break;
             n = d & 0x3f;
-            d = srcPx[i];
-            if (i < (srcLen - 1)) {
-                i++;
-            }
+            d = srcPx[i++];
         }
-        for (; n > 0; n--) {
-            if ((k < w) && (j < dstLen)) {
-                dstPx[j] = d;
-                j++;
-            }
-            k++;
-            if (k == s->rle) {
-                k = 0;
-                n = 1;
-            }
+        // A run stops at the end of the encoded line, only the first w of the
+        // bpl bytes per line are pixels
+        if (n > bpl - k) n = bpl - k;
+        fillRun(dstPx, &j, dstLen, d, k < w ? std::min(n, w - k) : 0);
+        k += n;
+        if (k == bpl) {
+            k = 0;
         }
     }
-    // printf("[DEBUG] src/main.cpp:%d\n", __LINE__);
+    memset(dstPx + j, 0, dstLen - j);
     s->rle = 0;
-    // printf("[DEBUG] src/main.cpp:%d\n", __LINE__);
     return dstPx;
 }
 
-void save_as_png(const char* filename, int img_width, int img_height, png_byte* img_data, png_color* palette) {
-    FILE* fp = fopen(filename, "wb");
-    if (!fp) {
-        fprintf(stderr, "Failed to open file '%s' for writing\n", filename);
-        return;
+// Most decoded bytes one byte of encoded data can give: a 2-byte token runs at most
+// 63 pixels in PCX and RLE8, 256 in RLE5 and 263 in LZ5, deflate stops at 1032:1.
+// A sprite claiming more pixels than its data can give is refused before its buffer
+// is allocated, so a forged size cannot make the decoders allocate gigabytes
+bool spriteDataFits(const Sprite* s, int format, size_t srcLen) {
+    uint64_t ratio;
+    switch (format) {
+    case 1:
+    case 2: ratio = 32; break;
+    case 3: ratio = 128; break;
+    case 4: ratio = 132; break;
+    default: ratio = 1032; break;
     }
-    // printf("%s\n", filename);
+    uint64_t bytes = (uint64_t) s->Size[0] * s->Size[1] * (format >= 11 ? 4 : 1);
+    if (bytes <= srcLen * ratio) return true;
+    fprintf(stderr, "Error: sprite %d,%d of %ux%u does not fit in its %zu bytes of %s data\n",
+        s->Group, s->Number, s->Size[0], s->Size[1], srcLen, formatName(format));
+    return false;
+}
+
+static void png_flush_noop(png_structp png_ptr) {
+}
 
+// Encode an indexed image with the given palette, or 8-bit RGBA when palette is NULL.
+// The PNG goes through write_fn, or to the FILE* io when write_fn is NULL
+int encode_png(void* io, png_rw_ptr write_fn, int img_width, int img_height, png_byte* img_data, png_color* palette, PngProfile profile) {
+    TRACE_SCOPE("png encode");
     png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png) {
         fprintf(stderr, "Failed to create PNG write struct\n");
-        fclose(fp);
-        return;
+        return -1;
     }
 
     png_infop info = png_create_info_struct(png);
     if (!info) {
         fprintf(stderr, "Failed to create PNG info struct\n");
         png_destroy_write_struct(&png, NULL);
-        fclose(fp);
-        return;
+        return -1;
     }
 
     if (setjmp(png_jmpbuf(png))) {
         fprintf(stderr, "Failed during PNG creation\n");
         png_destroy_write_struct(&png, &info);
-        fclose(fp);
-        return;
+        return -1;
     }
 
-    png_init_io(png, fp);
+    png_set_write_fn(png, io, write_fn, write_fn ? png_flush_noop : NULL);
+    png_profile_apply(png, profile);
 
     png_set_IHDR(
         png,
         info,
         img_width, img_height,
         8,
-        PNG_COLOR_TYPE_PALETTE,
+        palette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB_ALPHA,
         PNG_INTERLACE_NONE,
         PNG_COMPRESSION_TYPE_DEFAULT,
         PNG_FILTER_TYPE_DEFAULT
     );
 
-    png_set_PLTE(png, info, palette, 256);
+    if (palette) {
+        png_set_PLTE(png, info, palette, 256);
 
-    png_byte trans[256];
-    memset(trans, 255, 256);
-    trans[0] = 0; // Set palette index 0 to be transparent
-    png_set_tRNS(png, info, trans, 256, NULL);
+        png_byte trans[256];
+        memset(trans, 255, 256);
+        trans[0] = 0; // Set palette index 0 to be transparent
+        png_set_tRNS(png, info, trans, 256, NULL);
+    }
 
     png_write_info(png, info);
 
+    size_t stride = palette ? img_width : (size_t) img_width * 4;
     png_bytep rows[img_height];
     for (int y = 0; y < img_height; y++) {
-        rows[y] = img_data + y * img_width;
+        rows[y] = img_data + y * stride;
     }
 
-    png_write_image(png, rows);
+    png_profile_write_rows(png, profile, rows, img_width, img_height, stride, palette ? 1 : 4);
     png_write_end(png, NULL);
 
     png_destroy_write_struct(&png, &info);
-    fclose(fp);
+    return 0;
+}
+
+// --watch: an output is written to <name>.tmp and renamed over the old file once it is
+// complete, so a tool reloading it never reads half of one
+FILE* createOutput(const char* filename, std::string& path) {
+    path = opt_watch ? std::string(filename) + ".tmp" : std::string(filename);
+    return fopen(path.c_str(), "wb");
+}
+
+// Close a file of createOutput() and move it into place, false when that failed
+bool finishOutput(FILE* f, const char* filename, const std::string& path, bool ok) {
+    ok = fclose(f) == 0 && ok;
+    if (path == filename) return ok;
+    std::error_code ec;
+    if (ok) std::filesystem::rename(path, filename, ec);
+    if (!ok || ec) {
+        remove(path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void save_as_png(const char* filename, int img_width, int img_height, png_byte* img_data, png_color* palette, PngProfile profile) {
+    std::string path;
+    FILE* fp = createOutput(filename, path);
+    if (!fp) {
+        fprintf(stderr, "Failed to open file '%s' for writing\n", filename);
+        return;
+    }
+    // printf("%s\n", filename);
+    int rc = encode_png(fp, NULL, img_width, img_height, img_data, palette, profile);
+    if (!finishOutput(fp, filename, path, rc == 0)) {
+        fprintf(stderr, "Error writing file %s\n", filename);
+    }
     // puts(filename);
 }
 
-int readPcxHeader(Sprite* s, FILE* file, uint64_t offset) {
-    fseek(file, offset, SEEK_SET);
+// Name of an output file of this Sff: the entry name inside the -X archive,
+// otherwise the path in the output directory
+void sffOutputName(Sff* sff, char* out, size_t out_size, const char* name, const char* ext) {
+    if (sff->zip) {
+        snprintf(out, out_size, "%s%s", name, ext);
+    } else {
+        outputPath(out, out_size, name, ext);
+    }
+}
+
+// --cache: what a previous run knew about one input file. The manifest is a text file,
+// one "file" line per input followed by its "out" and "sprite" lines:
+//   file <size> <mtime> <content hash> <options> <path>
+//   out <path>                     atlas, metadata, info and -X archive files
+//   sprite <pixel hash> <path>     -x sprite PNGs
+// all fields tab separated, hashes in hex
+#define CACHE_MAGIC "sffcli cache 1"
+
+typedef struct CacheEntry {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;          // FNV-1a of the whole file
+    std::string options;    // cacheOptions() of the run that wrote the outputs
+    std::vector<std::string> outputs;
+    std::map<std::string, uint64_t> sprites;    // -x PNG -> hash of what it was written from
+} CacheEntry;
+
+std::map<std::string, CacheEntry> cacheOld;     // loaded from the manifest, read only
+std::map<std::string, CacheEntry> cacheNew;     // this run, written back at the end
+std::mutex cacheLock;                           // cacheNew and the entries it holds
+
+// The options that change what gets written, entries of other options are stale
+std::string cacheOptions() {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "p%d x%d X%d n%d i%d z%s Z%s m%d b%d a%d t%d%s%d w%d r%d,%d o%s", opt_palidx, opt_extract, opt_zip, !opt_atlas,
+        opt_sff_info, png_profile_name(opt_sprite_profile), png_profile_name(opt_atlas_profile), opt_max_atlas, opt_bin_meta,
+        opt_all_palettes, opt_texture, texture_format_name(opt_texture_rgba), opt_mips, opt_write_sff, opt_rgba, opt_rgba_output,
+        opt_outdir ? opt_outdir : ".");
+    return buf;
+}
+
+int loadCache(const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (!f) return 0;   // first run
+    char line[2048];
+    CacheEntry* e = NULL;
+    if (!fgets(line, sizeof(line), f) || strncmp(line, CACHE_MAGIC, strlen(CACHE_MAGIC)) != 0) {
+        fprintf(stderr, "Warning: %s is not a sffcli cache, starting a new one\n", filename);
+        fclose(f);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        std::vector<char*> col;
+        for (char* p = strtok(line, "\t"); p; p = strtok(NULL, "\t")) col.push_back(p);
+        if (col.size() == 6 && strcmp(col[0], "file") == 0) {
+            e = &cacheOld[col[5]];
+            e->size = strtoull(col[1], NULL, 10);
+            e->mtime = strtoll(col[2], NULL, 10);
+            e->hash = strtoull(col[3], NULL, 16);
+            e->options = col[4];
+        } else if (e && col.size() == 2 && strcmp(col[0], "out") == 0) {
+            e->outputs.push_back(col[1]);
+        } else if (e && col.size() == 3 && strcmp(col[0], "sprite") == 0) {
+            e->sprites[col[2]] = strtoull(col[1], NULL, 16);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+// Write the manifest: this run's entries, and the old ones of files not seen this time.
+// Written to a temporary file first so an interrupted run keeps the previous manifest
+int saveCache(const char* filename) {
+    std::string tmp = std::string(filename) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "Error creating cache file %s\n", tmp.c_str());
+        return -1;
+    }
+    fprintf(f, "%s\n", CACHE_MAGIC);
+    std::map<std::string, CacheEntry> all = cacheOld;
+    for (const auto& pair : cacheNew) all[pair.first] = pair.second;
+    for (const auto& pair : all) {
+        const CacheEntry& e = pair.second;
+        fprintf(f, "file\t%llu\t%lld\t%016llx\t%s\t%s\n", (unsigned long long) e.size, (long long) e.mtime,
+            (unsigned long long) e.hash, e.options.c_str(), pair.first.c_str());
+        for (const std::string& out : e.outputs) fprintf(f, "out\t%s\n", out.c_str());
+        for (const auto& s : e.sprites) fprintf(f, "sprite\t%016llx\t%s\n", (unsigned long long) s.second, s.first.c_str());
+    }
+    bool ok = fclose(f) == 0;
+    std::error_code ec;
+    if (ok) std::filesystem::rename(tmp, filename, ec);
+    if (!ok || ec) {
+        fprintf(stderr, "Error writing cache file %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Size and modification time of an input file, inside a mounted archive or on disk
+int fileStamp(const char* filename, uint64_t* size, int64_t* mtime) {
+    if (archivesMounted && PHYSFS_exists(filename)) {
+        PHYSFS_Stat st;
+        if (!PHYSFS_stat(filename, &st)) return -1;
+        *size = st.filesize;
+        *mtime = st.modtime;
+        return 0;
+    }
+    STAT_STRUCT st;
+    if (STAT_FUNC(filename, &st) != 0) return -1;
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return 0;
+}
+
+// Every output of the entry is still there
+bool cacheOutputsExist(const CacheEntry& e) {
+    for (const std::string& out : e.outputs) {
+        if (!std::filesystem::exists(out)) return false;
+    }
+    for (const auto& s : e.sprites) {
+        if (!std::filesystem::exists(s.first)) return false;
+    }
+    return true;
+}
+
+// --golden: what this run produced. Sprites are keyed "<sff>\t<index>\t<group>,<number>",
+// outputs by their path and hashed from disk once the run is done
+typedef struct {
+    std::mutex lock;
+    std::map<std::string, uint64_t> sprites;
+    std::map<std::string, uint64_t> outputs;   // keyed by input and output file
+    std::vector<std::string> inputs;    // decoded SFF files, timed again once the run is done
+} GoldenRun;
+
+GoldenRun goldenRun;
+
+// Note an output file of this Sff in its cache entry (and for --golden)
+void cacheOutput(Sff* sff, const char* filename) {
+    if (opt_golden) {
+        std::lock_guard<std::mutex> lock(goldenRun.lock);
+        goldenRun.outputs[std::string(sff->filename) + "\t" + filename] = 0;
+    }
+    if (!sff->cache) return;
+    std::lock_guard<std::mutex> lock(cacheLock);
+    if (!sff->cache->sprites.count(filename)) sff->cache->outputs.push_back(filename);
+}
+
+// -x sprite PNG about to be written from content with this hash: true when the previous
+// run wrote the same file from the same content and it is still there, so it can be kept
+bool cacheSpriteUnchanged(Sff* sff, const char* filename, uint64_t hash) {
+    if (!sff->cache || sff->zip) return false;
+    {
+        std::lock_guard<std::mutex> lock(cacheLock);
+        sff->cache->sprites[filename] = hash;
+    }
+    if (!sff->cached) return false;
+    auto it = sff->cached->sprites.find(filename);
+    return it != sff->cached->sprites.end() && it->second == hash && std::filesystem::exists(filename);
+}
+
+// Write a complete output file of this Sff, into the -X archive when there is one
+int writeOutput(Sff* sff, const char* filename, const uint8_t* data, size_t len, bool deflate) {
+    if (sff->zip) {
+        return zip_add(sff->zip, filename, data, len, deflate);
+    }
+    cacheOutput(sff, filename);
+    std::string path;
+    FILE* f = createOutput(filename, path);
+    if (!f) {
+        fprintf(stderr, "Error creating file %s\n", filename);
+        return -1;
+    }
+    size_t n = len > 0 ? fwrite(data, 1, len, f) : 0;
+    if (!finishOutput(f, filename, path, n == len)) {
+        fprintf(stderr, "Error writing file %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+static void png_vector_write(png_structp png_ptr, png_bytep data, png_size_t length) {
+    std::vector<uint8_t>* out = (std::vector<uint8_t>*) png_get_io_ptr(png_ptr);
+    out->insert(out->end(), data, data + length);
+}
+
+// save_as_png() for the output of an Sff. PNGs are already deflated, so they
+// are stored as they are in the -X archive
+void saveSffPng(Sff* sff, const char* filename, int img_width, int img_height, png_byte* img_data, png_color* palette, PngProfile profile) {
+    if (!sff->zip) {
+        cacheOutput(sff, filename);
+        save_as_png(filename, img_width, img_height, img_data, palette, profile);
+        return;
+    }
+    std::vector<uint8_t> png;
+    if (encode_png(&png, png_vector_write, img_width, img_height, img_data, palette, profile) == 0) {
+        zip_add(sff->zip, filename, png.data(), png.size(), false);
+    }
+}
+
+// A decoded -x sprite: PNG, or with --rgba expanded to RGBA8 through its palette
+// (true colour ones premultiplied if asked) and written as --rgba-output
+void saveSprite(Sff* sff, const char* filename, int w, int h, png_byte* data, const png_color* palette) {
+    if (opt_rgba < 0) {
+        saveSffPng(sff, filename, w, h, data, (png_color*) palette, opt_sprite_profile);
+        return;
+    }
+    static thread_local std::vector<uint8_t> rgba;
+    size_t n = (size_t) w * h;
+    rgba.resize(n * 4);
+    if (palette) {
+        uint32_t lut[256];
+        rgbaLut(palette, opt_rgba == RGBA_PREMULTIPLIED, lut);
+        expandIndexed(data, n, lut, rgba.data());
+    } else {
+        memcpy(rgba.data(), data, n * 4);
+        if (opt_rgba == RGBA_PREMULTIPLIED) premultiplyRgba(rgba.data(), n);
+    }
+    switch (opt_rgba_output) {
+    case RGBA_OUTPUT_PNG:
+        saveSffPng(sff, filename, w, h, rgba.data(), NULL, opt_sprite_profile);
+        break;
+    case RGBA_OUTPUT_RAW:
+        writeOutput(sff, filename, rgba.data(), rgba.size(), true);
+        break;
+    case RGBA_OUTPUT_DDS: {
+        std::vector<uint8_t> dds;
+        texture_encode(rgba.data(), w, h, TEXTURE_RGBA8, false, 1, TEXTURE_DDS, dds);
+        writeOutput(sff, filename, dds.data(), dds.size(), true);
+        break;
+    }
+    }
+}
+
+// -x file name of sprite s, "<prefix> <group> <number>" and the extension of its format
+void spriteFilename(const Sff* sff, const Sprite* s, char* out, size_t size) {
+    static const char* ext[] = { ".png", ".rgba", ".dds" };
+    snprintf(out, size, "%s %d %d%s", sff->spritePrefix, s->Group, s->Number, ext[opt_rgba >= 0 ? opt_rgba_output : RGBA_OUTPUT_PNG]);
+}
+
+// -X: open <name>.zip in the output directory, the sprites go to its root
+int openSffArchive(Sff* sff) {
+    char zipFilename[512];
+    outputPath(zipFilename, sizeof(zipFilename), sff->basename, ".zip");
+    cacheOutput(sff, zipFilename);
+    sff->zip = new ZipWriter();
+    if (zip_open(sff->zip, zipFilename) != 0) {
+        delete sff->zip;
+        sff->zip = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// -X: add the ACT palettes and write the central directory
+int closeSffArchive(Sff* sff) {
+    if (!sff->zip) return 0;
+    for (const auto& pal : sff->actPalettes) {
+        uint8_t act[256 * 3];
+        const uint32_t* colors = sffPalette(sff, pal[0]);
+        for (int i = 0; i < 256; i++) {
+            act[i * 3 + 0] = (colors[i] >> 0) & 0xFF;
+            act[i * 3 + 1] = (colors[i] >> 8) & 0xFF;
+            act[i * 3 + 2] = (colors[i] >> 16) & 0xFF;
+        }
+        char actFilename[512];
+        snprintf(actFilename, sizeof(actFilename), "%s %d %d.act", sff->basename, pal[1], pal[2]);
+        zip_add(sff->zip, actFilename, act, sizeof(act), true);
+    }
+    int rc = zip_close(sff->zip);
+    delete sff->zip;
+    sff->zip = NULL;
+    return rc;
+}
+
+// Number of encoder threads of the -x encoder pool
+int encodeThreadCount() {
+    int n = opt_encoders;
+    if (n <= 0) {
+        n = (int) std::thread::hardware_concurrency() / opt_jobs;
+    }
+    return n < 1 ? 1 : n;
+}
+
+void encodeWorker(EncodeQueue* q, Sff* sff) {
+    TRACE_FILE(sff->filename);
+    std::unique_lock<std::mutex> lk(q->lock);
+    for (;;) {
+        q->notEmpty.wait(lk, [q] { return q->closed || !q->jobs.empty(); });
+        if (q->jobs.empty()) break;
+        EncodeJob job = q->jobs.front();
+        q->jobs.pop_front();
+        lk.unlock();
+        q->notFull.notify_one();
+        saveSprite(sff, job.filename, job.width, job.height, job.data, job.rgba ? NULL : job.palette);
+        lk.lock();
+    }
+}
+
+void encodeQueueStart(EncodeQueue* q, int numThreads, Sff* sff) {
+    q->capacity = (size_t) numThreads * 4;
+    q->closed = false;
+    for (int t = 0; t < numThreads; t++) {
+        q->threads.emplace_back(encodeWorker, q, sff);
+    }
+}
+
+// Let the encoders drain what is left in the queue and wait for them
+void encodeQueueFinish(EncodeQueue* q) {
+    {
+        std::lock_guard<std::mutex> lk(q->lock);
+        q->closed = true;
+    }
+    q->notEmpty.notify_all();
+    for (auto& th : q->threads) {
+        th.join();
+    }
+    q->threads.clear();
+}
+
+// Write a decoded sprite as PNG: queued for the encoder pool when there is one,
+// otherwise right away. palette is NULL for RGBA pixels
+void submitPng(Sff* sff, const char* filename, int w, int h, png_byte* data, const png_color* palette) {
+    if (sff->cache) {
+        uint64_t hash = fnv1a_64(&w, sizeof(w), FNV1A_64_INIT);
+        hash = fnv1a_64(&h, sizeof(h), hash);
+        hash = fnv1a_64(data, (size_t) w * h * (palette ? 1 : 4), hash);
+        if (palette) hash = fnv1a_64(palette, 256 * sizeof(png_color), hash);
+        if (cacheSpriteUnchanged(sff, filename, hash)) return;
+    }
+    // --trim reuses the decode buffer for the next sprite, so encode it right away
+    if (!sff->encoder || opt_trim) {
+        saveSprite(sff, filename, w, h, data, palette);
+        return;
+    }
+    EncodeQueue* q = sff->encoder;
+    EncodeJob job;
+    strncpy(job.filename, filename, sizeof(job.filename) - 1);
+    job.filename[sizeof(job.filename) - 1] = 0;
+    job.width = w;
+    job.height = h;
+    job.data = data;
+    job.rgba = palette == NULL;
+    if (palette) memcpy(job.palette, palette, sizeof(job.palette));
+    {
+        std::unique_lock<std::mutex> lk(q->lock);
+        q->notFull.wait(lk, [q] { return q->jobs.size() < q->capacity; });
+        q->jobs.push_back(job);
+    }
+    q->notEmpty.notify_one();
+}
+
+int readPcxHeader(Sprite* s, MemReader* file, uint64_t offset) {
+    mseek(file, offset, SEEK_SET);
     uint16_t dummy;
-    if (fread(&dummy, sizeof(uint16_t), 1, file) != 1) {
+    if (mread(&dummy, sizeof(uint16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading uint16_t dummy\n");
         return -1;
     }
     uint8_t encoding, bpp;
-    if (fread(&encoding, sizeof(uint8_t), 1, file) != 1) {
+    if (mread(&encoding, sizeof(uint8_t), 1, file) != 1) {
         fprintf(stderr, "Error reading uint8_t encoding\n");
         return -1;
     }
-    if (fread(&bpp, sizeof(uint8_t), 1, file) != 1) {
+    if (mread(&bpp, sizeof(uint8_t), 1, file) != 1) {
         fprintf(stderr, "Error reading uint8_t bpp\n");
         return -1;
     }
@@ -992,13 +2174,13 @@ int readPcxHeader(Sprite* s, FILE* file, uint64_t offset) {
         return -1;
     }
     uint16_t rect[4];
-    if (fread(rect, sizeof(uint16_t), 4, file) != 4) {
+    if (mread(rect, sizeof(uint16_t), 4, file) != 4) {
         fprintf(stderr, "Error reading rectangle\n");
         return -1;
     }
-    fseek(file, offset + 66, SEEK_SET);
+    mseek(file, offset + 66, SEEK_SET);
     uint16_t bpl;
-    if (fread(&bpl, sizeof(uint16_t), 1, file) != 1) {
+    if (mread(&bpl, sizeof(uint16_t), 1, file) != 1) {
         fprintf(stderr, "Error reading bpl\n");
         return -1;
     }
@@ -1012,14 +2194,16 @@ int readPcxHeader(Sprite* s, FILE* file, uint64_t offset) {
     return 0;
 }
 
-int readSpriteDataV1(Sprite* s, FILE* file, Sff* sff, uint64_t offset, uint32_t datasize, uint32_t nextSubheader, Sprite* prev, std::vector<png_color*>* palettes, bool c00) {
+// Header pass for a SFF v1 sprite: reads the PCX header and palette and
+// records where the pixel data is, the pixels are decoded later by decodeSpriteDataV1
+int readSpriteDataV1(Sprite* s, MemReader* file, Sff* sff, uint64_t offset, uint32_t datasize, uint32_t nextSubheader, Sprite* prev, bool c00, SpriteJob* job) {
     if (nextSubheader > offset) {
         // Ignore datasize except last
         datasize = nextSubheader - offset;
     }
 
     uint8_t ps;
-    if (fread(&ps, sizeof(uint8_t), 1, file) != 1) {
+    if (mread(&ps, sizeof(uint8_t), 1, file) != 1) {
         fprintf(stderr, "Error reading sprite ps data\n");
         return -1;
     }
@@ -1028,9 +2212,11 @@ int readSpriteDataV1(Sprite* s, FILE* file, Sff* sff, uint64_t offset, uint32_t
         fprintf(stderr, "Error reading sprite PCX header\n");
         return -1;
     }
+    // Bytes per line is only needed by the decoder
+    job->bpl = s->rle;
+    s->rle = 0;
 
-    fseek(file, offset + 128, SEEK_SET);
-    uint32_t palHash = 0;
+    mseek(file, offset + 128, SEEK_SET);
     uint32_t palSize;
     if (c00 || paletteSame) {
         palSize = 0;
@@ -1040,147 +2226,181 @@ int readSpriteDataV1(Sprite* s, FILE* file, Sff* sff, uint64_t offset, uint32_t
     if (datasize < 128 + palSize) {
         datasize = 128 + palSize;
     }
-    // printf("[DEBUG] src/main.cpp:%d\n", __LINE__);
 
-    char pngFilename[256];
-    char basename[256];
-    get_basename_no_ext(sff->filename, basename, sizeof(basename));
-    if (opt_extract)
-    if (createDirectory(basename) != 0) {
-        return -1;
-    }
-    snprintf(pngFilename, sizeof(pngFilename), "%s%s%s %d %d.png", basename, SEP, basename, s->Group, s->Number);
     size_t srcLen = datasize - (128 + palSize);
-    uint8_t* srcPx = (uint8_t*) malloc(srcLen);
+    const uint8_t* srcPx = mpeek(file, srcLen);
     if (!srcPx) {
-        fprintf(stderr, "Error allocating memory for sprite data\n");
-        return -1;
-    }
-    if (fread(srcPx, srcLen, 1, file) != 1) {
         fprintf(stderr, "Error reading sprite PCX data pixel\n");
         return -1;
     }
+    mseek(file, srcLen, SEEK_CUR);
+    job->sprite = s;
+    job->srcPx = srcPx;
+    job->srcLen = srcLen;
 
     s->data = NULL;
-    sff->format_usage[1]++;
     // printf("PCX: ps=%d ", ps);
     if (paletteSame) {
-        png_color* png_palette;
-        // printf("[DEBUG] src/main.cpp:%d\n", __LINE__);
         if (prev != NULL) {
             s->palidx = prev->palidx;
             // printf("Info: Same palette (%d,%d) with (%d,%d) = %d\n", s->Group, s->Number, prev->Group, prev->Number, prev->palidx);
         }
         if (s->palidx < 0) {
-            png_color* palette = new png_color[256];
-            palettes->push_back(palette);
-            s->palidx = palettes->size() - 1;
-            png_palette = palette;
-            printf("Warning: incompleted code for handling palette in main.cpp line %d\n", __LINE__);
-        } else {
-            // fprintf(stderr, "Warning: palette index %d\npal_len=%d\n", s->palidx, palettes->size());
-            png_palette = palettes->at(s->palidx);
-            // for (int i = 0; i < 256; i++) {
-            //     png_palette[i].red = pal[i].red;
-            //     png_palette[i].green = pal[i].green;
-            //     png_palette[i].blue = pal[i].blue;
-                // png_palette[i].red = 100;
-                // png_palette[i].green = 200;
-                // png_palette[i].blue = 0;
-            // }
-        }
-        // printf("[DEBUG] src/main.cpp:%d\n", __LINE__);
-        uint8_t* px = RlePcxDecode(s, srcPx, srcLen);
-        free(srcPx);
-        if (!px) {
-            fprintf(stderr, "Error decoding PCX sprite data\n");
-            return -1;
+            const uint32_t none[256] = {};
+            s->palidx = addSffPalette(sff, none, s->Group, s->Number);
+            fprintf(sff->out, "Warning: incompleted code for handling palette in main.cpp line %d\n", __LINE__);
         }
-        // palHash = fast_hash(pal, 256);
-        // printf("old_pal=%d ", s->palidx);
-        if (opt_extract) save_as_png(pngFilename, s->Size[0], s->Size[1], px, png_palette);
-        s->data = px;
-        // free(px);
     } else {
-        png_color* png_palette = new png_color[256];
+        uint32_t colors[256];
         if (c00) {
-            fseek(file, offset + datasize - 768, 0);
+            mseek(file, offset + datasize - 768, SEEK_SET);
         }
         uint8_t rgb[3];
 
         for (int i = 0;i < 256;i++) {
-            if (fread(rgb, sizeof(uint8_t), 3, file) != 3) {
+            if (mread(rgb, sizeof(uint8_t), 3, file) != 3) {
                 fprintf(stderr, "Error reading palette rgb data\n");
                 return -1;
             }
-            uint8_t alpha = 255;
-            if (i == 0) {
-                alpha = 0;
-            }
-            png_palette[i].red = rgb[0];
-            png_palette[i].green = rgb[1];
-            png_palette[i].blue = rgb[2];
+            colors[i] = rgb[0] | rgb[1] << 8 | rgb[2] << 16;
         }
-        palettes->push_back(png_palette);
-        s->palidx = palettes->size() - 1;
+        s->palidx = addSffPalette(sff, colors, s->Group, s->Number);
+        sff->actPalettes.push_back({ s->palidx, s->Group, s->Number });
         // savePalette(pal, fmt.Sprintf("%v %v %v.act", "char_pal", s.Group, s.Number))
-        // printf("[DEBUG] src/main.cpp:%d\n", __LINE__);
-        uint8_t* px = RlePcxDecode(s, srcPx, srcLen);
-        free(srcPx);
-        if (!px) {
-            fprintf(stderr, "Error decoding PCX sprite data\n");
-            return -1;
-        }
-        // printf("[DEBUG] src/main.cpp:%d\n", __LINE__);
-        // palHash = fast_hash(pal, 256);
-        // printf("new_pal=%d ", s->palidx);
-        if (opt_extract) save_as_png(pngFilename, s->Size[0], s->Size[1], px, png_palette);
-        s->data = px;
-        // free(px);
     }
-    // printf("[DEBUG] src/main.cpp:%d ps=%d paletteSame=%d palidx=%d palLen=%d palSize=%d srcLen=%ld\n", __LINE__, ps, paletteSame, s->palidx, palettes->size(), palSize, srcLen);
-    // printf("%u\n", palHash);
-    sff->palette_usage[s->palidx]++;
     return 0;
 }
 
-int copy_png_with_palette(FILE* in, FILE* out, uint32_t palette[256]) {
-    if (!check_png_signature(in)) {
-        fprintf(stderr, "Not a valid PNG file\n");
+// Pixel (x, y) of a decoded sprite given in sprite coordinates, data may only hold
+// the dataX, dataY, dataW, dataH part of the sprite (--trim)
+static inline uint8_t* spritePixel(const Sprite* s, size_t x, size_t y, size_t bpp) {
+    return s->data + ((y - s->dataY) * s->dataW + (x - s->dataX)) * bpp;
+}
+
+// Crop scan helpers. A pixel is transparent when its last byte is 0: index 0, or
+// alpha 0 on the true colour page. mask selects those bytes in an 8 byte word
+static inline uint64_t load64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// First visible pixel in [from, to) of a row, -1 if there is none
+static int firstVisible(const uint8_t* row, int from, int to, int bpp, uint64_t mask) {
+    int step = 8 / bpp, x = from;
+    for (; x + step <= to; x += step) {
+        if (load64(row + x * bpp) & mask) break;
+    }
+    for (; x < to; x++) {
+        if (row[x * bpp + bpp - 1]) return x;
+    }
+    return -1;
+}
+
+// Last visible pixel in [from, to) of a row, -1 if there is none
+static int lastVisible(const uint8_t* row, int from, int to, int bpp, uint64_t mask) {
+    int step = 8 / bpp, x = to;
+    for (; x - step >= from; x -= step) {
+        if (load64(row + (x - step) * bpp) & mask) break;
+    }
+    for (; x > from; x--) {
+        if (row[(x - 1) * bpp + bpp - 1]) return x - 1;
+    }
+    return -1;
+}
+
+// Bounding box of the visible pixels in one row-major pass: each row is searched
+// from the left for its first visible pixel, and from the right only as far as the
+// right edge found so far. Returns false when the sprite is blank
+bool cropBounds(const uint8_t* p, int width, int height, int bpp, int* left, int* top, int* right, int* bottom) {
+    static const uint8_t indexedMask[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    static const uint8_t alphaMask[8] = { 0, 0, 0, 0xFF, 0, 0, 0, 0xFF };
+    uint64_t mask = load64(bpp == 4 ? alphaMask : indexedMask);
+    int x0 = width, x1 = -1, y0 = -1, y1 = -1;
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = p + (size_t) y * width * bpp;
+        int first = firstVisible(row, 0, width, bpp, mask);
+        if (first < 0) continue;
+        if (y0 < 0) y0 = y;
+        y1 = y;
+        if (first < x0) x0 = first;
+        int from = first > x1 ? first : x1 + 1;
+        int last = lastVisible(row, from, width, bpp, mask);
+        if (last > x1) x1 = last;
+    }
+    if (y0 < 0) return false;
+    *left = x0;
+    *top = y0;
+    *right = x1;
+    *bottom = y1;
+    return true;
+}
+
+// Where a sprite decodes to: its final place in the thread's arena, or with --trim the
+// thread's scratch buffer, trimSprite() then moves the visible part to the arena
+uint8_t* decodeBuffer(UsageCounters* counters, size_t size) {
+    if (!opt_trim) return (uint8_t*) arenaAlloc(counters->arena, size);
+    if (counters->scratch.size() < size) counters->scratch.resize(size);
+    return counters->scratch.data();
+}
+
+// Decode pass for a SFF v1 sprite, safe to run concurrently for different sprites
+int decodeSpriteDataV1(SpriteJob* job, Sff* sff, UsageCounters* counters) {
+    Sprite* s = job->sprite;
+    char pngFilename[512];
+    spriteFilename(sff, s, pngFilename, sizeof(pngFilename));
+
+    counters->format_usage[1]++;
+    if (!spriteDataFits(s, 1, job->srcLen)) return -1;
+    s->rle = job->bpl;
+    uint8_t* dstPx = decodeBuffer(counters, (size_t) s->Size[0] * s->Size[1]);
+    if (!dstPx) {
+        fprintf(stderr, "Error allocating memory for PCX decoded data %dx%d\n", s->Size[0], s->Size[1]);
+        return -1;
+    }
+    uint8_t* px = RlePcxDecode(s, job->srcPx, job->srcLen, dstPx);
+    if (!px) {
+        fprintf(stderr, "Error decoding PCX sprite data\n");
         return -1;
     }
+    if (opt_extract) {
+        png_color palette[256];
+        pngPalette(sffPalette(sff, s->palidx), palette);
+        submitPng(sff, pngFilename, s->Size[0], s->Size[1], px, palette);
+    }
+    s->data = px;
+    counters->palette_usage[s->palidx]++;
+    return 0;
+}
 
-    // Write PNG signature to output
-    const uint8_t png_sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
-    fwrite(png_sig, 1, 8, out);
+// Copy a PNG10 sprite with its PLTE replaced by the SFF palette in a single pass.
+// All other chunks are forwarded verbatim with their original CRCs, runs of them
+// in one append; only the new PLTE and tRNS get a CRC computed
+int copy_png_with_palette(const uint8_t* src, size_t srcLen, std::vector<uint8_t>& out, const uint32_t palette[256]) {
+    if (!check_png_signature(src, srcLen)) {
+        fprintf(stderr, "Not a valid PNG file\n");
+        return -1;
+    }
 
     int found_IHDR = 0;
     int found_PLTE = 0;
-    int wrote_PLTE = 0;
-    int wrote_tRNS = 0;
 
-    while (!feof(in)) {
-        uint8_t len_bytes[4], type[4];
-        if (fread(len_bytes, 1, 4, in) != 4) break;
+    size_t pos = PNG_SIG_BYTES;
+    size_t pending = 0;     // start of the chunks not written yet, signature included
+    while (srcLen - pos >= 12) {
+        const uint8_t* len_bytes = src + pos;
         uint32_t length = (len_bytes[0] << 24) | (len_bytes[1] << 16) | (len_bytes[2] << 8) | len_bytes[3];
-
-        if (fread(type, 1, 4, in) != 4) break;
-
-        uint8_t* data = (uint8_t*) malloc(length);
-        if (fread(data, 1, length, in) != length) {
-            free(data);
-            break;
-        }
-
-        uint8_t crc_buf[4];
-        fread(crc_buf, 1, 4, in); // ignore CRC
+        const uint8_t* type = src + pos + 4;
+        if (length > srcLen - pos - 12) break;
+        const uint8_t* data = src + pos + 8;
+        size_t chunk = pos;
+        pos += 12 + length;
 
         if (memcmp(type, "IHDR", 4) == 0) {
             found_IHDR = 1;
 
             if (length != 13) {
                 fprintf(stderr, "Invalid IHDR length\n");
-                free(data);
                 return -1;
             }
 
@@ -1189,13 +2409,15 @@ int copy_png_with_palette(FILE* in, FILE* out, uint32_t palette[256]) {
 
             if (bit_depth != 8 || color_type != 3) {
                 fprintf(stderr, "Only 8-bit indexed PNGs are supported\n");
-                free(data);
                 return -1;
             }
-
-            // Write IHDR chunk as-is
-            write_chunk(out, "IHDR", data, length);
-        } else if (memcmp(type, "PLTE", 4) == 0) {
+        } else if (memcmp(type, "PLTE", 4) == 0 || memcmp(type, "tRNS", 4) == 0) {
+            out.insert(out.end(), src + pending, src + chunk);
+            pending = pos;
+            if (memcmp(type, "tRNS", 4) == 0) {
+                // Skip original tRNS (we added our own)
+                continue;
+            }
             found_PLTE = 1;
 
             // Replace PLTE chunk
@@ -1206,7 +2428,6 @@ int copy_png_with_palette(FILE* in, FILE* out, uint32_t palette[256]) {
                 new_plte[i * 3 + 2] = (palette[i] >> 16) & 0xFF;  // B
             }
             write_chunk(out, "PLTE", new_plte, 256 * 3);
-            wrote_PLTE = 1;
 
             // Write tRNS chunk (only index 0 transparent)
             uint8_t trns[256];
@@ -1214,24 +2435,15 @@ int copy_png_with_palette(FILE* in, FILE* out, uint32_t palette[256]) {
                 trns[i] = (i == 0) ? 0 : 255;
             }
             write_chunk(out, "tRNS", trns, 256);
-            wrote_tRNS = 1;
-        } else if (memcmp(type, "tRNS", 4) == 0) {
-            // Skip original tRNS (we added our own)
-            free(data);
-            continue;
-        } else {
-            // Copy other chunks as-is
-            write_chunk(out, (char*) type, data, length);
         }
 
-        free(data);
-
         // Stop if we hit IEND
         if (memcmp(type, "IEND", 4) == 0)
             break;
     }
+    out.insert(out.end(), src + pending, src + pos);
 
-    if (!found_IHDR || !found_PLTE || !wrote_PLTE || !wrote_tRNS) {
+    if (!found_IHDR || !found_PLTE) {
         fprintf(stderr, "PNG missing IHDR or PLTE or failed writing replacements\n");
         return -1;
     }
@@ -1239,121 +2451,87 @@ int copy_png_with_palette(FILE* in, FILE* out, uint32_t palette[256]) {
     return 0;
 }
 
-int copy_png(FILE* in, FILE* out, uint32_t data_size) {
-    uint32_t png_len = data_size - 4;
-    char* buffer = (char*) malloc(png_len);
-    if (!buffer) {
-        // Handle memory allocation failure
-        fprintf(stderr, "Error allocating memory for PNG data\n");
-        return -1;
-    }
-
-    size_t read = fread(buffer, png_len, 1, in);
-    if (read != 1) {
-        fprintf(stderr, "Error reading PNG data\n");
-        free(buffer);
-        return -1;
-    }
-    fwrite(buffer, png_len, read, out);
-    free(buffer);
-    return 0;
-}
-
-void save_png(Sprite* s, FILE* file, uint32_t data_size, Sff* sff, bool with_palette) {
-    char pngFilename[256];
-    char basename[256];
-    get_basename_no_ext(sff->filename, basename, sizeof(basename));
-    if (createDirectory(basename) != 0) {
-        return;
-    }
-    snprintf(pngFilename, sizeof(pngFilename), "%s%s%s %d %d.png", basename, SEP, basename, s->Group, s->Number);
-    // Create a PNG file
-    FILE* pngFile = fopen(pngFilename, "wb");
-    if (!pngFile) {
-        fprintf(stderr, "Error creating PNG file %s\n", pngFilename);
-        return;
+void save_png(Sprite* s, const uint8_t* src, size_t srcLen, Sff* sff, bool with_palette) {
+    char pngFilename[512];
+    snprintf(pngFilename, sizeof(pngFilename), "%s %d %d.png", sff->spritePrefix, s->Group, s->Number);
+    if (sff->cache) {
+        uint64_t hash = fnv1a_64(src, srcLen, FNV1A_64_INIT);
+        if (with_palette) hash = fnv1a_64(sffPalette(sff, s->palidx), 256 * sizeof(uint32_t), hash);
+        if (cacheSpriteUnchanged(sff, pngFilename, hash)) return;
     }
     // Copy the PNG data from the input file to the output file
     if (with_palette) {
-        copy_png_with_palette(file, pngFile, sff->palList.palettes[s->palidx]);
+        std::vector<uint8_t> png;
+        png.reserve(srcLen + 1024);
+        if (copy_png_with_palette(src, srcLen, png, sffPalette(sff, s->palidx)) == 0) {
+            writeOutput(sff, pngFilename, png.data(), png.size(), false);
+        }
     } else
-        copy_png(file, pngFile, data_size);
-    fclose(pngFile);
+        writeOutput(sff, pngFilename, src, srcLen, false);
     // printf("%s\n", pngFilename);
 }
 
-int readSpriteDataV2(Sprite* s, FILE* file, uint64_t offset, uint32_t datasize, Sff* sff) {
+// Decode pass for a SFF v2 sprite, safe to run concurrently for different sprites
+int readSpriteDataV2(Sprite* s, MemReader* file, uint64_t offset, uint32_t datasize, Sff* sff, UsageCounters* counters) {
     uint8_t* px = NULL;
     if (s->rle > 0) return -1;
 
     if (s->rle == 0) {
-        px = (uint8_t*) malloc(datasize);
-        if (!px) {
-            fprintf(stderr, "Error allocating memory for sprite data\n");
-            return -1;
-        }
-        // Read sprite data
-        fseek(file, offset, SEEK_SET);
-        if (fread(px, datasize, 1, file) != 1) {
+        // Uncompressed sprite data
+        mseek(file, offset, SEEK_SET);
+        if (!mpeek(file, datasize)) {
             fprintf(stderr, "Error reading V2 uncompress sprite data\n");
-            free(px);
             return -1;
         }
     } else {
-        size_t srcLen;
-        uint8_t* srcPx = NULL;
-        fseek(file, offset + 4, SEEK_SET);
+        size_t srcLen = 0;
+        const uint8_t* srcPx = NULL;
+        mseek(file, offset + 4, SEEK_SET);
         int format = -s->rle;
-        int rc;
 
-        if (2 <= format && format <= 4) {
-            if (datasize < 4) {
-                datasize = 4;
-            }
-            srcLen = datasize - 4;
-            srcPx = (uint8_t*) malloc(srcLen);
-            if (!srcPx) {
-                fprintf(stderr, "Error allocating memory for sprite data\n");
-                return -1;
-            }
-            // printf("srcPx=%p srcLen=%ld\n", srcPx, srcLen);
-            rc = fread(srcPx, srcLen, 1, file);
-            if (rc != 1) {
-                fprintf(stderr, "Error reading V2 RLE sprite data (len=%ld). RC=%d.\n", srcLen, rc);
-                free(srcPx);
-                return -1;
-            }
-            sff->palette_usage[s->palidx]++;
+        if (datasize < 4) {
+            datasize = 4;
         }
-
-        char pngFilename[256];
-        char basename[256];
-        get_basename_no_ext(sff->filename, basename, sizeof(basename));
-        if (opt_extract) 
-        if (createDirectory(basename) != 0) {
+        srcLen = datasize - 4;
+        srcPx = mpeek(file, srcLen);
+        if (!srcPx) {
+            fprintf(stderr, "Error reading V2 sprite data (len=%ld).\n", srcLen);
             return -1;
         }
-        snprintf(pngFilename, sizeof(pngFilename), "%s%s%s %d %d.png", basename, SEP, basename, s->Group, s->Number);
+        if (2 <= format && format <= 4) {
+            counters->palette_usage[s->palidx]++;
+        }
+
+        char pngFilename[512];
+        spriteFilename(sff, s, pngFilename, sizeof(pngFilename));
 
         s->data = NULL;
-        sff->format_usage[format]++;
+        counters->format_usage[format]++;
+        // PNG sprites are copied as they are when extracting, their pixels are only
+        // needed for the atlas
+        bool decode = (2 <= format && format <= 4) || (10 <= format && format <= 12 && (opt_atlas || (opt_extract && opt_rgba >= 0))) ||
+            (format == 10 && opt_write_sff >= 0);
+        uint8_t* dstPx = NULL;
+        if (decode) {
+            if (!spriteDataFits(s, format, srcLen)) return -1;
+            // True colour PNG11/PNG12 sprites decode to 4 bytes per pixel
+            size_t bpp = format >= 11 ? 4 : 1;
+            dstPx = decodeBuffer(counters, (size_t) s->Size[0] * s->Size[1] * bpp);
+            if (!dstPx) {
+                fprintf(stderr, "Error allocating memory for decoded sprite data %dx%d\n", s->Size[0], s->Size[1]);
+                return -1;
+            }
+        }
         switch (format) {
         case 2:
             // printf("Decoding sprite with RLE8\n");
             // printf("RLE8: ");
-            px = Rle8Decode(s, srcPx, srcLen);
-            free(srcPx);
+            px = Rle8Decode(s, srcPx, srcLen, dstPx);
             if (px) {
-                uint32_t* sff_palette = sff->palList.palettes[s->palidx];
                 png_color png_palette[256];
-                for (int i = 0; i < 256; i++) {
-                    png_palette[i].red = (sff_palette[i] >> 0) & 0xFF;
-                    png_palette[i].green = (sff_palette[i] >> 8) & 0xFF;
-                    png_palette[i].blue = (sff_palette[i] >> 16) & 0xFF;
-                }
-                if (opt_extract) save_as_png(pngFilename, s->Size[0], s->Size[1], px, png_palette);
+                pngPalette(sffPalette(sff, s->palidx), png_palette);
+                if (opt_extract) submitPng(sff, pngFilename, s->Size[0], s->Size[1], px, png_palette);
                 s->data = px;
-                // free(px);
             } else {
                 fprintf(stderr, "Error decoding RLE8 sprite data\n");
                 return -1;
@@ -1362,19 +2540,12 @@ int readSpriteDataV2(Sprite* s, FILE* file, uint64_t offset, uint32_t datasize,
         case 3:
             // printf("Decoding sprite with RLE5\n");
             // printf("RLE5: ");
-            px = Rle5Decode(s, srcPx, srcLen);
-            free(srcPx);
+            px = Rle5Decode(s, srcPx, srcLen, dstPx);
             if (px) {
-                uint32_t* sff_palette = sff->palList.palettes[s->palidx];
                 png_color png_palette[256];
-                for (int i = 0; i < 256; i++) {
-                    png_palette[i].red = (sff_palette[i] >> 0) & 0xFF;
-                    png_palette[i].green = (sff_palette[i] >> 8) & 0xFF;
-                    png_palette[i].blue = (sff_palette[i] >> 16) & 0xFF;
-                }
-                if (opt_extract) save_as_png(pngFilename, s->Size[0], s->Size[1], px, png_palette);
+                pngPalette(sffPalette(sff, s->palidx), png_palette);
+                if (opt_extract) submitPng(sff, pngFilename, s->Size[0], s->Size[1], px, png_palette);
                 s->data = px;
-                // free(px);
             } else {
                 fprintf(stderr, "Error decoding RLE5 sprite data\n");
                 return -1;
@@ -1383,20 +2554,13 @@ int readSpriteDataV2(Sprite* s, FILE* file, uint64_t offset, uint32_t datasize,
         case 4:
             // printf("Decoding sprite with LZ55 palidx=%d\n", s->palidx);
             // printf("LZ5: ");
-            px = Lz5Decode(s, srcPx, srcLen);
-            // px = TestDecode(s, srcPx, srcLen);
-            free(srcPx);
+            px = Lz5Decode(s, srcPx, srcLen, dstPx);
+            // px = TestDecode(s, srcPx, srcLen, dstPx);
             if (px) {
-                uint32_t* sff_palette = sff->palList.palettes[s->palidx];
                 png_color png_palette[256];
-                for (int i = 0; i < 256; i++) {
-                    png_palette[i].red = (sff_palette[i] >> 0) & 0xFF;
-                    png_palette[i].green = (sff_palette[i] >> 8) & 0xFF;
-                    png_palette[i].blue = (sff_palette[i] >> 16) & 0xFF;
-                }
-                if (opt_extract) save_as_png(pngFilename, s->Size[0], s->Size[1], px, png_palette);
+                pngPalette(sffPalette(sff, s->palidx), png_palette);
+                if (opt_extract) submitPng(sff, pngFilename, s->Size[0], s->Size[1], px, png_palette);
                 s->data = px;
-                // free(px);
             } else {
                 fprintf(stderr, "Error decoding LZ5 sprite data\n");
                 return -1;
@@ -1405,26 +2569,38 @@ int readSpriteDataV2(Sprite* s, FILE* file, uint64_t offset, uint32_t datasize,
 
         case 10:
             // printf("PNG10: ");
-            px = Indexed_PngDecode(s, file);
-            if (px) {
-                fseek(file, offset + 4, SEEK_SET); // Restore file offset
-                if (opt_extract) save_png(s, file, datasize, sff, true);
+            px = decode ? Indexed_PngDecode_FromMemory(s, srcPx, srcLen, dstPx) : NULL;
+            if (px || !decode) {
+                if (opt_extract && opt_rgba >= 0) {
+                    png_color png_palette[256];
+                    pngPalette(sffPalette(sff, s->palidx), png_palette);
+                    submitPng(sff, pngFilename, s->Size[0], s->Size[1], px, png_palette);
+                } else if (opt_extract) {
+                    save_png(s, srcPx, srcLen, sff, true);
+                }
                 s->data = px;
-                sff->palette_usage[s->palidx]++;
+                counters->palette_usage[s->palidx]++;
             } else {
                 fprintf(stderr, "Error decoding PNG10 sprite data\n");
                 return -1;
             }
             break;
         case 11:
-            // printf("PNG11: palidx=%d\n", s->palidx);
-            if (opt_extract) save_png(s, file, datasize, sff, false);
-            sff->palette_usage[-1]++;
-            break;
         case 12:
-            // printf("PNG12: palidx=%d\n", s->palidx);
-            if (opt_extract) save_png(s, file, datasize, sff, false);
-            sff->palette_usage[-1]++;
+            // printf("PNG%d: palidx=%d\n", format, s->palidx);
+            px = decode ? RGBA_PngDecode(s, srcPx, srcLen, dstPx) : NULL;
+            if (px || !decode) {
+                if (opt_extract && opt_rgba >= 0) {
+                    submitPng(sff, pngFilename, s->Size[0], s->Size[1], px, NULL);
+                } else if (opt_extract) {
+                    save_png(s, srcPx, srcLen, sff, false);
+                }
+                s->data = px;
+                counters->palette_usage[-1]++;
+            } else {
+                fprintf(stderr, "Error decoding PNG%d sprite data\n", format);
+                return -1;
+            }
             break;
         }
     }
@@ -1432,14 +2608,11 @@ int readSpriteDataV2(Sprite* s, FILE* file, uint64_t offset, uint32_t datasize,
     return 0;
 }
 
+// A linked sprite shares the pixels of src: their size, palette and format. Its own
+// Group, Number and axis stay those of its header
 void spriteCopy(Sprite* dst, const Sprite* src) {
-    dst->Pal = src->Pal;
-    dst->Group = src->Group;
-    dst->Number = src->Number;
     dst->Size[0] = src->Size[0];
     dst->Size[1] = src->Size[1];
-    dst->Offset[0] = src->Offset[0];
-    dst->Offset[1] = src->Offset[1];
     // if (dst->palidx < 0) {
     dst->palidx = src->palidx;
     // }
@@ -1448,98 +2621,306 @@ void spriteCopy(Sprite* dst, const Sprite* src) {
     // dst->data = src->data;
 }
 
-// function to extract SFF
-int extractSff(Sff* sff, const char* filename) {
-    bool character = true;
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
-        fprintf(stderr, "Error opening file %s\n", filename);
+// Number of threads used for the decode pass
+int decodeThreadCount(size_t numJobs) {
+    int n = opt_threads;
+    if (n <= 0) {
+        n = (int) std::thread::hardware_concurrency() / opt_jobs;
+    }
+    if (n < 1) n = 1;
+    if ((size_t) n > numJobs) n = numJobs > 0 ? (int) numJobs : 1;
+    return n;
+}
+
+// --trim: copy the visible part of a sprite from the decode buffer into the arena,
+// a blank sprite keeps no pixels at all
+int trimSprite(Sprite* s, UsageCounters* counters) {
+    TRACE_SCOPE("trim");
+    size_t bpp = isRgbaSprite(s) ? 4 : 1;
+    int left, top, right, bottom;
+    if (!cropBounds(s->data, s->Size[0], s->Size[1], bpp, &left, &top, &right, &bottom)) {
+        s->data = NULL;
+        s->dataW = s->dataH = 0;
+        return 0;
+    }
+    size_t w = right - left + 1, h = bottom - top + 1;
+    uint8_t* px = (uint8_t*) arenaAlloc(counters->arena, w * h * bpp);
+    if (!px) {
+        fprintf(stderr, "Error allocating memory for trimmed sprite data %zux%zu\n", w, h);
         return -1;
     }
+    for (size_t y = 0; y < h; y++) {
+        memcpy(px + y * w * bpp, s->data + ((top + y) * s->Size[0] + left) * bpp, w * bpp);
+    }
+    s->data = px;
+    s->dataX = left;
+    s->dataY = top;
+    s->dataW = w;
+    s->dataH = h;
+    return 0;
+}
+
+// Decode one sprite job, reader and counters belong to the calling thread
+int decodeSprite(Sff* sff, SpriteJob* job, MemReader* reader, UsageCounters* counters) {
+    Sprite* s = job->sprite;
+    TRACE_SCOPE(std::string("decode ") + formatName(sff->header.Ver0 == 1 ? 1 : -s->rle));
+    int rc;
+    if (sff->header.Ver0 == 1) {
+        rc = decodeSpriteDataV1(job, sff, counters);
+    } else {
+        rc = readSpriteDataV2(s, reader, job->offset, job->datasize, sff, counters);
+    }
+    if (rc != 0 || !s->data) return rc;
+    s->dataX = s->dataY = 0;
+    s->dataW = s->Size[0];
+    s->dataH = s->Size[1];
+    return opt_trim ? trimSprite(s, counters) : 0;
+}
 
-    // Copy filename to sff structure
-    strncpy(sff->filename, filename, sizeof(sff->filename) - 1);
+// Ranges of encoded sprite data closer than this are read ahead as one span
+#define READ_PLAN_GAP (256 * 1024)
+
+// Byte range of the encoded data of a job inside the mapped file
+static void jobRange(const Sff* sff, const MappedFile* mf, const SpriteJob& job, uint64_t* start, uint64_t* end) {
+    if (sff->header.Ver0 == 1) {
+        *start = job.srcPx ? (uint64_t) (job.srcPx - mf->data) : 0;
+        *end = *start + job.srcLen;
+    } else {
+        *start = job.offset;
+        *end = std::min((uint64_t) mf->size, job.offset + job.datasize);
+    }
+}
+
+// Read planner: the sprites decode in ascending file order instead of header order,
+// and the coalesced spans of their data are handed to the kernel up front, in that
+// same order, so the disk reads the file front to back with a readahead queue full
+// instead of seeking from one page fault to the next. Files read into memory
+// (PhysFS, no mmap) are already read in one go
+void planReads(const Sff* sff, const MappedFile* mf, const std::vector<SpriteJob>& jobs, std::vector<uint32_t>& order) {
+    TRACE_SCOPE("read plan");
+    std::vector<uint64_t> starts(jobs.size());
+    order.resize(jobs.size());
+    for (size_t k = 0; k < jobs.size(); k++) {
+        uint64_t end;
+        jobRange(sff, mf, jobs[k], &starts[k], &end);
+        order[k] = (uint32_t) k;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return starts[a] < starts[b]; });
+    if (!mf->mapped) return;
+
+#ifndef _WIN32
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t spanStart = 0, spanEnd = 0;
+    auto flush = [&]() {
+        if (spanEnd <= spanStart) return;
+        uint64_t first = spanStart & ~(uint64_t) (pageSize - 1);
+        madvise((void*) (mf->data + first), (size_t) (spanEnd - first), MADV_WILLNEED);
+    };
+    for (uint32_t k : order) {
+        uint64_t start, end;
+        jobRange(sff, mf, jobs[k], &start, &end);
+        if (end <= start) continue;
+        if (spanEnd > spanStart && start <= spanEnd + READ_PLAN_GAP) {
+            spanEnd = std::max(spanEnd, end);
+            continue;
+        }
+        flush();
+        spanStart = start;
+        spanEnd = end;
+    }
+    flush();
+#endif
+}
+
+// Decode pass: worker threads take sprite jobs from a shared index until all are done,
+// in the file order planReads() gives them.
+// Every sprite writes only its own data buffer, the usage counters and pixel arenas are per thread
+int decodeSprites(Sff* sff, const MappedFile* mf, std::vector<SpriteJob>& jobs) {
+    std::vector<uint32_t> order;
+    planReads(sff, mf, jobs, order);
+    int numThreads = decodeThreadCount(jobs.size());
+    std::vector<UsageCounters> counters(numThreads);
+    sff->pixelArenas.resize(numThreads);
+    for (int t = 0; t < numThreads; t++) {
+        counters[t].arena = &sff->pixelArenas[t];
+    }
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+
+    auto worker = [&](int t) {
+        MemReader reader = { mf->data, mf->size, 0 };
+        TRACE_FILE(sff->filename);
+        while (!failed) {
+            size_t k = next++;
+            if (k >= jobs.size()) break;
+            if (decodeSprite(sff, &jobs[order[k]], &reader, &counters[t]) != 0) failed = true;
+        }
+    };
+
+    // -x: the PNGs are encoded by a pool of their own while the sprites decode
+    EncodeQueue encoder;
+    if (opt_extract) {
+        encodeQueueStart(&encoder, encodeThreadCount(), sff);
+        sff->encoder = &encoder;
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++) {
+        threads.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& th : threads) {
+        th.join();
+    }
+    if (sff->encoder) {
+        encodeQueueFinish(&encoder);
+        sff->encoder = NULL;
+    }
+
+    // Merge per-thread counters
+    for (const auto& c : counters) {
+        for (const auto& pair : c.palette_usage) sff->palette_usage[pair.first] += pair.second;
+        for (const auto& pair : c.format_usage) sff->format_usage[pair.first] += pair.second;
+    }
+    return failed ? -1 : 0;
+}
+
+// (Group, Number) lookup table: open addressing with linear probing, a power of two
+// number of slots at most half full, -1 = empty slot. The first sprite of a key wins.
+// The atlas .bin file (--bin-meta) carries a table with the same hash
+static inline uint32_t spriteKeyHash(uint16_t group, uint16_t number) {
+    return (uint32_t) group * 40503u + (uint32_t) number * 31161u;
+}
+
+static size_t spriteTableSize(size_t count) {
+    size_t size = 2;
+    while (size < count * 2) size <<= 1;
+    return size;
+}
+
+// Fill table with the entries 0..count-1, key(k) gives the group and number of entry k
+template <typename KeyFn>
+void buildSpriteTable(std::vector<int32_t>& table, size_t count, KeyFn key) {
+    table.assign(spriteTableSize(count), -1);
+    size_t mask = table.size() - 1;
+    for (size_t k = 0; k < count; k++) {
+        std::pair<uint16_t, uint16_t> gn = key(k);
+        size_t slot = spriteKeyHash(gn.first, gn.second) & mask;
+        for (; table[slot] >= 0; slot = (slot + 1) & mask) {
+            if (key(table[slot]) == gn) break;
+        }
+        if (table[slot] < 0) table[slot] = (int32_t) k;
+    }
+}
+
+// Index of sprite (group, number) in sff->sprites, -1 when there is none
+int findSprite(const Sff* sff, uint16_t group, uint16_t number) {
+    if (sff->spriteTable.empty()) return -1;
+    size_t mask = sff->spriteTable.size() - 1;
+    for (size_t slot = spriteKeyHash(group, number) & mask; sff->spriteTable[slot] >= 0; slot = (slot + 1) & mask) {
+        const Sprite* s = sff->sprites[sff->spriteTable[slot]];
+        if (s->Group == group && s->Number == number) return sff->spriteTable[slot];
+    }
+    return -1;
+}
+
+// Header pass: read the SFF header, the palettes and every sprite header from the
+// mapped file, and collect a SpriteJob for each sprite that has pixel data
+int indexSff(Sff* sff, const MappedFile* mf, std::vector<SpriteJob>& jobs) {
+    bool character = true;
+    MemReader reader = { mf->data, mf->size, 0 };
+    MemReader* file = &reader;
 
     // Read the header
     uint32_t lofs, tofs;
     if (readSffHeader(sff, file, &lofs, &tofs) != 0) {
-        fclose(file);
+        return -1;
+    }
+    // Every sprite and palette has a header in the file, counts it cannot hold are
+    // refused before anything is allocated for them
+    size_t spriteHeaderSize = sff->header.Ver0 == 1 ? 32 : 28;
+    if (sff->header.NumberOfSprites > mf->size / spriteHeaderSize || sff->header.NumberOfPalettes > mf->size / 16) {
+        fprintf(stderr, "Invalid SFF header: %u sprites and %u palettes in %zu bytes\n",
+            sff->header.NumberOfSprites, sff->header.NumberOfPalettes, mf->size);
         return -1;
     }
 
     if (sff->header.Ver0 != 1) {
+        TRACE_SCOPE("palettes");
         // Allocate memory for palettes
+        // A palette with the group and number of an earlier one shares its colours
         std::map<std::array<int, 2>, int> uniquePals;
-        sff->palList.numPalettes = 0;
-        for (int i = 0; i < sff->header.NumberOfPalettes && i < MAX_PAL_NO; i++) {
-            fseek(file, sff->header.FirstPaletteHeaderOffset + i * 16, SEEK_SET);
+        for (int i = 0; i < (int) sff->header.NumberOfPalettes; i++) {
+            mseek(file, sff->header.FirstPaletteHeaderOffset + i * 16, SEEK_SET);
             int16_t gn[3];
-            if (fread(gn, sizeof(uint16_t), 3, file) != 3) {
+            if (mread(gn, sizeof(uint16_t), 3, file) != 3) {
                 fprintf(stderr, "Error reading palette group\n");
-                fclose(file);
                 return -1;
             }
             // printf("Palette %d: Group %d, Number %d, ColNumber %d\n", i, gn[0], gn[1], gn[2]);
 
             uint16_t link;
-            if (fread(&link, sizeof(uint16_t), 1, file) != 1) {
+            if (mread(&link, sizeof(uint16_t), 1, file) != 1) {
                 fprintf(stderr, "Error reading palette link\n");
-                fclose(file);
                 return -1;
             }
             // printf("Palette link: %d\n", link);
 
             uint32_t ofs, siz;
-            if (fread(&ofs, sizeof(uint32_t), 1, file) != 1) {
+            if (mread(&ofs, sizeof(uint32_t), 1, file) != 1) {
                 fprintf(stderr, "Error reading palette offset\n");
-                fclose(file);
                 return -1;
             }
-            if (fread(&siz, sizeof(uint32_t), 1, file) != 1) {
+            if (mread(&siz, sizeof(uint32_t), 1, file) != 1) {
                 fprintf(stderr, "Error reading palette size\n");
-                fclose(file);
                 return -1;
             }
 
             // Check if the palette is unique
             std::array<int, 2> key = { gn[0], gn[1] };
-            if (uniquePals.find(key) == uniquePals.end()) {
-                fseek(file, lofs + ofs, SEEK_SET);
-                if (fread(sff->palList.palettes[i], sizeof(uint32_t), 256, file) != 256) {
+            auto same = uniquePals.find(key);
+            if (same == uniquePals.end()) {
+                uint32_t colors[256];
+                mseek(file, lofs + ofs, SEEK_SET);
+                if (mread(colors, sizeof(uint32_t), 256, file) != 256) {
                     fprintf(stderr, "Error reading palette data\n");
-                    fclose(file);
                     return -1;
                 }
+                for (int c = 0; c < 256; c++) colors[c] &= 0xFFFFFF;
+                addSffPalette(sff, colors, gn[0], gn[1]);
                 uniquePals[key] = i;
-                sff->palList.paletteMap[i] = sff->palList.numPalettes;
-                sff->palList.numPalettes++;
+                sff->actPalettes.push_back({ i, gn[0], gn[1] });
             } else {
-                // If the palette is not unique, use the existing one
-                printf("Palette %d(%d,%d) is not unique, using palette %d\nIncomplete code\n", i, gn[0], gn[1], uniquePals[key]);
+                fprintf(sff->out, "Palette %d(%d,%d) is not unique, using palette %d\n", i, gn[0], gn[1], same->second);
+                sff->palettes.push_back(sff->palettes[same->second]);
+                sff->paletteIds.push_back({ sff->paletteIds[same->second][0], gn[0], gn[1] });
             }
         }
     }
 
-    // Allocate memory for sprites
-    sff->sprites = (Sprite**) malloc(sff->header.NumberOfSprites * sizeof(Sprite*));
+    // Header pass: index all sprite headers and resolve linked sprites
+    TRACE_SCOPE("sprite headers");
+    sff->sprites = newSprites(&sff->arena, sff->header.NumberOfSprites);
+    if (!sff->sprites) {
+        fprintf(stderr, "Error allocating memory for %u sprites\n", sff->header.NumberOfSprites);
+        return -1;
+    }
+    jobs.reserve(sff->header.NumberOfSprites);
     Sprite* prev = NULL;
     sff->numLinkedSprites = 0;
     long shofs = sff->header.FirstSpriteHeaderOffset;
     for (int i = 0; i < sff->header.NumberOfSprites; i++) {
         uint32_t xofs, size;
         uint16_t indexOfPrevious;
-        sff->sprites[i] = newSprite();
-        fseek(file, shofs, SEEK_SET);
+        mseek(file, shofs, SEEK_SET);
         switch (sff->header.Ver0) {
         case 1:
             if (readSpriteHeaderV1(sff->sprites[i], file, &xofs, &size, &indexOfPrevious) != 0) {
-                fclose(file);
                 return -1;
             }
             break;
         case 2:
             if (readSpriteHeaderV2(sff->sprites[i], file, &xofs, &size, lofs, tofs, &indexOfPrevious) != 0) {
-                fclose(file);
                 return -1;
             }
             // printf("readSpriteHeaderV2(%d: %d,%d) xofs=%d size=%d lofs=%d tofs=%d indexOfPrevious=%d\n", i, sff->sprites[i]->Group, sff->sprites[i]->Number, xofs, size, lofs, tofs, indexOfPrevious);
@@ -1553,30 +2934,31 @@ int extractSff(Sff* sff, const char* filename) {
                 Sprite* dst = sff->sprites[i];
                 Sprite* src = sff->sprites[indexOfPrevious];
                 spriteCopy(dst, src);
+                dst->link = indexOfPrevious;
                 // printf("Info: Sprite[%d] use prev Sprite[%d]\n", i, indexOfPrevious);
             } else {
-                printf("Warning: Sprite %d has no size\n", i);
+                fprintf(sff->out, "Warning: Sprite %d has no size\n", i);
                 sff->sprites[i]->palidx = 0;
             }
         } else {
+            SpriteJob job = {};
             switch (sff->header.Ver0) {
             case 1:
                 if (sff->sprites[i]->Group == 0 && sff->sprites[i]->Number == 0) {
                     character = false;
                 }
                 // printf("Sprite[%d] (%d,%d) ", i, sff->sprites[i]->Group, sff->sprites[i]->Number);
-                if (readSpriteDataV1(sff->sprites[i], file, sff, shofs + 32, size, xofs, prev, &sff->palettes, character) != 0) {
-                    fclose(file);
+                if (readSpriteDataV1(sff->sprites[i], file, sff, shofs + 32, size, xofs, prev, character, &job) != 0) {
                     return -1;
                 }
                 break;
             case 2:
-                if (readSpriteDataV2(sff->sprites[i], file, xofs, size, sff) != 0) {
-                    fclose(file);
-                    return -1;
-                }
+                job.sprite = sff->sprites[i];
+                job.offset = xofs;
+                job.datasize = size;
                 break;
             }
+            jobs.push_back(job);
 
             // if use previous sprite Group 9000 and Number 0 only (fix for SFF v1)
             if (sff->sprites[i]->Group == 9000) {
@@ -1594,32 +2976,437 @@ int extractSff(Sff* sff, const char* filename) {
             shofs += 28;
         }
         
-        // Set default opt_palidx for sprite with Group 0 and Number 0
-        if (sff->sprites[i]->Group == 0 && sff->sprites[i]->Number == 0 && opt_palidx == 0) {
-            opt_palidx = sff->sprites[i]->palidx;
+        // Set default atlas palette for sprite with Group 0 and Number 0
+        if (sff->sprites[i]->Group == 0 && sff->sprites[i]->Number == 0 && sff->palidx == 0) {
+            sff->palidx = sff->sprites[i]->palidx;
         }
     }
     // if SFF == v1 then update total palette
     if (sff->header.Ver0 == 1) {
         sff->header.NumberOfPalettes = sff->palettes.size();
     }
-    fclose(file);
+
+    buildSpriteTable(sff->spriteTable, sff->header.NumberOfSprites, [sff](size_t k) {
+        return std::make_pair(sff->sprites[k]->Group, sff->sprites[k]->Number);
+    });
+    return 0;
+}
+
+// -i info scan: the counts the decode pass would report, taken from the sprite headers
+// alone. Only sprites with data are counted, like the decoders do
+void countSpriteHeaders(Sff* sff, const std::vector<SpriteJob>& jobs) {
+    for (const SpriteJob& job : jobs) {
+        const Sprite* s = job.sprite;
+        if (sff->header.Ver0 == 1) {
+            sff->format_usage[1]++;
+            sff->palette_usage[s->palidx]++;
+            continue;
+        }
+        int format = -s->rle;
+        if (format <= 0) continue;
+        sff->format_usage[format]++;
+        if (format == 11 || format == 12) {
+            sff->palette_usage[-1]++;
+        } else if ((2 <= format && format <= 4) || format == 10) {
+            sff->palette_usage[s->palidx]++;
+        }
+    }
+}
+
+// -i without -x, -X or --write-sff only scans the headers, no sprite is decoded and no atlas built
+bool headerOnly() {
+    return opt_sff_info && !opt_extract && opt_write_sff < 0;
+}
+
+// All Size[0] x Size[1] palette indices of a decoded sprite, 0 outside the part
+// --trim kept
+static void spriteIndices(const Sprite* s, std::vector<uint8_t>& px) {
+    px.assign((size_t) s->Size[0] * s->Size[1], 0);
+    if (!s->data) return;
+    for (size_t y = 0; y < s->dataH; y++) {
+        memcpy(px.data() + (s->dataY + y) * s->Size[0] + s->dataX, s->data + y * s->dataW, s->dataW);
+    }
+}
+
+// --write-sff: write the decoded file back out as <name>_repack.sff, SFF v2 whatever
+// the input was. Indexed sprites are encoded again under the policy, true colour ones
+// are copied. Sprites equal in size, axis, palette and data become links to the first,
+// palettes with the same colours share one copy
+// Data of a written indexed sprite: the raw size, then the payload of the encoding picked
+static void sffCopyData(SffWriterSprite& w, const std::vector<uint8_t>& px, SffPolicy policy, const uint8_t* png, size_t pngLen,
+    std::vector<uint8_t>& payload) {
+    w.format = (uint8_t) sff_pick_encoding(px.data(), px.size(), policy, png, pngLen, payload);
+    w.data.resize(4 + payload.size());
+    uint32_t rawLen = (uint32_t) px.size();
+    memcpy(w.data.data(), &rawLen, 4);
+    memcpy(w.data.data() + 4, payload.data(), payload.size());
+}
+
+void freeSff(Sff* sff);
+
+// --write-sff round trip: the copy read back holds every input sprite under the key,
+// axis and size of its header as read, and links where the writer put them
+int checkSffCopy(const Sff* sff, const std::vector<SffWriterSprite>& sprites, const std::vector<uint8_t>& out, const char* filename) {
+    MappedFile mf = {};
+    mf.data = out.data();
+    mf.size = out.size();
+    Sff copy{};
+    copy.out = tmpfile();   // the copy repeats the messages of the input
+    if (!copy.out) copy.out = sff->out;
+    std::vector<SpriteJob> jobs;
+    int rc = indexSff(&copy, &mf, jobs);
+    if (rc != 0 || copy.header.NumberOfSprites != sff->header.NumberOfSprites) {
+        fprintf(stderr, "Error, %s does not read back\n", filename);
+        rc = -1;
+    }
+    for (uint32_t i = 0; rc == 0 && i < sff->header.NumberOfSprites; i++) {
+        const Sprite* a = sff->sprites[i];
+        const Sprite* b = copy.sprites[i];
+        if (b->Group != a->Group || b->Number != a->Number || b->Offset[0] != a->Offset[0] || b->Offset[1] != a->Offset[1] ||
+            b->Size[0] != sprites[i].width || b->Size[1] != sprites[i].height || (b->link >= 0) != (sprites[i].link >= 0)) {
+            fprintf(stderr, "Error, sprite %u (%d,%d) of %s reads back as (%d,%d)\n", i, a->Group, a->Number, filename, b->Group, b->Number);
+            rc = -1;
+        }
+    }
+    if (copy.out != sff->out) fclose(copy.out);
+    freeSff(&copy);
+    return rc;
+}
+
+int writeSffCopy(Sff* sff, const MappedFile* mf, const std::vector<SpriteJob>& jobs) {
+    TRACE_SCOPE("write sff");
+    SffPolicy policy = (SffPolicy) opt_write_sff;
+    uint32_t num = sff->header.NumberOfSprites;
+    std::vector<SffWriterSprite> sprites(num);
+    std::vector<const SpriteJob*> jobOf(num, NULL);
+    for (const SpriteJob& job : jobs) {
+        jobOf[job.sprite - sff->sprites[0]] = &job;
+    }
+    for (uint32_t i = 0; i < num; i++) {
+        const Sprite* s = sff->sprites[i];
+        SffWriterSprite& w = sprites[i];
+        w.group = s->Group;
+        w.number = s->Number;
+        w.width = s->Size[0];
+        w.height = s->Size[1];
+        w.x = s->Offset[0];
+        w.y = s->Offset[1];
+        w.link = jobOf[i] ? -1 : s->link;
+        w.coldepth = 8;
+        w.palidx = s->palidx < 0 ? 0 : (uint16_t) s->palidx;
+        // Links of links point at the sprite holding the data
+        if (w.link >= 0 && sprites[w.link].link >= 0) w.link = sprites[w.link].link;
+        // No data and no link back (size 0 linking forward): one transparent pixel,
+        // size 0 would read as a link to sprite 0
+        if (!jobOf[i] && w.link < 0) {
+            std::vector<uint8_t> px(1, 0), payload;
+            w.width = w.height = 1;
+            sffCopyData(w, px, policy, NULL, 0, payload);
+        }
+    }
+
+    // Encode on the decode threads, each sprite writes only its own entry
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        std::vector<uint8_t> px, payload;
+        for (size_t i; (i = next++) < num;) {
+            const SpriteJob* job = jobOf[i];
+            if (!job) continue;
+            const Sprite* s = job->sprite;
+            SffWriterSprite& w = sprites[i];
+            int format = sff->header.Ver0 == 1 ? 1 : -s->rle;
+            MemReader reader = { mf->data, mf->size, 0 };
+            if (format == 11 || format == 12) {
+                mseek(&reader, job->offset, SEEK_SET);
+                const uint8_t* src = mpeek(&reader, job->datasize);
+                if (src) w.data.assign(src, src + job->datasize);
+                w.format = (uint8_t) format;
+                w.coldepth = 32;
+                continue;
+            }
+            const uint8_t* png = NULL;
+            size_t pngLen = 0;
+            if (format == 0) {
+                // Raw indices are not decoded, they are the data itself
+                mseek(&reader, job->offset, SEEK_SET);
+                size_t len = std::min((size_t) job->datasize, (size_t) s->Size[0] * s->Size[1]);
+                const uint8_t* src = mpeek(&reader, len);
+                px.assign((size_t) s->Size[0] * s->Size[1], 0);
+                if (src) memcpy(px.data(), src, len);
+            } else {
+                spriteIndices(s, px);
+            }
+            if (format == 10 && job->datasize > 4) {
+                mseek(&reader, job->offset + 4, SEEK_SET);
+                pngLen = job->datasize - 4;
+                png = mpeek(&reader, pngLen);
+            }
+            sffCopyData(w, px, policy, png, png ? pngLen : 0, payload);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < decodeThreadCount(num); t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& th : threads) {
+        th.join();
+    }
+
+    // Identical sprites become links, identical data implies the same format
+    std::map<uint64_t, std::vector<uint32_t>> seen;
+    size_t numLinked = 0;
+    for (uint32_t i = 0; i < num; i++) {
+        SffWriterSprite& w = sprites[i];
+        if (w.link >= 0) {
+            numLinked++;
+            continue;
+        }
+        uint64_t h = fnv1a_64(w.data.data(), w.data.size(), FNV1A_64_INIT);
+        h = fnv1a_64(&w.width, sizeof(uint16_t) * 2, h);
+        std::vector<uint32_t>& same = seen[h];
+        for (uint32_t k : same) {
+            const SffWriterSprite& o = sprites[k];
+            if (o.width == w.width && o.height == w.height && o.x == w.x && o.y == w.y && o.palidx == w.palidx &&
+                o.data == w.data) {
+                w.link = (int) k;
+                w.data.clear();
+                numLinked++;
+                break;
+            }
+        }
+        if (w.link < 0) same.push_back(i);
+    }
+
+    // SFF v1 palettes are keyed by their sprite, they get numbers of their own
+    std::vector<SffWriterPalette> palettes(sff->palettes.size());
+    std::map<int, int> firstOfEntry;
+    for (size_t k = 0; k < palettes.size(); k++) {
+        SffWriterPalette& p = palettes[k];
+        p.group = sff->header.Ver0 == 1 ? 1 : (int16_t) sff->paletteIds[k][1];
+        p.number = sff->header.Ver0 == 1 ? (int16_t) (k + 1) : (int16_t) sff->paletteIds[k][2];
+        p.colors = sff->palettes[k];
+        auto first = firstOfEntry.emplace(sff->paletteIds[k][0], (int) k);
+        p.link = first.second ? -1 : first.first->second;
+    }
+
+    std::vector<uint8_t> out;
+    sff_write_v2(sprites, palettes, out);
+    char filename[512];
+    char name[300];
+    snprintf(name, sizeof(name), "%s_repack", sff->basename);
+    sffOutputName(sff, filename, sizeof(filename), name, ".sff");
+    if (checkSffCopy(sff, sprites, out, filename) != 0) return -1;
+    if (writeOutput(sff, filename, out.data(), out.size(), true) != 0) return -1;
+
+    std::map<int, int> formats;
+    for (const SffWriterSprite& w : sprites) {
+        if (w.link < 0) formats[w.format]++;
+    }
+    fprintf(sff->out, "SFF %s (%s): %zu -> %zu bytes, %zu linked sprites, %zu palettes (%zu shared)", filename,
+        sff_policy_name(policy), mf->size, out.size(), numLinked, palettes.size(), palettes.size() - firstOfEntry.size());
+    for (const auto& pair : formats) {
+        fprintf(sff->out, ", %d %s", pair.second, formatName(pair.first));
+    }
+    fprintf(sff->out, "\n");
+    return 0;
+}
+
+// --watch: hash what the pixels of every sprite decode from, its encoded data, size,
+// format and palette colours. Jobs whose sprite hashes the same as in the resident
+// decode go to kept, the others to changed
+void splitResidentJobs(Sff* sff, const MappedFile* mf, const std::vector<SpriteJob>& jobs,
+    std::vector<SpriteJob>& kept, std::vector<SpriteJob>& changed) {
+    TRACE_SCOPE("watch hash");
+    const Sff* resident = sff->resident;
+    sff->spriteHashes.assign(sff->header.NumberOfSprites, 0);
+    for (const SpriteJob& job : jobs) {
+        const Sprite* s = job.sprite;
+        uint64_t start, end;
+        jobRange(sff, mf, job, &start, &end);
+        uint64_t h = fnv1a_64(s->Size, sizeof(s->Size), FNV1A_64_INIT);
+        h = fnv1a_64(&s->rle, sizeof(s->rle), h);
+        h = fnv1a_64(&job.bpl, sizeof(job.bpl), h);
+        h = fnv1a_64(sffPalette(sff, s->palidx), 256 * sizeof(uint32_t), h);
+        if (end > start) h = fnv1a_64(mf->data + start, end - start, h);
+        h |= 1;
+        sff->spriteHashes[s - sff->sprites[0]] = h;
+
+        int k = resident ? findSprite(resident, s->Group, s->Number) : -1;
+        if (k >= 0 && resident->spriteHashes[k] == h) {
+            kept.push_back(job);
+        } else {
+            changed.push_back(job);
+        }
+    }
+}
+
+// --watch: the kept sprites take their pixels from the resident decode, after the
+// decode pass so they go into its first arena
+int copyResidentSprites(Sff* sff, const std::vector<SpriteJob>& kept) {
+    TRACE_SCOPE("watch copy");
+    Arena* arena = &sff->pixelArenas[0];
+    for (const SpriteJob& job : kept) {
+        Sprite* s = job.sprite;
+        const Sprite* o = sff->resident->sprites[findSprite(sff->resident, s->Group, s->Number)];
+        s->rle = o->rle;
+        s->dataX = o->dataX;
+        s->dataY = o->dataY;
+        s->dataW = o->dataW;
+        s->dataH = o->dataH;
+        s->data = NULL;
+        if (!o->data) continue;
+        size_t size = (size_t) o->dataW * o->dataH * (isRgbaSprite(o) ? 4 : 1);
+        s->data = (uint8_t*) arenaAlloc(arena, size);
+        if (!s->data) {
+            fprintf(stderr, "Error allocating memory for sprite data %dx%d\n", o->dataW, o->dataH);
+            return -1;
+        }
+        memcpy(s->data, o->data, size);
+    }
+    countSpriteHeaders(sff, kept);
     return 0;
 }
 
-int initAtlas(Atlas* atlas, Sff* sff, int palidx) {
+// function to extract SFF, without decode only the headers and palettes are read
+int extractSff(Sff* sff, const char* filename, bool decode) {
+    MappedFile mf;
+    if (openInput(&mf, filename) != 0) {
+        fprintf(stderr, "Error opening file %s\n", filename);
+        return -1;
+    }
+
+    // Copy filename to sff structure, the output names derive from it
+    strncpy(sff->filename, filename, sizeof(sff->filename) - 1);
+    get_basename_no_ext(sff->filename, sff->basename, sizeof(sff->basename));
+    char spriteDir[512];
+    outputPath(spriteDir, sizeof(spriteDir), sff->basename, "");
+    if (opt_zip) {
+        snprintf(sff->spritePrefix, sizeof(sff->spritePrefix), "%s", sff->basename);
+    } else {
+        snprintf(sff->spritePrefix, sizeof(sff->spritePrefix), "%s%s%s", spriteDir, SEP, sff->basename);
+    }
+
+    std::vector<SpriteJob> jobs;
+    int rc = indexSff(sff, &mf, jobs);
+    if (rc == 0 && !decode) {
+        countSpriteHeaders(sff, jobs);
+        closeMappedFile(&mf);
+        return 0;
+    }
+
+    // Decode pass, -x writes into a directory created once here, -X into <name>.zip
+    if (rc == 0 && opt_extract) {
+        rc = opt_zip ? openSffArchive(sff) : createDirectory(spriteDir);
+    }
+    // --watch: only the sprites that changed since the resident decode are decoded again
+    std::vector<SpriteJob> kept, changed;
+    if (rc == 0 && opt_watch) {
+        splitResidentJobs(sff, &mf, jobs, kept, changed);
+        if (sff->resident) fprintf(sff->out, "%zu of %zu sprites changed\n", changed.size(), jobs.size());
+    }
+    if (rc == 0) {
+        rc = decodeSprites(sff, &mf, opt_watch ? changed : jobs);
+    }
+    if (rc == 0 && !kept.empty()) {
+        rc = copyResidentSprites(sff, kept);
+    }
+    if (rc == 0 && opt_write_sff >= 0) {
+        rc = writeSffCopy(sff, &mf, jobs);
+    }
+    closeMappedFile(&mf);
+    return rc;
+}
+
+// Give linked sprites and sprites whose cropped bitmap equals an earlier one the rect
+// of that sprite: their w and h are cleared so only the first copy is packed, and
+// shareAtlasRects() copies its place back after packing. Returns the pixel area saved
+int64_t dedupeAtlas(Atlas* atlas) {
+    Sff* sff = atlas->sff;
+    uint32_t num = sff->header.NumberOfSprites;
+    size_t bpp = atlas->rgba ? 4 : 1;
+    int64_t saved = 0;
+    atlas->dupOf = (int*) malloc(num * sizeof(int));
+    if (!atlas->dupOf) { fprintf(stderr, "Not enough memory\n"); exit(1); }
+
+    std::map<uint64_t, std::vector<uint32_t>> bitmaps;
+    for (uint32_t i = 0; i < num; i++) {
+        Sprite* s = sff->sprites[i];
+        stbrp_rect* r = &atlas->rects[i];
+        atlas->dupOf[i] = -1;
+        if (!s->data) {
+            // Linked sprite, in the atlas when the sprite it links to is
+            int src = s->link;
+            if (src < 0 || (atlas->rects[src].w <= 0 && atlas->dupOf[src] < 0)) continue;
+            atlas->dupOf[i] = atlas->dupOf[src] >= 0 ? atlas->dupOf[src] : src;
+            s->atlas_x = sff->sprites[src]->atlas_x;
+            s->atlas_y = sff->sprites[src]->atlas_y;
+            r->id = i;
+            continue;
+        }
+        if (r->w <= 0 || r->h <= 0) continue;
+
+        size_t rowBytes = r->w * bpp, stride = s->dataW * bpp;
+        const uint8_t* p = spritePixel(s, s->atlas_x, s->atlas_y, bpp);
+        uint64_t h = fnv1a_64(&r->w, sizeof(r->w), FNV1A_64_INIT);
+        h = fnv1a_64(&r->h, sizeof(r->h), h);
+        for (int y = 0; y < r->h; y++) h = fnv1a_64(p + y * stride, rowBytes, h);
+
+        std::vector<uint32_t>& same = bitmaps[h];
+        for (uint32_t j : same) {
+            Sprite* t = sff->sprites[j];
+            if (atlas->rects[j].w != r->w || atlas->rects[j].h != r->h) continue;
+            const uint8_t* q = spritePixel(t, t->atlas_x, t->atlas_y, bpp);
+            int y;
+            for (y = 0; y < r->h && memcmp(p + y * stride, q + y * t->dataW * bpp, rowBytes) == 0; y++);
+            if (y == r->h) {
+                atlas->dupOf[i] = j;
+                break;
+            }
+        }
+        if (atlas->dupOf[i] >= 0) {
+            saved += (int64_t) s->Size[0] * s->Size[1];
+        } else {
+            same.push_back(i);
+        }
+    }
+    // Only now clear the duplicates, the byte compare above needs their size
+    for (uint32_t i = 0; i < num; i++) {
+        if (atlas->dupOf[i] >= 0) atlas->rects[i].w = atlas->rects[i].h = 0;
+    }
+    return saved;
+}
+
+// After packing: shared sprites take the place (and page) of the sprite they share with
+void shareAtlasRects(Atlas* atlas) {
+    for (uint32_t i = 0; i < atlas->sff->header.NumberOfSprites; i++) {
+        int j = atlas->dupOf[i];
+        if (j < 0) continue;
+        atlas->rects[i] = atlas->rects[j];
+        atlas->rects[i].id = i;
+        if (atlas->page) atlas->page[i] = atlas->page[j];
+    }
+}
+
+int initAtlas(Atlas* atlas, Sff* sff, int palidx, bool rgba) {
+    TRACE_SCOPE("crop scan");
     int64_t prod = 0;
     int crop = 1;
     int inpcrop = 1;
     size_t maxw = 0, maxh = 0;
-    atlas->usePalette = palidx;
+    atlas->usePalette = rgba ? -1 : palidx;
+    atlas->rgba = rgba;
 
     atlas->sff = sff;
+    atlas->page = NULL;
+    atlas->numPages = 0;
+    atlas->dupOf = NULL;
+    atlas->layout = NULL;
+    snprintf(atlas->packing, sizeof(atlas->packing), "pages");
     atlas->rects = (struct stbrp_rect*) malloc(sff->header.NumberOfSprites * sizeof(struct stbrp_rect));
     memset(atlas->rects, 0, sff->header.NumberOfSprites * sizeof(struct stbrp_rect));
     // printf("\ninitAtlas\n");
     for (int i = 0; i < sff->header.NumberOfSprites; i++) {
-        size_t x, y;
         int16_t sprite_width = sff->sprites[i]->Size[0];
         int16_t sprite_height = sff->sprites[i]->Size[1];
         uint8_t* p = sff->sprites[i]->data;
@@ -1629,6 +3416,11 @@ int initAtlas(Atlas* atlas, Sff* sff, int palidx) {
             continue;
         }
 
+        // Indexed and true colour sprites go to separate pages
+        if (isRgbaSprite(sff->sprites[i]) != atlas->rgba) {
+            continue;
+        }
+
         // Only include sprites with the same atlas palette index
         if (atlas->usePalette >= 0) {
             if (sff->sprites[i]->palidx != atlas->usePalette) {
@@ -1647,29 +3439,14 @@ int initAtlas(Atlas* atlas, Sff* sff, int palidx) {
         prod += sff->sprites[i]->Size[0] * sff->sprites[i]->Size[1];
         /* crop input sprite to content */
         if (inpcrop) {
-            for (y = 0; y < sff->sprites[i]->Size[1] && sprite_height > 0; y++) {
-                // printf("i=%d x=%d y=%d spr_w=%d\n", i, x, y, sff->sprites[i]->Size[0]);
-                for (x = 0; x < sff->sprites[i]->Size[0] && !p[(y * sff->sprites[i]->Size[0] + x)]; x++);
-                if (x < sff->sprites[i]->Size[0]) break;
-                sff->sprites[i]->atlas_y++; sprite_height--;
-            }
-            for (y = sff->sprites[i]->Size[1] - 1; y >= sff->sprites[i]->atlas_y && sprite_height > 0; y--) {
-                for (x = 0; x < sff->sprites[i]->Size[0] && !p[(y * sff->sprites[i]->Size[0] + x)]; x++);
-                if (x < sff->sprites[i]->Size[0]) break;
-                sprite_height--;
-            }
-            for (x = 0; x < sff->sprites[i]->Size[0] && sprite_height > 0 && sprite_width > 0; x++) {
-                for (y = 0; y < sprite_height && !p[((y + sff->sprites[i]->atlas_y) * sff->sprites[i]->Size[0] + x)]; y++);
-                if (y < sprite_height) break;
-                sff->sprites[i]->atlas_x++; sprite_width--;
-            }
-            for (x = sff->sprites[i]->Size[0] - 1; x >= sff->sprites[i]->atlas_x && sprite_height > 0 && sprite_width > 0; x--) {
-                for (y = 0; y < sprite_height && !p[((y + sff->sprites[i]->atlas_y) * sff->sprites[i]->Size[0] + x)]; y++);
-                if (y < sprite_height) break;
-                sprite_width--;
-            }
-            if (sprite_width < 1 || sprite_height < 1) {
-                sprite_width = sprite_height = sff->sprites[i]->atlas_x = sff->sprites[i]->atlas_y = 0;
+            int left, top, right, bottom;
+            if (cropBounds(p, sff->sprites[i]->dataW, sff->sprites[i]->dataH, atlas->rgba ? 4 : 1, &left, &top, &right, &bottom)) {
+                sff->sprites[i]->atlas_x = sff->sprites[i]->dataX + left;
+                sff->sprites[i]->atlas_y = sff->sprites[i]->dataY + top;
+                sprite_width = right - left + 1;
+                sprite_height = bottom - top + 1;
+            } else {
+                sprite_width = sprite_height = 0;
             }
         }
         atlas->rects[i].id = i;
@@ -1678,6 +3455,7 @@ int initAtlas(Atlas* atlas, Sff* sff, int palidx) {
 
         // printf("Sprite %d[%d,%d]: %dx%d -> %dx%d\n", i, sff->sprites[i]->Group, sff->sprites[i]->Number,sff->sprites[i]->Size[0], sff->sprites[i]->Size[1], sprite_width, sprite_height);
     }
+    prod -= dedupeAtlas(atlas);
 
     /* calculate an optimal atlas size */
     size_t i;
@@ -1691,170 +3469,652 @@ int initAtlas(Atlas* atlas, Sff* sff, int palidx) {
     return 0;
 }
 
-int generateAtlas(Atlas* atlas) {
-    int crop = 1, tofile = 1;
-    uint8_t* o, * p, * src, * dst;
-    char* meta, * s;
-    stbrp_context ctx;
-    stbrp_node* nodes;
-    uint32_t i, j, num = atlas->sff->header.NumberOfSprites;
-
-    nodes = (stbrp_node*) malloc((atlas->width + 1) * sizeof(stbrp_node));
-    if (!nodes) { fprintf(stderr, "Not enough memory\n"); exit(1); }
-    memset(nodes, 0, (atlas->width + 1) * sizeof(stbrp_node));
-    stbrp_init_target(&ctx, atlas->width, atlas->height, nodes, atlas->width + 1);
-    // printf("Packing %u sprites into %u x %u atlas\n", num, atlas->width, atlas->height);
-    if (!stbrp_pack_rects(&ctx, atlas->rects, num)) {
-        atlas->height <<= 1;
-        memset(nodes, 0, (atlas->width + 1) * sizeof(stbrp_node));
-        for (i = 0; i < num; i++) atlas->rects[i].was_packed = atlas->rects[i].x = atlas->rects[i].y = 0;
-        stbrp_init_target(&ctx, atlas->width, atlas->height, nodes, atlas->width + 1);
-        if (stbrp_pack_rects(&ctx, atlas->rects, num)) goto ok;
-        fprintf(stderr, "Error, sprites do not fit into %u x %u atlas.\n", atlas->width, atlas->height);
-        exit(2);
-    }
-ok:
-    free(nodes);
-
-    // Crop the atlas to the actual size of the sprites
-    if (crop) atlas->width = atlas->height = 0;
-    uint32_t l;
-    for (i = l = 0; i < num; i++) {
-        if (crop) {
-            if (atlas->rects[i].x + atlas->rects[i].w > atlas->width) atlas->width = atlas->rects[i].x + atlas->rects[i].w;
-            if (atlas->rects[i].y + atlas->rects[i].h > atlas->height) atlas->height = atlas->rects[i].y + atlas->rects[i].h;
+// --max-atlas-size: pack the sprites into as many pages of at most maxSize x maxSize
+// as needed. Sprites go in group by group (the Group field), first fit over the pages
+// still open; a group is split over pages only when it does not fit on an empty page
+int packAtlasPages(Atlas* atlas, int maxSize) {
+    uint32_t num = atlas->sff->header.NumberOfSprites;
+    Sprite** sprites = atlas->sff->sprites;
+
+    // Sprite indices that need space, ordered by group and SFF order within a group
+    std::vector<uint32_t> order;
+    for (uint32_t i = 0; i < num; i++) {
+        stbrp_rect* r = &atlas->rects[i];
+        if (r->w <= 0 || r->h <= 0) continue;
+        if (r->w > maxSize || r->h > maxSize) {
+            fprintf(stderr, "Warning: sprite %d,%d (%dx%d) is larger than the maximum atlas size %d, skipped\n",
+                sprites[i]->Group, sprites[i]->Number, r->w, r->h, maxSize);
+            r->w = r->h = 0;
+            continue;
         }
-        l += 32 + 256;
+        order.push_back(i);
     }
-
-    // Check atlas size after cropping
-    if (atlas->width <= 0 || atlas->height <= 0) {
-        fprintf(stderr, "Error, nothing left after cropping atlas. Size= %u x %u\n", atlas->width, atlas->height);
-        return -2;
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return sprites[a]->Group < sprites[b]->Group; });
+    std::deque<std::vector<uint32_t>> groups;
+    for (size_t k = 0; k < order.size(); k++) {
+        if (k == 0 || sprites[order[k]]->Group != sprites[order[k - 1]]->Group) groups.emplace_back();
+        groups.back().push_back(order[k]);
     }
 
-    meta = s = (char*) malloc(l);
-    if (!meta) { fprintf(stderr, "Not enough memory for meta data\n"); exit(1); }
-    memset(meta, 0, l);
-    o = (uint8_t*) malloc(atlas->width * atlas->height);
-    if (!o) { fprintf(stderr, "Not enough memory for atlas output image data\n"); exit(1); }
-    memset(o, 0, atlas->width * atlas->height);
-
-    /* records */
-    // s += sprintf(s, "X\tY\tW\tH\tx\ty\tw\th\txx\tyy\tFilename\n");
-    char filename[256];
-    size_t numProcessedSprite = 0;
-    for (i = 0; i < num; i++) {
-        snprintf(filename, sizeof(filename), "%d,%d", atlas->sff->sprites[i]->Group, atlas->sff->sprites[i]->Number);
-        if (atlas->rects[i].w > 0 && atlas->rects[i].h > 0) {
-            src = atlas->sff->sprites[i]->data + (atlas->sff->sprites[i]->atlas_y * atlas->sff->sprites[i]->Size[0] + atlas->sff->sprites[i]->atlas_x);
-            dst = o + (atlas->width * atlas->rects[i].y + atlas->rects[i].x);
-            for (j = 0; j < atlas->rects[i].h; j++, dst += atlas->width, src += atlas->sff->sprites[i]->Size[0])
-                memcpy(dst, src, atlas->rects[i].w);
-
-            s += sprintf(s, "%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%d\t%d\t%s\n",
-            atlas->rects[i].x, atlas->rects[i].y, atlas->rects[i].w, atlas->rects[i].h,
-            atlas->sff->sprites[i]->atlas_x, atlas->sff->sprites[i]->atlas_y, atlas->sff->sprites[i]->Size[0], atlas->sff->sprites[i]->Size[1],
-            atlas->sff->sprites[i]->Offset[0], atlas->sff->sprites[i]->Offset[1],
-            filename);
-            numProcessedSprite++;
-        }
-    }
-
-    char basename[256];
-    char outFilename[256];
-    get_basename_no_ext(atlas->sff->filename, basename, sizeof(basename));
-    snprintf(outFilename, sizeof(outFilename), "sprite_atlas_%s_p%d.png", basename, opt_palidx);
-    if (atlas->sff->header.Ver0 == 1) {
-        save_as_png(outFilename, atlas->width, atlas->height, o, atlas->sff->palettes[atlas->usePalette<0 ? 0 : atlas->usePalette]);
-    } else {
-        uint32_t* sff_palette = atlas->sff->palList.palettes[atlas->usePalette<0 ? 0 : atlas->usePalette];
-        png_color png_palette[256];
-        for (int i = 0; i < 256; i++) {
-            png_palette[i].red = (sff_palette[i] >> 0) & 0xFF;
-            png_palette[i].green = (sff_palette[i] >> 8) & 0xFF;
-            png_palette[i].blue = (sff_palette[i] >> 16) & 0xFF;
-        }
-        save_as_png(outFilename, atlas->width, atlas->height, o, png_palette);
-    }
-    free(o);
-    printf("Atlas %s (%ux%u) created with %u sprites and palette_index=%d\n", outFilename, atlas->width, atlas->height, numProcessedSprite, opt_palidx);
-    printf("___________________________________________________________\n\n");
-    /* save meta info to a separate file too */
-    if (tofile) {
-        snprintf(outFilename, sizeof(outFilename), "sprite_atlas_%s_p%d.txt", basename, opt_palidx);
-        FILE* f = fopen(outFilename, "wb+");
-        if (f) {
-            fwrite(meta, 1, s - meta, f);
-            fclose(f);
+    atlas->page = (int*) malloc(num * sizeof(int));
+    if (!atlas->page) { fprintf(stderr, "Not enough memory\n"); exit(1); }
+    for (uint32_t i = 0; i < num; i++) atlas->page[i] = -1;
+    atlas->numPages = 0;
+
+    std::vector<stbrp_node> nodes(maxSize + 1);
+    std::vector<stbrp_rect> batch;
+    while (!groups.empty()) {
+        stbrp_context ctx;
+        stbrp_init_target(&ctx, maxSize, maxSize, nodes.data(), (int) nodes.size());
+        int page = atlas->numPages++;
+        bool empty = true;
+        for (auto g = groups.begin(); g != groups.end();) {
+            batch.clear();
+            for (uint32_t i : *g) batch.push_back(atlas->rects[i]);
+            bool all = stbrp_pack_rects(&ctx, batch.data(), (int) batch.size()) != 0;
+            if (all || empty) {
+                // A group too big for a whole page keeps what fit, the rest goes on
+                std::vector<uint32_t> rest;
+                for (size_t k = 0; k < batch.size(); k++) {
+                    uint32_t i = (*g)[k];
+                    if (batch[k].was_packed) {
+                        atlas->rects[i].x = batch[k].x;
+                        atlas->rects[i].y = batch[k].y;
+                        atlas->rects[i].was_packed = 1;
+                        atlas->page[i] = page;
+                    } else {
+                        rest.push_back(i);
+                    }
+                }
+                empty = false;
+                if (rest.empty()) {
+                    g = groups.erase(g);
+                } else {
+                    *g = rest;
+                    ++g;
+                }
+            } else {
+                // The space taken by the partial pack is lost on this page, the
+                // whole group waits for the next one
+                ++g;
+            }
         }
     }
-    free(meta);
     return 0;
 }
 
-int deinitAtlas(Atlas* atlas) {
-    free(atlas->rects);
-    return 0;
-}
+// Packing strategies tried for a single page atlas, the one with the smallest
+// cropped page wins. stb_rect_pack always sorts by height, other orders are
+// packed one rect at a time in that order
+typedef enum {
+    PACK_ORDER_HEIGHT,      // stb_rect_pack's own order
+    PACK_ORDER_AREA,
+    PACK_ORDER_WIDTH,
+    PACK_ORDER_PERIMETER
+} PackOrder;
 
-void freeSff(Sff* sff) {
-    // clean up sprite
-    for (int i = 0; i < sff->header.NumberOfSprites; i++) {
-        if (sff->sprites[i]->data) free(sff->sprites[i]->data);
-        free(sff->sprites[i]);
-    }
-    free(sff->sprites);
+#define PACK_ORDER_COUNT 4
 
-    // clean up sff->palettes
-    for (png_color* palette : sff->palettes) {
-        delete[] palette;
+static const char* packOrderName[PACK_ORDER_COUNT] = { "height", "area", "width", "perimeter" };
+
+typedef struct {
+    int heuristic;          // STBRP_HEURISTIC_Skyline_*
+    PackOrder order;
+    bool pow2;              // power of two target from initAtlas, else a tight non power of two width
+    int width, height;      // target, the height is doubled once when it does not fit
+    std::vector<stbrp_rect> rects;
+    uint32_t usedW, usedH;  // extents of the packed sprites, 0 = did not fit
+} PackCandidate;
+
+static bool packRects(PackCandidate* c, std::vector<stbrp_node>& nodes, const std::vector<uint32_t>& order) {
+    stbrp_context ctx;
+    nodes.assign(c->width + 1, stbrp_node());
+    stbrp_init_target(&ctx, c->width, c->height, nodes.data(), c->width + 1);
+    stbrp_setup_heuristic(&ctx, c->heuristic);
+    if (c->order == PACK_ORDER_HEIGHT) {
+        return stbrp_pack_rects(&ctx, c->rects.data(), (int) c->rects.size()) != 0;
+    }
+    for (uint32_t i : order) {
+        if (!stbrp_pack_rects(&ctx, &c->rects[i], 1)) return false;
+    }
+    return true;
+}
+
+static void packCandidate(PackCandidate* c, const stbrp_rect* rects, uint32_t num) {
+    TRACE_SCOPE(std::string("pack ") + packOrderName[c->order]);
+    std::vector<uint32_t> order;
+    if (c->order != PACK_ORDER_HEIGHT) {
+        auto key = [&](uint32_t i) -> int64_t {
+            const stbrp_rect& r = rects[i];
+            switch (c->order) {
+            case PACK_ORDER_AREA: return (int64_t) r.w * r.h;
+            case PACK_ORDER_WIDTH: return r.w;
+            default: return r.w + r.h;
+            }
+        };
+        for (uint32_t i = 0; i < num; i++) order.push_back(i);
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            if (key(a) != key(b)) return key(a) > key(b);
+            return rects[a].h > rects[b].h;
+        });
+    }
+
+    std::vector<stbrp_node> nodes;
+    c->usedW = c->usedH = 0;
+    for (int attempt = 0; attempt < 2; attempt++, c->height <<= 1) {
+        c->rects.assign(rects, rects + num);
+        if (packRects(c, nodes, order)) break;
+        if (attempt == 1) return;
+    }
+    for (const stbrp_rect& r : c->rects) {
+        if (r.w <= 0 || r.h <= 0) continue;
+        if ((uint32_t) (r.x + r.w) > c->usedW) c->usedW = r.x + r.w;
+        if ((uint32_t) (r.y + r.h) > c->usedH) c->usedH = r.y + r.h;
+    }
+}
+
+// Single page atlas: pack with every strategy on the decode threads and keep the
+// densest. Ties go to the first candidate, stb's default into the power of two target.
+// Returns -2 when no sprite has pixels left to pack, -1 when they do not fit
+int packAtlas(Atlas* atlas) {
+    uint32_t i, num = atlas->sff->header.NumberOfSprites;
+    int64_t area = 0;
+    int maxw = 0, maxh = 0;
+    for (i = 0; i < num; i++) {
+        area += (int64_t) atlas->rects[i].w * atlas->rects[i].h;
+        if (atlas->rects[i].w > maxw) maxw = atlas->rects[i].w;
+        if (atlas->rects[i].h > maxh) maxh = atlas->rects[i].h;
+    }
+    if (area == 0) {
+        fprintf(stderr, "Error, nothing left after cropping atlas. Size= 0 x 0\n");
+        return -2;
+    }
+    int side;
+    for (side = 1; (int64_t) side * side < area; side++);
+
+    std::vector<PackCandidate> candidates;
+    static const int heuristics[2] = { STBRP_HEURISTIC_Skyline_BL_sortHeight, STBRP_HEURISTIC_Skyline_BF_sortHeight };
+    for (int target = 0; target < 3; target++) {
+        int w = atlas->width, h = atlas->height;
+        if (target > 0) {
+            // Non power of two: the square of the sprite area, and a wider one
+            w = std::max(maxw, target == 1 ? side : side + side / 4);
+            h = (int) std::max<int64_t>(maxh, (area + w - 1) / w + maxh);
+            if (w > 0xFFFF || h > 0xFFFF) continue;
+        }
+        for (int heuristic : heuristics) {
+            for (int order = 0; order < PACK_ORDER_COUNT; order++) {
+                PackCandidate c;
+                c.heuristic = heuristic;
+                c.order = (PackOrder) order;
+                c.pow2 = target == 0;
+                c.width = w;
+                c.height = h;
+                candidates.push_back(c);
+            }
+        }
+    }
+
+    int numThreads = decodeThreadCount(candidates.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        TRACE_FILE(atlas->sff->filename);
+        for (size_t k; (k = next++) < candidates.size();) {
+            packCandidate(&candidates[k], atlas->rects, num);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& th : threads) {
+        th.join();
+    }
+
+    const PackCandidate* best = NULL;
+    for (const PackCandidate& c : candidates) {
+        if (c.usedW == 0) continue;
+        if (!best || (uint64_t) c.usedW * c.usedH < (uint64_t) best->usedW * best->usedH) best = &c;
+    }
+    if (!best) {
+        fprintf(stderr, "Error, sprites do not fit into %u x %u atlas (see --max-atlas-size).\n", atlas->width, atlas->height << 1);
+        return -1;
+    }
+    memcpy(atlas->rects, best->rects.data(), num * sizeof(stbrp_rect));
+    atlas->width = best->width;
+    atlas->height = best->height;
+    snprintf(atlas->packing, sizeof(atlas->packing), "%s %s%s",
+        best->heuristic == STBRP_HEURISTIC_Skyline_BF_sortHeight ? "BF" : "BL",
+        packOrderName[best->order], best->pow2 ? "" : " npot");
+    return 0;
+}
+
+// --watch: remember where a pack from scratch put every sprite
+void resetAtlasLayout(Atlas* atlas) {
+    AtlasLayout* layout = atlas->layout;
+    uint64_t width = 0, height = 0;
+    layout->slots.clear();
+    for (uint32_t i = 0; i < atlas->sff->header.NumberOfSprites; i++) {
+        const stbrp_rect& r = atlas->rects[i];
+        if (r.w <= 0 || r.h <= 0) continue;
+        const Sprite* s = atlas->sff->sprites[i];
+        layout->slots.emplace(std::make_pair(s->Group, s->Number), r);
+        width = std::max<uint64_t>(width, r.x + r.w);
+        height = std::max<uint64_t>(height, r.y + r.h);
+    }
+    layout->packedArea = width * height;
+}
+
+// --watch: a refresh keeps the place of every sprite that still fits the slot it had, a
+// shrunk sprite keeps its whole slot. Only new and grown sprites are packed, into a band
+// below the kept ones. Returns -1 with the layout untouched when nothing is kept or the
+// page would grow past twice the last pack from scratch, the caller packs anew then
+int repackAtlas(Atlas* atlas) {
+    AtlasLayout* layout = atlas->layout;
+    uint32_t num = atlas->sff->header.NumberOfSprites;
+    std::map<std::pair<uint16_t, uint16_t>, stbrp_rect> slots;
+    std::vector<stbrp_rect> fresh;
+    int usedW = 0, usedH = 0, freshW = 0, freshH = 0;
+    for (uint32_t i = 0; i < num; i++) {
+        stbrp_rect* r = &atlas->rects[i];
+        if (r->w <= 0 || r->h <= 0) continue;
+        const Sprite* s = atlas->sff->sprites[i];
+        auto key = std::make_pair(s->Group, s->Number);
+        auto it = layout->slots.find(key);
+        if (it == layout->slots.end() || slots.count(key) || r->w > it->second.w || r->h > it->second.h) {
+            fresh.push_back(*r);
+            freshW = std::max(freshW, (int) r->w);
+            freshH = std::min(freshH + r->h, 0xFFFF);
+            continue;
+        }
+        const stbrp_rect& slot = it->second;
+        r->x = slot.x;
+        r->y = slot.y;
+        r->was_packed = 1;
+        slots.emplace(key, slot);
+        usedW = std::max(usedW, slot.x + slot.w);
+        usedH = std::max(usedH, slot.y + slot.h);
+    }
+    if (slots.empty()) return -1;
+
+    uint32_t bandW = 0, bandH = 0;
+    std::vector<stbrp_rect> band;
+    if (!fresh.empty()) {
+        PackCandidate c;
+        c.heuristic = STBRP_HEURISTIC_Skyline_BL_sortHeight;
+        c.order = PACK_ORDER_HEIGHT;
+        c.pow2 = false;
+        c.width = std::max(usedW, freshW);
+        c.height = freshH;
+        packCandidate(&c, fresh.data(), (uint32_t) fresh.size());
+        if (c.usedW == 0) return -1;
+        bandW = c.usedW;
+        bandH = c.usedH;
+        band = c.rects;
+    }
+    uint64_t width = std::max<uint64_t>(usedW, bandW), height = (uint64_t) usedH + bandH;
+    if (height > 0xFFFF || width * height > 2 * layout->packedArea) return -1;
+
+    for (stbrp_rect& r : band) {
+        r.y += usedH;
+        atlas->rects[r.id] = r;
+        const Sprite* s = atlas->sff->sprites[r.id];
+        slots.emplace(std::make_pair(s->Group, s->Number), r);
+    }
+    layout->slots.swap(slots);
+    atlas->width = width;
+    atlas->height = height;
+    snprintf(atlas->packing, sizeof(atlas->packing), "incremental, %zu new", band.size());
+    return 0;
+}
+
+// Pixels of an atlas page are RGBA8: true colour sprites, or indexed ones with --rgba
+static bool rgbaPage(const Atlas* atlas) {
+    return atlas->rgba || opt_rgba >= 0;
+}
+
+// --texture: the page again as a GPU texture. Indexed pages are R8 with the atlas palette
+// in <page>_palette, a 256 x 1 RGBA8 texture; true colour pages use --texture-rgba
+int writeAtlasTexture(Atlas* atlas, const char* pageName, const uint8_t* pixels) {
+    TextureContainer container = (TextureContainer) opt_texture;
+    const char* ext = container == TEXTURE_DDS ? ".dds" : ".ktx2";
+    TextureFormat format = rgbaPage(atlas) ? opt_texture_rgba : TEXTURE_R8;
+    char outFilename[512];
+    std::vector<uint8_t> out;
+    {
+        TRACE_SCOPE("texture");
+        texture_encode(pixels, atlas->width, atlas->height, format, opt_mips, decodeThreadCount((atlas->height + 3) / 4), container, out);
+    }
+    sffOutputName(atlas->sff, outFilename, sizeof(outFilename), pageName, ext);
+    int rc = writeOutput(atlas->sff, outFilename, out.data(), out.size(), true);
+    fprintf(atlas->sff->out, "Texture %s (%s%s)\n", outFilename, texture_format_name(format), opt_mips ? ", mips" : "");
+    if (rc == 0 && !rgbaPage(atlas)) {
+        std::vector<uint8_t> row;
+        appendPaletteRow(row, sffPalette(atlas->sff, atlas->usePalette));
+        texture_encode(row.data(), 256, 1, TEXTURE_RGBA8, false, 1, container, out);
+        char paletteName[300];
+        snprintf(paletteName, sizeof(paletteName), "%s_palette", pageName);
+        sffOutputName(atlas->sff, outFilename, sizeof(outFilename), paletteName, ext);
+        rc = writeOutput(atlas->sff, outFilename, out.data(), out.size(), true);
+    }
+    return rc;
+}
+
+// Write one atlas page: pixels of every sprite on it (page < 0: all sprites) and their
+// metadata lines, appended to meta with a page column when the atlas is paged
+int writeAtlasPage(Atlas* atlas, int page, const char* name, char** meta) {
+    uint32_t i, j, num = atlas->sff->header.NumberOfSprites;
+    uint8_t* o, * src, * dst;
+    char* s = *meta;
+    bool paged = page >= 0;
+    auto onPage = [&](uint32_t i) { return !paged || atlas->page[i] == page; };
+
+    // Crop the atlas to the actual size of the sprites
+    uint32_t width = 0, height = 0;
+    for (i = 0; i < num; i++) {
+        if (!onPage(i)) continue;
+        if (atlas->rects[i].x + atlas->rects[i].w > width) width = atlas->rects[i].x + atlas->rects[i].w;
+        if (atlas->rects[i].y + atlas->rects[i].h > height) height = atlas->rects[i].y + atlas->rects[i].h;
+    }
+
+    // Check atlas size after cropping
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "Error, nothing left after cropping atlas. Size= %u x %u\n", width, height);
+        return -2;
+    }
+    atlas->width = width;
+    atlas->height = height;
+
+    size_t bpp = atlas->rgba ? 4 : 1;
+    o = (uint8_t*) malloc(atlas->width * atlas->height * bpp);
+    if (!o) { fprintf(stderr, "Not enough memory for atlas output image data\n"); exit(1); }
+    memset(o, 0, atlas->width * atlas->height * bpp);
+
+    /* records */
+    // s += sprintf(s, "X\tY\tW\tH\tx\ty\tw\th\txx\tyy\tFilename\n");
+    char filename[256];
+    size_t numProcessedSprite = 0;
+    uint64_t usedPixels = 0;
+    uint32_t numShared = 0;
+    {
+        TRACE_SCOPE("blit");
+        for (i = 0; i < num; i++) {
+            if (!onPage(i)) continue;
+            snprintf(filename, sizeof(filename), "%d,%d", atlas->sff->sprites[i]->Group, atlas->sff->sprites[i]->Number);
+            if (atlas->rects[i].w > 0 && atlas->rects[i].h > 0) {
+                // Shared rects are blitted once, by the sprite that owns them
+                if (atlas->dupOf[i] < 0) {
+                    src = spritePixel(atlas->sff->sprites[i], atlas->sff->sprites[i]->atlas_x, atlas->sff->sprites[i]->atlas_y, bpp);
+                    dst = o + (atlas->width * atlas->rects[i].y + atlas->rects[i].x) * bpp;
+                    for (j = 0; j < atlas->rects[i].h; j++, dst += atlas->width * bpp, src += atlas->sff->sprites[i]->dataW * bpp)
+                        memcpy(dst, src, atlas->rects[i].w * bpp);
+                    usedPixels += (uint64_t) atlas->rects[i].w * atlas->rects[i].h;
+                } else {
+                    numShared++;
+                }
+
+                s += sprintf(s, "%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%d\t%d\t%s",
+                atlas->rects[i].x, atlas->rects[i].y, atlas->rects[i].w, atlas->rects[i].h,
+                atlas->sff->sprites[i]->atlas_x, atlas->sff->sprites[i]->atlas_y, atlas->sff->sprites[i]->Size[0], atlas->sff->sprites[i]->Size[1],
+                atlas->sff->sprites[i]->Offset[0], atlas->sff->sprites[i]->Offset[1],
+                filename);
+                s += paged ? sprintf(s, "\t%d\n", page) : sprintf(s, "\n");
+                numProcessedSprite++;
+            }
+        }
     }
+    *meta = s;
+
+    char pageName[280];
+    char outFilename[512];
+    if (paged) {
+        snprintf(pageName, sizeof(pageName), "%s_%d", name, page);
+    } else {
+        snprintf(pageName, sizeof(pageName), "%s", name);
+    }
+    sffOutputName(atlas->sff, outFilename, sizeof(outFilename), pageName, ".png");
+    size_t pagePixelCount = (size_t) atlas->width * atlas->height;
+    if (atlas->rgba) {
+        if (opt_rgba == RGBA_PREMULTIPLIED) premultiplyRgba(o, pagePixelCount);
+        saveSffPng(atlas->sff, outFilename, atlas->width, atlas->height, o, NULL, opt_atlas_profile);
+    } else {
+        png_color png_palette[256];
+        pngPalette(sffPalette(atlas->sff, atlas->usePalette<0 ? 0 : atlas->usePalette), png_palette);
+        if (opt_rgba >= 0) {
+            // --rgba: the page goes out expanded through the atlas palette
+            uint32_t lut[256];
+            rgbaLut(png_palette, opt_rgba == RGBA_PREMULTIPLIED, lut);
+            uint8_t* rgba = (uint8_t*) malloc(pagePixelCount * 4);
+            if (!rgba) { fprintf(stderr, "Not enough memory for atlas output image data\n"); exit(1); }
+            expandIndexed(o, pagePixelCount, lut, rgba);
+            free(o);
+            o = rgba;
+        }
+        saveSffPng(atlas->sff, outFilename, atlas->width, atlas->height, o, opt_rgba >= 0 ? NULL : png_palette, opt_atlas_profile);
+    }
+    if (opt_texture >= 0) writeAtlasTexture(atlas, pageName, o);
+    free(o);
+    if (atlas->rgba) {
+        fprintf(atlas->sff->out, "Atlas %s (%ux%u) created with %u true colour sprites\n", outFilename, atlas->width, atlas->height, numProcessedSprite);
+    } else {
+        fprintf(atlas->sff->out, "Atlas %s (%ux%u) created with %u sprites and palette_index=%d\n", outFilename, atlas->width, atlas->height, numProcessedSprite, atlas->usePalette);
+    }
+    uint64_t pagePixels = (uint64_t) atlas->width * atlas->height;
+    fprintf(atlas->sff->out, "Fill %.1f%%, %llu bytes wasted, %u sprites share a bitmap (packing: %s)\n", 100.0 * usedPixels / pagePixels,
+        (unsigned long long) ((pagePixels - usedPixels) * bpp), numShared, atlas->packing);
+    fprintf(atlas->sff->out, "___________________________________________________________\n\n");
+    return 0;
+}
+
+// --bin-meta: the atlas records in a binary file next to the .txt, little endian:
+//   header   "SFAT", uint16 version (1), uint16 flags (1 = true colour page,
+//            2 = --max-atlas-size pages named <name>_<page>.png),
+//            uint32 count, uint16 pages, int16 palette index (-1 = true colour)
+//   columns  count values each, all 16 bit: group, number, x, y, w, h (rect in the page),
+//            crop x, crop y, sprite w, sprite h, axis x, axis y (signed), page
+//   table    (version 2) uint32 slots, then slots int32 record indices, -1 = empty:
+//            the (group, number) table of findSprite() over the records
+// Records are sorted by (group, number) so readers can also binary-search the first two columns
+#define ATLAS_BIN_VERSION 2
+#define ATLAS_BIN_COLUMNS 13
+
+int writeAtlasBinary(Atlas* atlas, const char* name) {
+    Sprite** sprites = atlas->sff->sprites;
+    std::vector<uint32_t> order;
+    for (uint32_t i = 0; i < atlas->sff->header.NumberOfSprites; i++) {
+        if (atlas->rects[i].w > 0 && atlas->rects[i].h > 0) order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        if (sprites[a]->Group != sprites[b]->Group) return sprites[a]->Group < sprites[b]->Group;
+        return sprites[a]->Number < sprites[b]->Number;
+    });
+
+    uint32_t count = (uint32_t) order.size();
+    std::vector<int32_t> table;
+    buildSpriteTable(table, count, [&](size_t k) {
+        return std::make_pair(sprites[order[k]]->Group, sprites[order[k]]->Number);
+    });
+    size_t tablePos = 16 + (size_t) count * ATLAS_BIN_COLUMNS * 2;
+    std::vector<uint8_t> out(tablePos + 4 + table.size() * 4);
+    auto put16 = [&](size_t pos, uint16_t v) {
+        out[pos] = v & 0xFF;
+        out[pos + 1] = v >> 8;
+    };
+    auto put32 = [&](size_t pos, uint32_t v) {
+        put16(pos, v & 0xFFFF);
+        put16(pos + 2, v >> 16);
+    };
+    memcpy(out.data(), "SFAT", 4);
+    put16(4, ATLAS_BIN_VERSION);
+    put16(6, (rgbaPage(atlas) ? 1 : 0) | (atlas->page ? 2 : 0));
+    put32(8, count);
+    put16(12, atlas->page ? atlas->numPages : 1);
+    put16(14, (uint16_t) atlas->usePalette);
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t i = order[k];
+        const Sprite* sp = sprites[i];
+        const stbrp_rect& r = atlas->rects[i];
+        uint16_t col[ATLAS_BIN_COLUMNS] = {
+            sp->Group, sp->Number, (uint16_t) r.x, (uint16_t) r.y, (uint16_t) r.w, (uint16_t) r.h,
+            (uint16_t) sp->atlas_x, (uint16_t) sp->atlas_y, sp->Size[0], sp->Size[1],
+            (uint16_t) sp->Offset[0], (uint16_t) sp->Offset[1], (uint16_t) (atlas->page ? atlas->page[i] : 0)
+        };
+        for (int c = 0; c < ATLAS_BIN_COLUMNS; c++) {
+            put16(16 + ((size_t) c * count + k) * 2, col[c]);
+        }
+    }
+    put32(tablePos, (uint32_t) table.size());
+    for (size_t slot = 0; slot < table.size(); slot++) {
+        put32(tablePos + 4 + slot * 4, (uint32_t) table[slot]);
+    }
+
+    char outFilename[512];
+    sffOutputName(atlas->sff, outFilename, sizeof(outFilename), name, ".bin");
+    return writeOutput(atlas->sff, outFilename, out.data(), out.size(), true);
+}
+
+int generateAtlas(Atlas* atlas) {
+    int tofile = 1;
+    char* meta, * s;
+    uint32_t num = atlas->sff->header.NumberOfSprites;
+    bool paged = opt_max_atlas > 0;
+
+    if (paged) {
+        TRACE_SCOPE("pack");
+        packAtlasPages(atlas, opt_max_atlas);
+    } else {
+        TRACE_SCOPE("pack");
+        // printf("Packing %u sprites into %u x %u atlas\n", num, atlas->width, atlas->height);
+        if (!atlas->layout || repackAtlas(atlas) != 0) {
+            int rc = packAtlas(atlas);
+            if (rc != 0) return rc;
+            if (atlas->layout) resetAtlasLayout(atlas);
+        }
+    }
+    shareAtlasRects(atlas);
+
+    meta = s = (char*) malloc((size_t) num * (32 + 256) + 1);
+    if (!meta) { fprintf(stderr, "Not enough memory for meta data\n"); exit(1); }
+    meta[0] = 0;
+
+    char name[256];
+    if (atlas->rgba) {
+        snprintf(name, sizeof(name), "sprite_atlas_%s_rgba", atlas->sff->basename);
+    } else {
+        snprintf(name, sizeof(name), "sprite_atlas_%s_p%d", atlas->sff->basename, atlas->usePalette);
+    }
+    int rc = 0;
+    if (paged) {
+        for (int page = 0; page < atlas->numPages && rc == 0; page++) {
+            rc = writeAtlasPage(atlas, page, name, &s);
+        }
+        if (atlas->numPages == 0) {
+            fprintf(stderr, "Error, nothing left after cropping atlas. Size= 0 x 0\n");
+            rc = -2;
+        }
+    } else {
+        rc = writeAtlasPage(atlas, -1, name, &s);
+    }
+    /* save meta info to a separate file too, one for all pages */
+    if (rc == 0 && tofile) {
+        char outFilename[512];
+        sffOutputName(atlas->sff, outFilename, sizeof(outFilename), name, ".txt");
+        writeOutput(atlas->sff, outFilename, (const uint8_t*) meta, s - meta, true);
+    }
+    if (rc == 0 && opt_bin_meta) {
+        rc = writeAtlasBinary(atlas, name);
+    }
+    free(meta);
+    return rc;
+}
+
+// Palette indices that get an indexed atlas: the atlas palette, or with --all-palettes
+// every palette index that sprites use
+std::vector<int> atlasPalettes(const Sff* sff) {
+    if (!opt_all_palettes) return { sff->palidx };
+    std::vector<int> list;
+    for (const auto& pair : sff->palette_usage) {
+        if (pair.first >= 0) list.push_back(pair.first);
+    }
+    return list;
+}
+
+// --all-palettes: the palettes of the indexed atlases as one strip, row k holds the
+// palette of the k-th atlas (the palette indices are listed in the output)
+int writePaletteStrip(Sff* sff, const std::vector<int>& palettes) {
+    std::vector<uint8_t> image;
+    std::string list;
+    for (int palidx : palettes) {
+        appendPaletteRow(image, sffPalette(sff, palidx));
+        list += " " + std::to_string(palidx);
+    }
+    char name[280];
+    char outFilename[512];
+    snprintf(name, sizeof(name), "sprite_atlas_%s_palettes", sff->basename);
+    sffOutputName(sff, outFilename, sizeof(outFilename), name, ".png");
+    saveSffPng(sff, outFilename, 256, (int) palettes.size(), image.data(), NULL, opt_atlas_profile);
+    fprintf(sff->out, "Palette strip %s (256x%zu), rows are palette indices%s\n", outFilename, palettes.size(), list.c_str());
+    return 0;
+}
+
+int deinitAtlas(Atlas* atlas) {
+    free(atlas->rects);
+    free(atlas->page);
+    free(atlas->dupOf);
+    atlas->page = NULL;
+    atlas->dupOf = NULL;
+    return 0;
+}
+
+void freeSff(Sff* sff) {
+    // Sprites and their pixels live in the arenas, the palettes in palettePool
+    arenaFree(&sff->arena);
+    for (Arena& arena : sff->pixelArenas) {
+        arenaFree(&arena);
+    }
+    sff->pixelArenas.clear();
+    sff->sprites = NULL;
     sff->palettes.clear();
+    sff->paletteIds.clear();
     sff->palette_usage.clear();
     sff->format_usage.clear();
-    opt_palidx = 0;
+    sff->spriteTable.clear();
+    sff->spriteHashes.clear();
 }
 
 void printAtlas(Atlas* atlas) {
-    printf("Atlas size: %d x %d\n", atlas->width, atlas->height);
+    fprintf(atlas->sff->out, "Atlas size: %d x %d\n", atlas->width, atlas->height);
     for (int i = 0; i < atlas->sff->header.NumberOfSprites; i++) {
-        printf("Sprite %d: %dx%d -> %dx%d\n", i, atlas->sff->sprites[i]->Size[0], atlas->sff->sprites[i]->Size[1], atlas->rects[i].w, atlas->rects[i].h);
+        fprintf(atlas->sff->out, "Sprite %d: %dx%d -> %dx%d\n", i, atlas->sff->sprites[i]->Size[0], atlas->sff->sprites[i]->Size[1], atlas->rects[i].w, atlas->rects[i].h);
     }
 }
 
 void printSff(Sff* sff) {
-    std::map<int, std::string> format_code = {
-        {1, "PCX"},
-        {2, "RLE8"},
-        {3, "RLE5"},
-        {4, "LZ5"},
-        {10, "PNG10"},
-        {11, "PNG11"},
-        {12, "PNG12"}
-    };
 
     // Print SFF information
-    printf("\nSFF file: %s\n", sff->filename);
-    printf("Version: %d.%d.%d.%d\n", sff->header.Ver0, sff->header.Ver1, sff->header.Ver2, sff->header.Ver3);
-    printf("Number of sprites: %d (Normal=%d Linked=%d)\n", sff->header.NumberOfSprites, sff->header.NumberOfSprites - sff->numLinkedSprites, sff->numLinkedSprites);
-    printf("Number of palettes: %d\n", sff->header.NumberOfPalettes);
+    fprintf(sff->out, "\nSFF file: %s\n", sff->filename);
+    fprintf(sff->out, "Version: %d.%d.%d.%d\n", sff->header.Ver0, sff->header.Ver1, sff->header.Ver2, sff->header.Ver3);
+    fprintf(sff->out, "Number of sprites: %d (Normal=%d Linked=%d)\n", sff->header.NumberOfSprites, sff->header.NumberOfSprites - sff->numLinkedSprites, sff->numLinkedSprites);
+    fprintf(sff->out, "Number of palettes: %d\n", sff->header.NumberOfPalettes);
 
     if (opt_verbose) {
-        printf("\nPalette usage:\n");
+        fprintf(sff->out, "\nPalette usage:\n");
         for (const auto& pair : sff->palette_usage) {
             uint32_t hash;
 
             if (sff->header.Ver0 == 1) {
-                hash = fast_hash_v1(sff->palettes[sff->sprites[pair.first]->palidx], 256);
+                png_color pal[256];
+                pngPalette(sffPalette(sff, sff->sprites[pair.first]->palidx), pal);
+                hash = fast_hash_v1(pal, 256);
             } else {
                 if (pair.first == -1) {
                     hash = 0;
                 } else {
-                    hash = fast_hash_v2(sff->palList.palettes[pair.first], 256);
+                    hash = fast_hash_v2(sffPalette(sff, pair.first), 256);
                 }
             }
-            std::cout << "\t" << pair.first << ":\t" << pair.second << "\t" << hash << '\n';
+            fprintf(sff->out, "\t%d:\t%d\t%u\n", pair.first, pair.second, hash);
         }
     } else {
         std::vector<std::pair<int, int>> sortedVec(sff->palette_usage.begin(), sff->palette_usage.end());
@@ -1862,22 +4122,36 @@ void printSff(Sff* sff) {
               [](const auto& a, const auto& b) {
                   return a.second > b.second;
               });
-        printf("\nTop palette usage:\n");
+        fprintf(sff->out, "\nTop palette usage:\n");
         for (int i = 0; i < 10 && i < sortedVec.size() ; ++i) {
-            std::cout << "\t" << sortedVec[i].first << "\t:\t" << sortedVec[i].second << '\n';
+            fprintf(sff->out, "\t%d\t:\t%d\n", sortedVec[i].first, sortedVec[i].second);
         }
     }
 
-    printf("\nFormat usage:\n");
+    fprintf(sff->out, "\nFormat usage:\n");
     for (const auto& pair : sff->format_usage) {
-        std::cout << "\t" << format_code[pair.first] << ": " << pair.second << '\n';
+        fprintf(sff->out, "\t%s: %d\n", formatName(pair.first), pair.second);
+    }
+
+    if (opt_verbose) {
+        Arena total = sff->arena;
+        for (const Arena& arena : sff->pixelArenas) {
+            total.numAllocs += arena.numAllocs;
+            total.numBlocks += arena.numBlocks;
+            total.bytesUsed += arena.bytesUsed;
+            total.bytesReserved += arena.bytesReserved;
+        }
+        fprintf(sff->out, "\nMemory: %zu allocations in %zu blocks (%zu KB used, %zu KB reserved)\n",
+            total.numAllocs, total.numBlocks, total.bytesUsed / 1024, total.bytesReserved / 1024);
+        fprintf(sff->out, "Peak RSS: %zu KB\n", peakRssKB());
     }
 
     if (opt_sff_info) {
-        char basename[256];
-        char outFilename[256];
-        get_basename_no_ext(sff->filename, basename, sizeof(basename));
-        snprintf(outFilename, sizeof(outFilename), "SFFv%d_Info_%s.csv", sff->header.Ver0, basename);
+        char name[256];
+        char outFilename[512];
+        snprintf(name, sizeof(name), "SFFv%d_Info_%s", sff->header.Ver0, sff->basename);
+        outputPath(outFilename, sizeof(outFilename), name, ".csv");
+        cacheOutput(sff, outFilename);
         FILE *f = fopen(outFilename, "w");
         if (f) {
             // fprintf(f, "sep=|\n");
@@ -1890,28 +4164,666 @@ void printSff(Sff* sff) {
                 if (sff->header.Ver0 == 1) {
                     fprintf(f, "%d,%u,%u,%d,%d,%d,%d,%d\n", i+1, sff->sprites[i]->Group, sff->sprites[i]->Number, sff->sprites[i]->Size[0], sff->sprites[i]->Size[1], sff->sprites[i]->Offset[0], sff->sprites[i]->Offset[1], sff->sprites[i]->palidx);
                 } else {
-                    fprintf(f, "%d,%u,%u,%d,%d,%d,%d,%d,%s,%d\n", i+1, sff->sprites[i]->Group, sff->sprites[i]->Number, sff->sprites[i]->Size[0], sff->sprites[i]->Size[1], sff->sprites[i]->Offset[0], sff->sprites[i]->Offset[1], sff->sprites[i]->palidx, format_code[-sff->sprites[i]->rle].c_str(), sff->sprites[i]->coldepth);
+                    fprintf(f, "%d,%u,%u,%d,%d,%d,%d,%d,%s,%d\n", i+1, sff->sprites[i]->Group, sff->sprites[i]->Number, sff->sprites[i]->Size[0], sff->sprites[i]->Size[1], sff->sprites[i]->Offset[0], sff->sprites[i]->Offset[1], sff->sprites[i]->palidx, formatName(-sff->sprites[i]->rle), sff->sprites[i]->coldepth);
                 }
             }
             fclose(f);
-            printf("\nSprite information saved to %s\n", outFilename);
+            fprintf(sff->out, "\nSprite information saved to %s\n", outFilename);
         }
     }
 }
 
-int main(int argc, char* argv[]) {
+// --palette-table: every palette index of every SFF of the run, written at the end
+typedef struct {
+    std::string name;       // SFF basename
+    int palidx, group, number;
+    int entry;              // palettePool entry holding the colours
+} PaletteTableRef;
+
+std::vector<PaletteTableRef> paletteTableRefs;  // guarded by palettePool.lock
+
+void addPaletteTable(const Sff* sff) {
+    std::lock_guard<std::mutex> lock(palettePool.lock);
+    for (size_t i = 0; i < sff->paletteIds.size(); i++) {
+        const std::array<int, 3>& id = sff->paletteIds[i];
+        paletteTableRefs.push_back({ sff->basename, (int) i, id[1], id[2], id[0] });
+    }
+}
+
+// Write palette_table.png, one 256 x 1 RGBA row per distinct palette, and palette_table.txt, "row palidx group number name" per palette
+// index of every SFF. Rows follow the SFF names, so -j does not change the table
+int writePaletteTable() {
+    std::sort(paletteTableRefs.begin(), paletteTableRefs.end(), [](const PaletteTableRef& a, const PaletteTableRef& b) {
+        return a.name != b.name ? a.name < b.name : a.palidx < b.palidx;
+    });
+    std::map<int, int> rows;    // pool entry -> row
+    std::vector<uint8_t> image;
+    for (const PaletteTableRef& ref : paletteTableRefs) {
+        if (rows.count(ref.entry)) continue;
+        rows[ref.entry] = (int) rows.size();
+        appendPaletteRow(image, palettePool.colors[ref.entry].data());
+    }
+    if (rows.empty()) return 0;
+
+    char outFilename[512];
+    outputPath(outFilename, sizeof(outFilename), "palette_table", ".txt");
+    FILE* f = fopen(outFilename, "w");
+    if (!f) {
+        fprintf(stderr, "Error creating palette table %s\n", outFilename);
+        return -1;
+    }
+    for (const PaletteTableRef& ref : paletteTableRefs) {
+        fprintf(f, "%d\t%d\t%d\t%d\t%s\n", rows[ref.entry], ref.palidx, ref.group, ref.number, ref.name.c_str());
+    }
+    fclose(f);
+    outputPath(outFilename, sizeof(outFilename), "palette_table", ".png");
+    save_as_png(outFilename, 256, (int) rows.size(), image.data(), NULL, opt_atlas_profile);
+    printf("Palette table %s (256x%zu) holds %zu palette indices of the run\n", outFilename, rows.size(), paletteTableRefs.size());
+    return 0;
+}
+
+#define GOLDEN_MAGIC "sffcli golden 2"
+// The throughput check decodes the inputs on one thread until every format took at
+// least GOLDEN_MIN_NS, at most GOLDEN_MAX_ITERATIONS times
+#define GOLDEN_MAX_ITERATIONS 100
+#define GOLDEN_MIN_NS 20000000ull
+
+// FNV-1a of all Size[0] x Size[1] pixels of a decoded sprite, 0 outside the part --trim kept
+uint64_t spritePixelHash(const Sprite* s) {
+    size_t bpp = isRgbaSprite(s) ? 4 : 1;
+    std::vector<uint8_t> row((size_t) s->Size[0] * bpp);
+    uint64_t hash = FNV1A_64_INIT;
+    for (size_t y = 0; y < s->Size[1]; y++) {
+        std::fill(row.begin(), row.end(), 0);
+        if (s->data && y >= s->dataY && y < (size_t) s->dataY + s->dataH) {
+            memcpy(row.data() + s->dataX * bpp, s->data + (y - s->dataY) * s->dataW * bpp, s->dataW * bpp);
+        }
+        hash = fnv1a_64(row.data(), row.size(), hash);
+    }
+    return hash;
+}
+
+// --golden: note the pixel hash of every sprite of a decoded file
+void goldenSff(const Sff* sff) {
+    std::vector<std::pair<std::string, uint64_t>> hashes;
+    for (uint32_t i = 0; i < sff->header.NumberOfSprites; i++) {
+        const Sprite* s = sff->sprites[i];
+        char key[512];
+        snprintf(key, sizeof(key), "%s\t%u\t%u,%u", sff->filename, i, s->Group, s->Number);
+        // A linked sprite shows the pixels at the end of its link chain, links point back
+        const Sprite* d = s;
+        while (d->link >= 0) d = sff->sprites[d->link];
+        hashes.push_back({ key, spritePixelHash(d) });
+    }
+    std::lock_guard<std::mutex> lock(goldenRun.lock);
+    for (const auto& h : hashes) goldenRun.sprites[h.first] = h.second;
+    goldenRun.inputs.push_back(sff->filename);
+}
+
+int writeGolden(const char* filename, const std::map<int, double>& speed) {
+    FILE* f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "Error creating golden manifest %s\n", filename);
+        return -1;
+    }
+    fprintf(f, "%s\noptions\t%s\n", GOLDEN_MAGIC, cacheOptions().c_str());
+    for (const auto& pair : goldenRun.sprites) fprintf(f, "sprite\t%016llx\t%s\n", (unsigned long long) pair.second, pair.first.c_str());
+    for (const auto& pair : goldenRun.outputs) fprintf(f, "output\t%016llx\t%s\n", (unsigned long long) pair.second, pair.first.c_str());
+    for (const auto& pair : speed) fprintf(f, "speed\t%d\t%.1f\n", pair.first, pair.second);
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Error writing golden manifest %s\n", filename);
+        return -1;
+    }
+    printf("Golden manifest %s: %zu sprites, %zu outputs\n", filename, goldenRun.sprites.size(), goldenRun.outputs.size());
+    return 0;
+}
+
+// Compare the run with the manifest: every sprite and output hash must match and no
+// format may decode more than --golden-slack percent slower. Returns the number of failures
+int checkGolden(const char* filename, const std::map<int, double>& runSpeed) {
+    FILE* f = fopen(filename, "r");
+    char line[2048];
+    if (!f || !fgets(line, sizeof(line), f) || strncmp(line, GOLDEN_MAGIC, strlen(GOLDEN_MAGIC)) != 0) {
+        fprintf(stderr, "Error: %s is not a sffcli golden manifest\n", filename);
+        if (f) fclose(f);
+        return 1;
+    }
+    std::map<std::string, uint64_t> sprites, outputs;
+    std::map<int, double> speed;
+    std::string options;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        char* tab = strchr(line, '\t');
+        if (!tab) continue;
+        *tab++ = 0;
+        if (strcmp(line, "options") == 0) {
+            options = tab;
+            continue;
+        }
+
+        char* rest = strchr(tab, '\t');
+        if (!rest) continue;
+        *rest++ = 0;
+        if (strcmp(line, "sprite") == 0) sprites[rest] = strtoull(tab, NULL, 16);
+        else if (strcmp(line, "output") == 0) outputs[rest] = strtoull(tab, NULL, 16);
+        else if (strcmp(line, "speed") == 0) speed[atoi(tab)] = atof(rest);
+    }
+    fclose(f);
+
+    int failures = 0;
+    if (options != cacheOptions()) {
+        fprintf(stderr, "Golden: recorded with options '%s', this run has '%s'\n", options.c_str(), cacheOptions().c_str());
+        failures++;
+    }
+    // Only the inputs of this run are checked, a manifest may cover more. Sprites and
+    // outputs are both keyed by their input file first
+    std::map<std::string, bool> inputs;
+    for (const auto& pair : goldenRun.sprites) inputs[pair.first.substr(0, pair.first.find('\t'))] = true;
+    auto compare = [&](const char* what, const std::map<std::string, uint64_t>& golden, const std::map<std::string, uint64_t>& run) {
+        for (const auto& pair : run) {
+            auto it = golden.find(pair.first);
+            if (it == golden.end()) {
+                fprintf(stderr, "Golden: new %s %s\n", what, pair.first.c_str());
+                failures++;
+            } else if (it->second != pair.second) {
+                fprintf(stderr, "Golden: changed %s %s (%016llx, was %016llx)\n", what, pair.first.c_str(),
+                    (unsigned long long) pair.second, (unsigned long long) it->second);
+                failures++;
+            }
+        }
+        for (const auto& pair : golden) {
+            if (!inputs.count(pair.first.substr(0, pair.first.find('\t')))) continue;
+            if (!run.count(pair.first)) {
+                fprintf(stderr, "Golden: missing %s %s\n", what, pair.first.c_str());
+                failures++;
+            }
+        }
+    };
+    compare("sprite", sprites, goldenRun.sprites);
+    compare("output", outputs, goldenRun.outputs);
+    for (const auto& pair : runSpeed) {
+        auto it = speed.find(pair.first);
+        if (it == speed.end()) continue;
+        double mbps = pair.second;
+        bool slow = mbps < it->second * (100 - opt_golden_slack) / 100;
+        printf("Golden speed %-6s %8.1f MB/s, was %8.1f%s\n", formatName(pair.first), mbps, it->second, slow ? " SLOWER" : "");
+        if (slow) failures++;
+    }
+    printf("Golden %s: %zu sprites, %zu outputs, %d failure(s)\n", filename, goldenRun.sprites.size(), goldenRun.outputs.size(), failures);
+    return failures;
+}
+
+// Decode timings of one sprite format collected by the benchmark
+typedef struct {
+    uint64_t inBytes;
+    uint64_t outBytes;
+    std::vector<uint64_t> ns;   // decode time of every sprite
+    uint64_t pixelHash;         // sum of the FNV-1a of every sprite's pixels (first iteration), as go_sffcli -B prints it
+} BenchStats;
+
+int benchDecode(const std::vector<std::string>& files, int iterations, std::map<int, BenchStats>& stats, BenchStats* all, BenchStats* encode, FILE* out);
+
+// Decode throughput per format in MB/s of pixels, from a decode of the inputs on one
+// thread with nothing written, like -B, so -T, -j and the PNG encoders do not skew it
+int goldenSpeed(std::map<int, double>& speed) {
+    if (goldenRun.inputs.empty()) return 0;
+    bool extract = opt_extract, zip = opt_zip, trim = opt_trim, atlas = opt_atlas;
+    opt_extract = opt_zip = opt_trim = false;
+    opt_atlas = true;
+    FILE* out = tmpfile();  // the run already printed what indexing the inputs says
+    std::map<int, BenchStats> stats;
+    int rc = 0;
+    for (int it = 0; it < GOLDEN_MAX_ITERATIONS && rc == 0; it++) {
+        rc = benchDecode(goldenRun.inputs, 1, stats, NULL, NULL, out ? out : stdout);
+        bool done = true;
+        for (const auto& pair : stats) {
+            uint64_t ns = 0;
+            for (uint64_t t : pair.second.ns) ns += t;
+            if (ns < GOLDEN_MIN_NS) done = false;
+        }
+        if (done) break;
+    }
+    if (out) fclose(out);
+    opt_extract = extract;
+    opt_zip = zip;
+    opt_trim = trim;
+    opt_atlas = atlas;
+    for (const auto& pair : stats) {
+        uint64_t ns = 0;
+        for (uint64_t t : pair.second.ns) ns += t;
+        if (ns >= GOLDEN_MIN_NS) speed[pair.first] = pair.second.outBytes / (ns / 1e9) / 1e6;
+    }
+    return rc;
+}
+
+// --golden: hash the outputs the run wrote, then record or check the manifest
+int finishGolden() {
+    for (auto& pair : goldenRun.outputs) {
+        MappedFile mf;
+        if (openMappedFile(&mf, pair.first.substr(pair.first.find('\t') + 1).c_str()) != 0) continue;
+        pair.second = fnv1a_64(mf.data, mf.size, FNV1A_64_INIT);
+        closeMappedFile(&mf);
+    }
+    std::map<int, double> speed;
+    if (goldenSpeed(speed) != 0) return -1;
+    if (opt_golden_update) return writeGolden(opt_golden, speed);
+    if (!std::filesystem::exists(opt_golden)) {
+        fprintf(stderr, "Error: golden manifest %s not found, record it with --golden-update\n", opt_golden);
+        return -1;
+    }
+    return checkGolden(opt_golden, speed) == 0 ? 0 : -1;
+}
+
+// Batch outputs written once all SFF files are done
+int finishRun() {
+    int rc = 0;
+    if (opt_palette_table && writePaletteTable() != 0) rc = 1;
+    if (opt_cache && saveCache(opt_cache) != 0) rc = 1;
+    if (opt_golden && finishGolden() != 0) rc = 1;
+    return rc;
+}
+
+// --cache: fill entry with the stamp and content hash of the input. Returns 1 when the
+// previous run saw the same content with the same options and its outputs are all still
+// there (unchanged entries are carried over); else 0, with *cached set to the previous
+// entry when only the content changed, so unchanged sprites can be kept. -1 = no stamp
+int checkCache(const char* filename, CacheEntry* entry, const CacheEntry** cached) {
+    *cached = NULL;
+    if (fileStamp(filename, &entry->size, &entry->mtime) != 0) return -1;
+    entry->options = cacheOptions();
+    auto it = cacheOld.find(filename);
+    const CacheEntry* old = it != cacheOld.end() && it->second.options == entry->options ? &it->second : NULL;
+    if (old && old->size == entry->size && old->mtime == entry->mtime && cacheOutputsExist(*old)) {
+        return 1;
+    }
+
+    // Touched or new: the content hash decides
+    MappedFile mf;
+    if (openInput(&mf, filename) != 0) return -1;
+    entry->hash = fnv1a_64(mf.data, mf.size, FNV1A_64_INIT);
+    closeMappedFile(&mf);
+    if (old && old->hash == entry->hash && cacheOutputsExist(*old)) {
+        CacheEntry same = *old;
+        same.mtime = entry->mtime;
+        std::lock_guard<std::mutex> lock(cacheLock);
+        cacheNew[filename] = same;
+        return 1;
+    }
+    *cached = old;
+    return 0;
+}
+
+// --watch: what stays resident of one input from one refresh to the next
+typedef struct {
+    uint64_t size;      // stamp of the file the outputs were made from
+    int64_t mtime;
+    Sff sff;            // its decoded sprites, sff.sprites is NULL until a decode succeeded
+    std::map<int, AtlasLayout> layouts;     // atlas palette index (-1 true colour page) -> layout
+} WatchState;
+
+// Extract one SFF file and build its atlas. All per-file state lives here,
+// so several files can be processed at the same time. With watch the decode
+// starts from the resident one and is kept for the next refresh
+int processSff(const char* filename, FILE* out, WatchState* watch) {
     Atlas atlas;
-    Sff sff;
+    Sff sff{};
+    sff.palidx = opt_palidx;
+    sff.out = out;
+    sff.resident = watch && watch->sff.sprites ? &watch->sff : NULL;
+    TRACE_FILE(filename);
+
+    CacheEntry entry;
+    if (opt_cache) {
+        switch (checkCache(filename, &entry, &sff.cached)) {
+        case 1:
+            fprintf(out, "%s is unchanged, skipped (--cache)\n", filename);
+            // Its palettes still belong in the table of the whole run
+            if (!opt_palette_table) {
+                dropPrefetched(filename);
+            } else if (extractSff(&sff, filename, false) == 0) {
+                addPaletteTable(&sff);
+            }
+            freeSff(&sff);
+            return 0;
+        case 0:
+            sff.cache = &entry;
+            break;
+        default:
+            break;  // no stamp, process it without caching
+        }
+    }
+
+    int rc = extractSff(&sff, filename, !headerOnly());
+    if (rc == 0 && opt_golden && !headerOnly()) goldenSff(&sff);
+    if (rc == 0 && (!opt_atlas || headerOnly())) {
+        printSff(&sff);
+    } else if (rc == 0) {
+        // One decode serves the atlas of every palette index
+        std::vector<int> palettes = atlasPalettes(&sff);
+        for (size_t k = 0; k < palettes.size(); k++) {
+            initAtlas(&atlas, &sff, palettes[k], false);
+            if (watch) atlas.layout = &watch->layouts[palettes[k]];
+            if (k == 0) printSff(&sff);
+            // printAtlas(&atlas);
+            generateAtlas(&atlas);
+            deinitAtlas(&atlas);
+        }
+        if (palettes.empty()) printSff(&sff);
+        if (opt_all_palettes && !palettes.empty()) writePaletteStrip(&sff, palettes);
+
+        // True colour sprites get a page of their own beside the indexed atlas
+        if (sff.format_usage.count(11) || sff.format_usage.count(12)) {
+            initAtlas(&atlas, &sff, -1, true);
+            if (watch) atlas.layout = &watch->layouts[-1];
+            generateAtlas(&atlas);
+            deinitAtlas(&atlas);
+        }
+    } else {
+        fprintf(stderr, "Error extracting %s\n", filename);
+    }
+    if (closeSffArchive(&sff) != 0 && rc == 0) rc = -1;
+    if (opt_palette_table && rc == 0) addPaletteTable(&sff);
+    if (sff.cache && rc == 0) {
+        std::lock_guard<std::mutex> lock(cacheLock);
+        cacheNew[filename] = entry;
+    }
+    if (watch && rc == 0 && !headerOnly()) {
+        // This decode is the one the next refresh starts from
+        freeSff(&watch->sff);
+        sff.resident = NULL;
+        sff.cache = NULL;
+        sff.cached = NULL;
+        watch->sff = std::move(sff);
+    } else {
+        freeSff(&sff);
+    }
+    return rc;
+}
+
+// Time between two looks at the watched files
+#define WATCH_POLL_MS 250
+
+// --watch: after the first run stay resident and poll the size and modification time
+// of the inputs. A file that changed and then held still for one poll is refreshed:
+// only its changed sprites decode, the atlas keeps the places it had. Runs until
+// interrupted, the files are processed one after the other
+int watchFiles(const std::vector<std::string>& files) {
+    std::vector<WatchState> states(files.size());
+    std::vector<std::pair<uint64_t, int64_t>> seen(files.size());
+    for (size_t k = 0; k < files.size(); k++) {
+        fileStamp(files[k].c_str(), &states[k].size, &states[k].mtime);
+        seen[k] = std::make_pair(states[k].size, states[k].mtime);
+        processSff(files[k].c_str(), stdout, &states[k]);
+    }
+    stopPrefetch();
+    finishRun();
+    printf("Watching %zu file(s) for changes, interrupt to stop\n", files.size());
+    fflush(stdout);
+
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_POLL_MS));
+        bool refreshed = false;
+        for (size_t k = 0; k < files.size(); k++) {
+            WatchState& w = states[k];
+            uint64_t size;
+            int64_t mtime;
+            // A file that is gone for now is usually being replaced by an editor
+            if (fileStamp(files[k].c_str(), &size, &mtime) != 0) continue;
+            bool settled = seen[k] == std::make_pair(size, mtime);
+            seen[k] = std::make_pair(size, mtime);
+            if (!settled || (size == w.size && mtime == w.mtime)) continue;
+
+            auto t0 = std::chrono::steady_clock::now();
+            w.size = size;
+            w.mtime = mtime;
+            int rc = processSff(files[k].c_str(), stdout, &w);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            printf("%s %s in %.1f ms\n", rc == 0 ? "Refreshed" : "Failed to refresh", files[k].c_str(), ms);
+            fflush(stdout);
+            refreshed = true;
+        }
+        if (refreshed && opt_cache) saveCache(opt_cache);
+    }
+}
+
+void printBenchLine(const char* name, BenchStats* b) {
+    uint64_t total = 0;
+    for (uint64_t t : b->ns) total += t;
+    std::sort(b->ns.begin(), b->ns.end());
+    double sec = total / 1e9;
+    if (sec <= 0) sec = 1e-9;
+    printf("%-8s %10zu %10.1f %10.1f %12.0f %10.2f %10.2f %016llx\n", name, b->ns.size(),
+        b->inBytes / sec / 1e6, b->outBytes / sec / 1e6, b->ns.size() / sec,
+        b->ns[b->ns.size() / 2] / 1e3, b->ns[b->ns.size() * 99 / 100] / 1e3, (unsigned long long) b->pixelHash);
+}
+
+// libpng write callback of the encode benchmark, only counts the bytes
+static void png_count_write(png_structp png_ptr, png_bytep data, png_size_t length) {
+    *(uint64_t*) png_get_io_ptr(png_ptr) += length;
+}
+
+// Run only the sprite decode pass over every file `iterations` times on the calling
+// thread, nothing is written but what indexing says to out. Timings go to stats per
+// format and to all (if not NULL); with encode the sprites decoded by the first
+// iteration are also encoded in memory with every PNG profile
+int benchDecode(const std::vector<std::string>& files, int iterations, std::map<int, BenchStats>& stats, BenchStats* all, BenchStats* encode, FILE* out) {
+    for (const auto& filename : files) {
+        MappedFile mf;
+        if (openMappedFile(&mf, filename.c_str()) != 0) {
+            fprintf(stderr, "Error opening file %s\n", filename.c_str());
+            return -1;
+        }
+        Sff sff{};
+        sff.palidx = opt_palidx;
+        sff.out = out;
+        strncpy(sff.filename, filename.c_str(), sizeof(sff.filename) - 1);
+        TRACE_FILE(sff.filename);
+
+        std::vector<SpriteJob> jobs;
+        if (indexSff(&sff, &mf, jobs) != 0) {
+            fprintf(stderr, "Error extracting %s\n", filename.c_str());
+            freeSff(&sff);
+            closeMappedFile(&mf);
+            return -1;
+        }
+
+        MemReader reader = { mf.data, mf.size, 0 };
+        UsageCounters counters;
+        Arena arena = {};
+        counters.arena = &arena;
+        int rc = 0;
+        for (int it = 0; it < iterations && rc == 0; it++) {
+            for (auto& job : jobs) {
+                Sprite* s = job.sprite;
+                int format = sff.header.Ver0 == 1 ? 1 : -s->rle;
+                auto t0 = std::chrono::steady_clock::now();
+                rc = decodeSprite(&sff, &job, &reader, &counters);
+                auto t1 = std::chrono::steady_clock::now();
+                if (rc != 0) {
+                    fprintf(stderr, "Error decoding sprite %d,%d of %s\n", s->Group, s->Number, filename.c_str());
+                    break;
+                }
+                uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+                uint64_t inBytes = sff.header.Ver0 == 1 ? job.srcLen : job.datasize;
+                uint64_t outBytes = s->data ? (uint64_t) s->Size[0] * s->Size[1] * (isRgbaSprite(s) ? 4 : 1) : 0;
+                BenchStats& b = stats[format];
+                b.inBytes += inBytes;
+                b.outBytes += outBytes;
+                b.ns.push_back(ns);
+                if (all) {
+                    all->inBytes += inBytes;
+                    all->outBytes += outBytes;
+                    all->ns.push_back(ns);
+                }
+
+                if (it > 0 || !s->data || s->Size[0] == 0 || s->Size[1] == 0) continue;
+                uint64_t hash = fnv1a_64(s->data, outBytes, FNV1A_64_INIT);
+                b.pixelHash += hash;
+                if (all) all->pixelHash += hash;
+                if (!encode) continue;
+                png_color palette[256];
+                png_color* pal = NULL;
+                if (sff.header.Ver0 == 1 || !isRgbaSprite(s)) {
+                    pngPalette(sffPalette(&sff, s->palidx), palette);
+                    pal = palette;
+                }
+                for (int p = 0; p < PNG_PROFILE_COUNT; p++) {
+                    uint64_t pngBytes = 0;
+                    t0 = std::chrono::steady_clock::now();
+                    encode_png(&pngBytes, png_count_write, s->Size[0], s->Size[1], s->data, pal, (PngProfile) p);
+                    t1 = std::chrono::steady_clock::now();
+                    encode[p].inBytes += outBytes;
+                    encode[p].outBytes += pngBytes;
+                    encode[p].ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+                }
+            }
+            // Start every iteration with fresh pixel memory, like a real run
+            arenaFree(&arena);
+        }
+        arenaFree(&arena);
+        freeSff(&sff);
+        closeMappedFile(&mf);
+        if (rc != 0) return -1;
+    }
+    return 0;
+}
+
+// Benchmark mode: reports throughput of the encoded input and decoded output, and
+// the per-sprite latency, per format, then the PNG encode of every profile
+int benchSff(const std::vector<std::string>& files, int iterations) {
+    std::map<int, BenchStats> stats;
+    BenchStats all = {};
+    BenchStats encode[PNG_PROFILE_COUNT] = {};
+    if (benchDecode(files, iterations, stats, &all, encode, stdout) != 0) return -1;
+
+    printf("Decode benchmark: %zu file(s), %d iteration(s), 1 thread\n", files.size(), iterations);
+    printf("%-8s %10s %10s %10s %12s %10s %10s %16s\n", "Format", "Sprites", "In MB/s", "Out MB/s", "Sprites/s", "p50 us", "p99 us", "Pixels FNV");
+    for (auto& pair : stats) {
+        char name[16];
+        snprintf(name, sizeof(name), "%s", formatName(pair.first));
+        if (!name[0]) snprintf(name, sizeof(name), "%d", pair.first);
+        printBenchLine(name, &pair.second);
+    }
+    if (!all.ns.empty()) printBenchLine("Total", &all);
+
+    printf("\nEncode benchmark: PNG of every decoded sprite, once per profile\n");
+    printf("%-8s %10s %10s %12s %12s %10s\n", "Profile", "Sprites", "MB/s", "Pixel KB", "PNG KB", "Ratio");
+    for (int p = 0; p < PNG_PROFILE_COUNT; p++) {
+        BenchStats& b = encode[p];
+        uint64_t total = 0;
+        for (uint64_t t : b.ns) total += t;
+        double sec = total > 0 ? total / 1e9 : 1e-9;
+        printf("%-8s %10zu %10.1f %12.0f %12.0f %10.3f\n", png_profile_name((PngProfile) p), b.ns.size(),
+            b.inBytes / sec / 1e6, b.inBytes / 1024.0, b.outBytes / 1024.0,
+            b.inBytes ? (double) b.outBytes / b.inBytes : 0.0);
+    }
+    return 0;
+}
+
+static bool hasExtension(const std::string& path, const char* ext) {
+    return strcasecmp(std::filesystem::path(path).extension().string().c_str(), ext) == 0;
+}
+
+// Add every *.sff below dir of the PhysFS tree to files
+static void findArchiveSff(const std::string& dir, std::vector<std::string>& files) {
+    char** list = PHYSFS_enumerateFiles(dir.c_str());
+    if (!list) return;
+    for (char** i = list; *i; i++) {
+        std::string path = dir + "/" + *i;
+        PHYSFS_Stat st;
+        if (!PHYSFS_stat(path.c_str(), &st)) continue;
+        if (st.filetype == PHYSFS_FILETYPE_DIRECTORY) {
+            findArchiveSff(path, files);
+        } else if (hasExtension(path, ".sff")) {
+            files.push_back(path);
+        }
+    }
+    PHYSFS_freeList(list);
+}
+
+// Mount a .zip under its own file name and queue the SFF files inside it,
+// they are named "<archive>.zip/<path in archive>"
+int mountArchive(const char* argv0, const std::string& archive, std::vector<std::string>& files) {
+    if (!archivesMounted) {
+        if (!PHYSFS_init(argv0)) {
+            fprintf(stderr, "Error initialising PhysFS: %s\n", PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+            return -1;
+        }
+        archivesMounted = true;
+        atexit([] { PHYSFS_deinit(); });
+    }
+    std::string mountPoint;
+    const char* mounted = PHYSFS_getMountPoint(archive.c_str());
+    if (mounted) {
+        // Given twice, its SFF files are queued again like a repeated .sff argument
+        mountPoint = mounted;
+        if (!mountPoint.empty() && mountPoint.back() == '/') mountPoint.pop_back();
+    } else {
+        std::string name = std::filesystem::path(archive).filename().string();
+        mountPoint = name;
+        for (int n = 2; PHYSFS_exists(mountPoint.c_str()); n++) {
+            mountPoint = name + "#" + std::to_string(n);
+        }
+        if (!PHYSFS_mount(archive.c_str(), mountPoint.c_str(), 1)) {
+            fprintf(stderr, "Error mounting %s: %s\n", archive.c_str(), PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+            return -1;
+        }
+    }
+    size_t before = files.size();
+    findArchiveSff(mountPoint, files);
+    if (files.size() == before) {
+        fprintf(stderr, "No SFF file in %s\n", archive.c_str());
+    }
+    return 0;
+}
+
+#ifndef SFFCLI_LIBRARY
+int main(int argc, char* argv[]) {
     int opt;
+#ifdef SFFCLI_TRACE
+    atexit(traceWrite);
+#endif
+    // Long options without a short letter use codes above the char range
+    enum { OPT_MAX_ATLAS = 256, OPT_TRIM, OPT_BIN_META, OPT_CACHE, OPT_PALETTE_TABLE, OPT_ALL_PALETTES, OPT_TEXTURE, OPT_TEXTURE_RGBA, OPT_MIPS, OPT_WRITE_SFF, OPT_PREFETCH, OPT_GOLDEN, OPT_GOLDEN_UPDATE, OPT_GOLDEN_SLACK, OPT_RGBA, OPT_RGBA_OUTPUT, OPT_WATCH };
+    static const struct option longOptions[] = {
+        { "max-atlas-size", required_argument, NULL, OPT_MAX_ATLAS },
+        { "trim", no_argument, NULL, OPT_TRIM },
+        { "bin-meta", no_argument, NULL, OPT_BIN_META },
+        { "cache", required_argument, NULL, OPT_CACHE },
+        { "palette-table", no_argument, NULL, OPT_PALETTE_TABLE },
+        { "all-palettes", no_argument, NULL, OPT_ALL_PALETTES },
+        { "texture", required_argument, NULL, OPT_TEXTURE },
+        { "texture-rgba", required_argument, NULL, OPT_TEXTURE_RGBA },
+        { "mips", no_argument, NULL, OPT_MIPS },
+        { "write-sff", required_argument, NULL, OPT_WRITE_SFF },
+        { "prefetch", required_argument, NULL, OPT_PREFETCH },
+        { "golden", required_argument, NULL, OPT_GOLDEN },
+        { "golden-update", no_argument, NULL, OPT_GOLDEN_UPDATE },
+        { "golden-slack", required_argument, NULL, OPT_GOLDEN_SLACK },
+        { "rgba", required_argument, NULL, OPT_RGBA },
+        { "rgba-output", required_argument, NULL, OPT_RGBA_OUTPUT },
+        { "watch", no_argument, NULL, OPT_WATCH },
+        { NULL, 0, NULL, 0 }
+    };
 
-    while ((opt = getopt(argc, argv, "ihxvp:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "ihxXnvo:p:T:E:j:B:z:Z:", longOptions, NULL)) != -1) {
         switch (opt) {
             case 'h':
-                printf("Usage: %s -i -x -h -v [-p palette_index]\n", argv[0]);
+                printf("Usage: %s -i -x -X -n -h -v [-o outdir] [-p palette_index] [-T threads] [-E encoders] [-j jobs] [-B iterations] [-z profile] [-Z profile] [--max-atlas-size N] [--trim] [--bin-meta] [--cache manifest] [--palette-table] [--all-palettes] [--texture dds|ktx2] [--texture-rgba bc7|bc3|rgba8] [--mips] [--write-sff size|balanced|speed] [--prefetch N] [--golden manifest] [--golden-update] [--golden-slack percent] [--rgba straight|premultiplied] [--rgba-output png|raw|dds] [--watch]\n", argv[0]);
                 return 0;
             case 'x':
                 opt_extract = true;
                 break;
+            case 'X':
+                opt_extract = true;
+                opt_zip = true;
+                break;
+            case 'o':
+                opt_outdir = optarg;
+                break;
+            case 'n':
+                opt_atlas = false;
+                break;
             case 'i':
                 opt_sff_info = true;
                 break;
@@ -1921,38 +4833,208 @@ int main(int argc, char* argv[]) {
             case 'p':
                 opt_palidx = atoi(optarg);
                 break;
+            case 'T':
+                opt_threads = atoi(optarg);
+                break;
+            case 'E':
+                opt_encoders = atoi(optarg);
+                break;
+            case 'j':
+                opt_jobs = atoi(optarg);
+                break;
+            case 'B':
+                opt_bench = atoi(optarg);
+                break;
+            case OPT_MAX_ATLAS:
+                opt_max_atlas = atoi(optarg);
+                if (opt_max_atlas <= 0) {
+                    fprintf(stderr, "Invalid maximum atlas size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_TRIM:
+                opt_trim = true;
+                break;
+            case OPT_BIN_META:
+                opt_bin_meta = true;
+                break;
+            case OPT_CACHE:
+                opt_cache = optarg;
+                break;
+            case OPT_PALETTE_TABLE:
+                opt_palette_table = true;
+                break;
+            case OPT_ALL_PALETTES:
+                opt_all_palettes = true;
+                break;
+            case OPT_TEXTURE:
+                if (strcmp(optarg, "dds") == 0) {
+                    opt_texture = TEXTURE_DDS;
+                } else if (strcmp(optarg, "ktx2") == 0) {
+                    opt_texture = TEXTURE_KTX2;
+                } else {
+                    fprintf(stderr, "Unknown texture container '%s' (dds or ktx2)\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_TEXTURE_RGBA:
+                if (strcmp(optarg, "bc7") == 0) {
+                    opt_texture_rgba = TEXTURE_BC7;
+                } else if (strcmp(optarg, "bc3") == 0) {
+                    opt_texture_rgba = TEXTURE_BC3;
+                } else if (strcmp(optarg, "rgba8") == 0) {
+                    opt_texture_rgba = TEXTURE_RGBA8;
+                } else {
+                    fprintf(stderr, "Unknown true colour texture format '%s' (bc7, bc3 or rgba8)\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_MIPS:
+                opt_mips = true;
+                break;
+            case OPT_WRITE_SFF:
+                opt_write_sff = sff_policy_parse(optarg);
+                if (opt_write_sff < 0) {
+                    fprintf(stderr, "Unknown SFF policy '%s' (size, balanced or speed)\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_PREFETCH:
+                opt_prefetch = atoi(optarg);
+                break;
+            case OPT_GOLDEN:
+                opt_golden = optarg;
+                break;
+            case OPT_GOLDEN_UPDATE:
+                opt_golden_update = true;
+                break;
+            case OPT_GOLDEN_SLACK:
+                opt_golden_slack = atoi(optarg);
+                break;
+            case OPT_RGBA:
+                if (strcmp(optarg, "straight") == 0) {
+                    opt_rgba = RGBA_STRAIGHT;
+                } else if (strcmp(optarg, "premultiplied") == 0) {
+                    opt_rgba = RGBA_PREMULTIPLIED;
+                } else {
+                    fprintf(stderr, "Unknown alpha '%s' (straight or premultiplied)\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_RGBA_OUTPUT:
+                if (strcmp(optarg, "png") == 0) {
+                    opt_rgba_output = RGBA_OUTPUT_PNG;
+                } else if (strcmp(optarg, "raw") == 0) {
+                    opt_rgba_output = RGBA_OUTPUT_RAW;
+                } else if (strcmp(optarg, "dds") == 0) {
+                    opt_rgba_output = RGBA_OUTPUT_DDS;
+                } else {
+                    fprintf(stderr, "Unknown RGBA output '%s' (png, raw or dds)\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_WATCH:
+                opt_watch = true;
+                break;
+            case 'z':
+            case 'Z': {
+                int profile = png_profile_parse(optarg);
+                if (profile < 0) {
+                    fprintf(stderr, "Unknown PNG profile '%s' (default, fast or small)\n", optarg);
+                    return 1;
+                }
+                if (opt == 'z') {
+                    opt_sprite_profile = (PngProfile) profile;
+                } else {
+                    opt_atlas_profile = (PngProfile) profile;
+                }
+                break;
+            }
             default:
-                printf("Usage: %s -x -h -v [-p palette_index]\n", argv[0]);
+                printf("Usage: %s -x -X -n -h -v [-o outdir] [-p palette_index] [-T threads] [-E encoders] [-j jobs] [-B iterations] [-z profile] [-Z profile] [--max-atlas-size N] [--trim] [--bin-meta] [--cache manifest] [--palette-table] [--all-palettes] [--texture dds|ktx2] [--texture-rgba bc7|bc3|rgba8] [--mips] [--write-sff size|balanced|speed] [--prefetch N] [--golden manifest] [--golden-update] [--golden-slack percent] [--rgba straight|premultiplied] [--rgba-output png|raw|dds] [--watch]\n", argv[0]);
                 return 1;
         }
     }
+    if (opt_jobs < 1) opt_jobs = 1;
+    if (opt_watch && opt_zip) {
+        fprintf(stderr, "--watch refreshes plain output files, it does not work with -X\n");
+        return 1;
+    }
 
+    std::vector<std::string> files;
     // Check the rest of the arguments
     if ( optind >= argc) { // There is no arguments, so we will use the current directory
         // iterate current directory with sff file
         for (const auto& entry : std::filesystem::directory_iterator(".")) {
-            if (strcasecmp(entry.path().extension().string().c_str(), ".sff") == 0) {
-                extractSff(&sff, entry.path().string().c_str());
-                initAtlas(&atlas, &sff, opt_palidx);
-                printSff(&sff);
-                // printAtlas(&atlas);
-                generateAtlas(&atlas);
-                freeSff(&sff);
-                deinitAtlas(&atlas);
+            if (hasExtension(entry.path().string(), ".sff")) {
+                files.push_back(entry.path().string());
             }
         }
     } else { // There are arguments, so we will use the arguments
         // iterate all arguments
+        // .zip archives are mounted and contribute the SFF files they hold
         for (int i = optind; i < argc; i++) {
-            extractSff(&sff, argv[i]);
-            initAtlas(&atlas, &sff, opt_palidx);
-            printSff(&sff);
-            // printAtlas(&atlas);
-            generateAtlas(&atlas);
-            freeSff(&sff);
-            deinitAtlas(&atlas);
+            if (hasExtension(argv[i], ".zip")) {
+                mountArchive(argv[0], argv[i], files);
+            } else {
+                files.push_back(argv[i]);
+            }
         }
     }
 
-    return 0;
+    if (opt_bench > 0) {
+        opt_extract = false;
+        opt_zip = false;
+        opt_trim = false;
+        opt_atlas = true;
+        return benchSff(files, opt_bench) == 0 ? 0 : 1;
+    }
+
+    if (opt_outdir && createDirectory(opt_outdir) != 0) {
+        return 1;
+    }
+    if (opt_cache) loadCache(opt_cache);
+    if (opt_prefetch > 0 && files.size() > 1) startPrefetch(files);
+    if (opt_watch) return watchFiles(files);
+
+    if (opt_jobs == 1) {
+        for (const auto& file : files) {
+            processSff(file.c_str(), stdout, NULL);
+        }
+        stopPrefetch();
+        return finishRun();
+    }
+
+    // Process several files at once, each job prints into its own temporary
+    // file which is copied to stdout in one piece when the job is done
+    std::atomic<size_t> next(0);
+    std::mutex stdoutLock;
+    auto worker = [&]() {
+        for (size_t k; (k = next++) < files.size();) {
+            FILE* out = tmpfile();
+            processSff(files[k].c_str(), out ? out : stdout, NULL);
+            if (out) {
+                char buffer[4096];
+                size_t n;
+                rewind(out);
+                std::lock_guard<std::mutex> lock(stdoutLock);
+                while ((n = fread(buffer, 1, sizeof(buffer), out)) > 0) {
+                    fwrite(buffer, 1, n, stdout);
+                }
+                fflush(stdout);
+                fclose(out);
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < opt_jobs && (size_t) t < files.size(); t++) {
+        threads.emplace_back(worker);
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    stopPrefetch();
+
+    return finishRun();
 }
+#endif // SFFCLI_LIBRARY
@@ -3,7 +3,8 @@
  Usage: sffcli.exe <sff_file>
  Example: sffcli.exe chars.sff
  Build windows: go build -trimpath -ldflags="-s -w" -o sffcli.exe .\src\
- Build linux: go build -trimpath -ldflags="-s -w" -o sffcli src/main.go
+ Build linux: go build -trimpath -ldflags="-s -w" -o sffcli ./src
+ Build on the libsffcli decoders: make lib, then go build -tags sffcli_native ... ./src (make go_native)
 */
 
 package main
@@ -389,6 +390,12 @@ func (s *Sprite) read(f *physfs.File, sff *Sff, offset int64, datasize uint32,
 	if err := read(px); err != nil {
 		return err
 	}
+	if sff.bench {
+		if s.rle > 0 {
+			sff.batch.add(s, 1, s.rle, px)
+		}
+		return nil
+	}
 	if paletteSame {
 		if prev != nil {
 			s.palidx = prev.palidx
@@ -418,7 +425,7 @@ func (s *Sprite) read(f *physfs.File, sff *Sff, offset int64, datasize uint32,
 
 	// Create a new Paletted image
 	img := image.NewPaletted(image.Rect(0, 0, int(s.Size[0]), int(s.Size[1])), genPalette(pl.Get(s.palidx)))
-	img.Pix = s.RlePcxDecode(px)
+	img.Pix = decodePcx(s, px)
 
 	// Extract filename without extension
 	baseFilename := strings.TrimSuffix(sff.filename, filepath.Ext(sff.filename))
@@ -826,36 +833,30 @@ func (s *Sprite) readV2(f *physfs.File, offset int64, datasize uint32, sff *Sff)
 		f.Seek(offset+4, 0)
 		format := -s.rle
 
-		var srcPx []byte
-		if 2 <= format && format <= 4 {
-			if datasize < 4 {
-				datasize = 4
-			}
-			srcPx = make([]byte, datasize-4)
-			if err := binary.Read(f, binary.LittleEndian, srcPx); err != nil {
-				return err
-			}
-		}
-
 		switch format {
 			case 2, 3, 4:
-				switch format {
-				case 2:
-					px = s.Rle8Decode(srcPx)
-				case 3:
-					px = s.Rle5Decode(srcPx)
-				case 4:
-					px = s.Lz5Decode(srcPx)
+				// Decoded and saved with the batch
+				if datasize < 4 {
+					datasize = 4
 				}
-				if err := saveImageToPNG(sff, s, px); err != nil {
+				if err := sff.batch.read(f, s, format, int(datasize-4)); err != nil {
 					return err
 				}
-				// fmt.Printf("len(px)=%v w:%v h:%v\n", len(px), s.Size[0], s.Size[1])
+				if !sff.bench && len(sff.batch.jobs) >= decodeBatchSize {
+					return sff.batch.flush(sff)
+				}
 				// img_tag := C.CString(fmt.Sprintf("%v_%v.png", s.Group, s.Number))
 				// C.calculate_image((*C.uchar)(unsafe.Pointer(&px[0])), C.int(s.Size[0]), C.int(s.Size[1]), img_tag)
 				// defer C.free(unsafe.Pointer(img_tag))
 			case 10, 11, 12:
 				// fmt.Printf("PNG Format %v. Group:%v Num:%v\n", format, s.Group, s.Number)
+				if sff.bench {
+					return nil
+				}
+				// The sprites before it are saved first, the .tsv keeps the file order
+				if err := sff.batch.flush(sff); err != nil {
+					return err
+				}
 				if err := saveImageToPNG3(sff, s, f, datasize); err != nil {
 					return err
 				}
@@ -872,6 +873,8 @@ type Sff struct {
 	sprites  map[[2]int16]*Sprite
 	palList  PaletteList
 	filename string
+	batch    *spriteBatch // sprites read but not decoded yet
+	bench    bool         // -B: only queue the encoded sprites, nothing is saved
 }
 type Palette struct {
 	palList PaletteList
@@ -886,10 +889,12 @@ func newSff() (s *Sff) {
 	return
 }
 
-func extractSff(filename string, cmdSavePalette bool) (*Sff, error) {
+func extractSff(filename string, cmdSavePalette bool, bench bool) (*Sff, error) {
 	char := true
 	s := newSff()
 	s.filename = filename
+	s.bench = bench
+	s.batch = batchPool.Get().(*spriteBatch)
 	f := physfs.OpenRead(filename)
 	if f == nil {
 		return nil, fmt.Errorf(fmt.Sprintf("File not found: %v", filename))
@@ -1021,6 +1026,13 @@ func extractSff(filename string, cmdSavePalette bool) (*Sff, error) {
 		//~ fmt.Printf("Loading sprite %v/%v: %v,%v %v compressed_size=%v\n", i+1, len(spriteList), spriteList[i].Group, spriteList[i].Number, spriteList[i].Size, size)
 	}
 	// C.print_info()
+	if !s.bench {
+		if err := s.batch.flush(s); err != nil {
+			return nil, err
+		}
+		releaseBatch(s.batch)
+		s.batch = nil
+	}
 	return s, nil
 }
 func (s *Sff) GetSprite(g, n int16) *Sprite {
@@ -1049,15 +1061,31 @@ func main() {
 	// Set Write Directory
 	physfs.SetWriteDir(currentDir)
 
+	benchIterations := 0
+	benchFiles := 0
+	benchStats := make(map[int]*benchStats)
 	if len(os.Args[1:]) > 0 {
-		for _, arg := range os.Args[1:] {
+		for i := 1; i < len(os.Args); i++ {
+			arg := os.Args[i]
 			if arg == "-pal" {
 				cmdSavePalette = true
+			} else if arg == "-B" && i+1 < len(os.Args) {
+				i++
+				fmt.Sscan(os.Args[i], &benchIterations)
 			} else if arg == "-h" || arg == "--help" {
 				readAllDirectories = false
-				fmt.Println("Usage:\n\tsffcli\n\tsffcli -pal\n\tsffcli -pal [char1.sff] [char2.sff] ...\n\nOptions:\n-pal: save palette as ACT file")
+				fmt.Println("Usage:\n\tsffcli\n\tsffcli -pal\n\tsffcli -pal [char1.sff] [char2.sff] ...\n\tsffcli -B iterations [char1.sff] ...\n\nOptions:\n-pal: save palette as ACT file\n-B: decode benchmark, decode the RLE and PCX sprites iterations times without saving them")
+			} else if benchIterations > 0 {
+				readAllDirectories = false
+				sff, err := extractSff(arg, false, true)
+				if err != nil {
+					fmt.Println(err)
+				} else {
+					benchSff(sff, benchIterations, benchStats)
+					benchFiles++
+				}
 			} else {
-				sff, err := extractSff(arg, cmdSavePalette)
+				sff, err := extractSff(arg, cmdSavePalette, false)
 				if err != nil {
 					fmt.Println(err)
 				} else {
@@ -1072,6 +1100,10 @@ func main() {
 		}
 	}
 
+	if benchFiles > 0 {
+		printBench(benchStats, benchFiles, benchIterations)
+	}
+
 	if readAllDirectories {
 		// Read currentDir directory
 		entries, err := physfs.EnumerateFiles("/")
@@ -1083,7 +1115,7 @@ func main() {
 		for _, file := range entries {
 			if strings.HasSuffix(file, ".sff") {
 
-				sff, err := extractSff(file, cmdSavePalette)
+				sff, err := extractSff(file, cmdSavePalette, false)
 				if err != nil {
 					fmt.Println(err)
 				} else {
@@ -1,4 +1,4 @@
-// Description: Merges two indexed PNG images with palettes, removing duplicates and remapping pixels.
+// Description: Merges indexed PNG images into one shared palette (median cut and k-means when the colours do not fit), remapping pixels.
 // Compile: g++ -o merge_png.exe src/merge_png.cpp -lpng -fopenmp -std=c++11
 #include <vector>
 #include <map>
@@ -9,10 +9,12 @@
 #include <cstdlib>
 #include <cstring>
 #include <cmath>
+#include <limits>
+#include <string>
 #include <unordered_map>
 #include <functional>
-#include <thread>
 #include "png.h"
+#include "png_profile.h"
 
 // Structure to hold RGB color
 struct RGB {
@@ -41,6 +43,14 @@ namespace std {
     };
 }
 
+// One input image, remapped in place to the merged palette
+struct Image {
+    const char* filename;
+    std::vector<uint8_t> pixels;
+    std::vector<RGB> palette;
+    int width, height;
+};
+
 // Function to load PNG and extract pixel data and palette
 bool load_png(const char* filename, std::vector<uint8_t>& pixels, std::vector<RGB>& palette, int& width, int& height) {
     FILE* fp = fopen(filename, "rb");
@@ -115,7 +125,7 @@ bool load_png(const char* filename, std::vector<uint8_t>& pixels, std::vector<RG
 }
 
 // Function to save PNG with a new palette
-bool save_png(const char* filename, const std::vector<uint8_t>& pixels, const std::vector<RGB>& palette, int width, int height) {
+bool save_png(const char* filename, const std::vector<uint8_t>& pixels, const std::vector<RGB>& palette, int width, int height, PngProfile profile) {
     FILE* fp = fopen(filename, "wb");
     if (!fp) {
         fprintf(stderr, "Error: Cannot open file %s for writing\n", filename);
@@ -142,6 +152,7 @@ bool save_png(const char* filename, const std::vector<uint8_t>& pixels, const st
     }
 
     png_init_io(png, fp);
+    png_profile_apply(png, profile);
 
     png_set_IHDR(
         png, info, width, height, 8, PNG_COLOR_TYPE_PALETTE,
@@ -168,7 +179,7 @@ bool save_png(const char* filename, const std::vector<uint8_t>& pixels, const st
         rows[y] = (png_bytep) &pixels[y * width];
     }
 
-    png_write_image(png, rows);
+    png_profile_write_rows(png, profile, rows, width, height, width, 1);
     png_write_end(png, NULL);
 
     png_destroy_write_struct(&png, &info);
@@ -176,125 +187,311 @@ bool save_png(const char* filename, const std::vector<uint8_t>& pixels, const st
     return true;
 }
 
-// Helper function to calculate the Euclidean distance between two colors
-double color_distance(const RGB& c1, const RGB& c2) {
-    return std::sqrt(
-        (c1.r - c2.r) * (c1.r - c2.r) +
-        (c1.g - c2.g) * (c1.g - c2.g) +
-        (c1.b - c2.b) * (c1.b - c2.b)
-    );
+// Squared Euclidean distance between two colors, exact in integers
+int color_distance2(const RGB& c1, const RGB& c2) {
+    int dr = c1.r - c2.r, dg = c1.g - c2.g, db = c1.b - c2.b;
+    return dr * dr + dg * dg + db * db;
+}
+
+static inline int channel(const RGB& c, int axis) {
+    return axis == 0 ? c.r : axis == 1 ? c.g : c.b;
+}
+
+// k-d tree over a palette for nearest colour queries. The answer is the one of a
+// linear scan: the nearest colour, the lowest index among equally near ones
+struct PaletteTree {
+    struct Node {
+        RGB color;
+        int index;          // in the palette
+        int axis;           // 0 = r, 1 = g, 2 = b
+        int left, right;    // child nodes, -1 = none
+    };
+    std::vector<Node> nodes;
+    int root = -1;
+};
+
+// Split on the widest channel at the median, returns the node
+int build_tree_node(PaletteTree& tree, const std::vector<RGB>& palette, std::vector<int>& order, int lo, int hi) {
+    if (lo >= hi) return -1;
+    int axis = 0, widest = -1;
+    for (int a = 0; a < 3; a++) {
+        int minv = 255, maxv = 0;
+        for (int i = lo; i < hi; i++) {
+            minv = std::min(minv, channel(palette[order[i]], a));
+            maxv = std::max(maxv, channel(palette[order[i]], a));
+        }
+        if (maxv - minv > widest) {
+            widest = maxv - minv;
+            axis = a;
+        }
+    }
+    int mid = (lo + hi) / 2;
+    std::nth_element(order.begin() + lo, order.begin() + mid, order.begin() + hi, [&](int a, int b) {
+        return channel(palette[a], axis) < channel(palette[b], axis);
+    });
+    int node = (int) tree.nodes.size();
+    tree.nodes.push_back({ palette[order[mid]], order[mid], axis, -1, -1 });
+    int left = build_tree_node(tree, palette, order, lo, mid);
+    int right = build_tree_node(tree, palette, order, mid + 1, hi);
+    tree.nodes[node].left = left;
+    tree.nodes[node].right = right;
+    return node;
 }
 
-// Function to quantize the palette to 256 colors
-void quantize_palette(const std::vector<RGB>& input_palette, std::vector<RGB>& output_palette) {
+void build_palette_tree(const std::vector<RGB>& palette, PaletteTree& tree) {
+    std::vector<int> order(palette.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = (int) i;
+    tree.nodes.clear();
+    tree.nodes.reserve(palette.size());
+    tree.root = build_tree_node(tree, palette, order, 0, (int) order.size());
+}
+
+void search_tree(const PaletteTree& tree, int n, const RGB& color, int& best, int& best_index) {
+    if (n < 0) return;
+    const PaletteTree::Node& node = tree.nodes[n];
+    int d = color_distance2(color, node.color);
+    if (d < best || (d == best && node.index < best_index)) {
+        best = d;
+        best_index = node.index;
+    }
+    // The far side can only hold colours at least diff away, <= keeps equally near
+    // ones with a lower index
+    int diff = channel(color, node.axis) - channel(node.color, node.axis);
+    search_tree(tree, diff < 0 ? node.left : node.right, color, best, best_index);
+    if (diff * diff <= best) search_tree(tree, diff < 0 ? node.right : node.left, color, best, best_index);
+}
+
+// Index of the nearest color in the palette of the tree, -1 for an empty palette
+int find_nearest_color(const PaletteTree& tree, const RGB& color) {
+    int best = std::numeric_limits<int>::max(), best_index = -1;
+    search_tree(tree, tree.root, color, best, best_index);
+    return best_index;
+}
+
+// A colour of the merged images and how many pixels have it
+struct ColorCount {
+    RGB color;
+    uint64_t count;
+};
+
+// Weighted mean of the colours of a box or cluster, the previous colour when it is empty
+struct ColorSum {
+    uint64_t r = 0, g = 0, b = 0, count = 0;
+    void add(const ColorCount& c) {
+        r += c.color.r * c.count;
+        g += c.color.g * c.count;
+        b += c.color.b * c.count;
+        count += c.count;
+    }
+    RGB mean(const RGB& fallback) const {
+        if (count == 0) return fallback;
+        return { (uint8_t) ((r + count / 2) / count), (uint8_t) ((g + count / 2) / count), (uint8_t) ((b + count / 2) / count) };
+    }
+};
+
+#define KMEANS_ITERATIONS 8
+
+// Reduce the colours to at most max_colors. When they fit they are kept as they are,
+// in order. Otherwise median cut on the pixel counts: the box with the most pixels
+// times its widest channel range is split at the weighted median of that channel,
+// until there are max_colors boxes. The box means are then refined by k-means, its
+// assignment step runs in parallel over the histogram
+void quantize_palette(const std::vector<ColorCount>& input_histogram, size_t max_colors, std::vector<RGB>& output_palette) {
     output_palette.clear();
-    if (input_palette.size() <= 256) {
-        output_palette = input_palette;
+    if (input_histogram.size() <= max_colors) {
+        for (const ColorCount& c : input_histogram) output_palette.push_back(c.color);
+        return;
+    }
+    // Palette entries no pixel uses do not pull the palette
+    std::vector<ColorCount> histogram;
+    for (const ColorCount& c : input_histogram) {
+        if (c.count > 0) histogram.push_back(c);
+    }
+    if (histogram.size() <= max_colors) {
+        for (const ColorCount& c : histogram) output_palette.push_back(c.color);
         return;
     }
 
-    // Use a simple clustering approach (e.g., K-Means or Median Cut)
-    // Here, we use a naive approach: pick the first 256 colors
-    for (size_t i = 0; i < 256; i++) {
-        output_palette.push_back(input_palette[i]);
+    // Median cut, a box is a range of histogram
+    struct Box { size_t lo, hi; };
+    std::vector<Box> boxes(1, { 0, histogram.size() });
+    while (boxes.size() < max_colors) {
+        int split = -1, split_axis = 0;
+        uint64_t split_score = 0;
+        for (size_t k = 0; k < boxes.size(); k++) {
+            const Box& box = boxes[k];
+            if (box.hi - box.lo < 2) continue;
+            uint64_t count = 0;
+            int minv[3] = { 255, 255, 255 }, maxv[3] = { 0, 0, 0 };
+            for (size_t i = box.lo; i < box.hi; i++) {
+                count += histogram[i].count;
+                for (int a = 0; a < 3; a++) {
+                    minv[a] = std::min(minv[a], channel(histogram[i].color, a));
+                    maxv[a] = std::max(maxv[a], channel(histogram[i].color, a));
+                }
+            }
+            for (int a = 0; a < 3; a++) {
+                uint64_t score = count * (uint64_t) (maxv[a] - minv[a]);
+                if (maxv[a] > minv[a] && score >= split_score) {
+                    split = (int) k;
+                    split_axis = a;
+                    split_score = score;
+                }
+            }
+        }
+        if (split < 0) break;
+
+        Box box = boxes[split];
+        std::sort(histogram.begin() + box.lo, histogram.begin() + box.hi, [&](const ColorCount& a, const ColorCount& b) {
+            return channel(a.color, split_axis) < channel(b.color, split_axis);
+        });
+        uint64_t total = 0, half = 0;
+        for (size_t i = box.lo; i < box.hi; i++) total += histogram[i].count;
+        size_t mid = box.lo + 1;
+        for (size_t i = box.lo; i < box.hi - 1; i++) {
+            half += histogram[i].count;
+            mid = i + 1;
+            if (half * 2 >= total) break;
+        }
+        boxes[split] = { box.lo, mid };
+        boxes.push_back({ mid, box.hi });
+    }
+
+    std::vector<RGB> centroids;
+    for (const Box& box : boxes) {
+        ColorSum sum;
+        for (size_t i = box.lo; i < box.hi; i++) sum.add(histogram[i]);
+        centroids.push_back(sum.mean(histogram[box.lo].color));
     }
-}
 
-// Helper function to find the nearest color in the merged palette
-uint8_t find_nearest_color(const RGB& color, const std::vector<RGB>& merged_palette) {
-    double min_distance = std::numeric_limits<double>::max();
-    uint8_t best_index = 0;
-    for (size_t i = 0; i < merged_palette.size(); i++) {
-        double distance = color_distance(color, merged_palette[i]);
-        if (distance < min_distance) {
-            min_distance = distance;
-            best_index = i;
+    // k-means refinement
+    std::vector<int> cluster(histogram.size(), -1);
+    for (int iteration = 0; iteration < KMEANS_ITERATIONS; iteration++) {
+        PaletteTree tree;
+        build_palette_tree(centroids, tree);
+        int changed = 0;
+        #pragma omp parallel for reduction(+:changed)
+        for (int i = 0; i < (int) histogram.size(); i++) {
+            int c = find_nearest_color(tree, histogram[i].color);
+            changed += c != cluster[i];
+            cluster[i] = c;
         }
+        if (changed == 0) break;
+        std::vector<ColorSum> sums(centroids.size());
+        for (size_t i = 0; i < histogram.size(); i++) sums[cluster[i]].add(histogram[i]);
+        for (size_t k = 0; k < centroids.size(); k++) centroids[k] = sums[k].mean(centroids[k]);
     }
-    return best_index;
+    output_palette = centroids;
 }
 
-// Optimized function to merge palettes and remap pixels
-void merge_palettes_and_remap(
-    const std::vector<RGB>& palette1, const std::vector<uint8_t>& pixels1, int width1, int height1,
-    const std::vector<RGB>& palette2, const std::vector<uint8_t>& pixels2, int width2, int height2,
-    std::vector<RGB>& merged_palette, std::vector<uint8_t>& remapped_pixels1, std::vector<uint8_t>& remapped_pixels2
-) {
-    // Combine palettes
-    std::vector<RGB> combined_palette = palette1;
-    combined_palette.insert(combined_palette.end(), palette2.begin(), palette2.end());
-
-    // Remove duplicate colors
-    std::unordered_map<RGB, uint8_t> color_to_index;
-    std::vector<RGB> unique_palette;
-    for (const auto& color : combined_palette) {
-        if (color_to_index.find(color) == color_to_index.end()) {
-            color_to_index[color] = unique_palette.size();
-            unique_palette.push_back(color);
-        }
+// Index -> index table of one image: index 0 stays transparent, its other palette
+// entries map to the nearest opaque merged colour (merged index 1 on), indices past
+// the end of its palette to 0
+void build_remap_lut(const std::vector<RGB>& palette, const PaletteTree& opaque, uint8_t lut[256]) {
+    lut[0] = 0;
+    for (size_t i = 1; i < 256; i++) {
+        int nearest = i < palette.size() ? find_nearest_color(opaque, palette[i]) : -1;
+        lut[i] = nearest < 0 ? 0 : (uint8_t) (nearest + 1);
     }
+}
 
-    // Quantize the palette to 256 colors
-    quantize_palette(unique_palette, merged_palette);
+// Gather every pixel through the lut, no hashing or branch in the loop so it vectorizes
+void remap_pixels(std::vector<uint8_t>& pixels, const uint8_t lut[256]) {
+    uint8_t* p = pixels.data();
+    size_t n = pixels.size();
+    for (size_t i = 0; i < n; i++) {
+        p[i] = lut[p[i]];
+    }
+}
 
-    // Precompute nearest colors for all unique colors in the original palettes
-    std::unordered_map<RGB, uint8_t> nearest_color_cache;
-    for (const auto& color : unique_palette) {
-        nearest_color_cache[color] = find_nearest_color(color, merged_palette);
+// Merge the palettes of all images into one: index 0 is the transparent colour of the
+// first image, the opaque colours of all images are quantized into the other 255.
+// Then each image is remapped through its own table, the images in parallel
+void merge_palettes_and_remap(std::vector<Image>& images, std::vector<RGB>& merged_palette) {
+    // How many pixels use each palette entry of each image
+    std::vector<std::vector<uint64_t>> usage(images.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < (int) images.size(); k++) {
+        usage[k].assign(256, 0);
+        for (uint8_t p : images[k].pixels) usage[k][p]++;
     }
 
-    // Function to remap pixels for a single image
-    auto remap_pixels = [&](const std::vector<uint8_t>& pixels, const std::vector<RGB>& palette, int width, int height, std::vector<uint8_t>& remapped_pixels) {
-        remapped_pixels.resize(width * height);
-        #pragma omp parallel for // Use OpenMP for parallel processing
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                RGB color = palette[pixels[y * width + x]];
-                remapped_pixels[y * width + x] = nearest_color_cache[color];
+    // Remove duplicate colors, in the order of the images and their palettes
+    std::unordered_map<RGB, size_t> color_to_index;
+    std::vector<ColorCount> histogram;
+    for (size_t k = 0; k < images.size(); k++) {
+        const std::vector<RGB>& palette = images[k].palette;
+        for (size_t i = 1; i < palette.size(); i++) {
+            auto it = color_to_index.find(palette[i]);
+            if (it == color_to_index.end()) {
+                it = color_to_index.insert({ palette[i], histogram.size() }).first;
+                histogram.push_back({ palette[i], 0 });
             }
+            histogram[it->second].count += usage[k][i];
         }
-    };
+    }
 
-    // Remap pixels for both images
-    remap_pixels(pixels1, palette1, width1, height1, remapped_pixels1);
-    remap_pixels(pixels2, palette2, width2, height2, remapped_pixels2);
+    // Quantize the opaque colors to 255
+    std::vector<RGB> opaque;
+    quantize_palette(histogram, 255, opaque);
+    merged_palette.assign(1, images[0].palette.empty() ? RGB{ 0, 0, 0 } : images[0].palette[0]);
+    merged_palette.insert(merged_palette.end(), opaque.begin(), opaque.end());
+
+    PaletteTree tree;
+    build_palette_tree(opaque, tree);
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < (int) images.size(); k++) {
+        uint8_t lut[256];
+        build_remap_lut(images[k].palette, tree, lut);
+        remap_pixels(images[k].pixels, lut);
+    }
 }
 
 int main(int argc, char* argv[]) {
-    // Check if two filenames are provided
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <image1.png> <image2.png>\n", argv[0]);
+    // Optional encoder profile, then the filenames
+    PngProfile profile = PNG_PROFILE_DEFAULT;
+    int arg = 1;
+    if (argc >= 3 && strcmp(argv[1], "-z") == 0) {
+        int p = png_profile_parse(argv[2]);
+        if (p < 0) {
+            fprintf(stderr, "Error: Unknown PNG profile %s (default, fast or small)\n", argv[2]);
+            return 1;
+        }
+        profile = (PngProfile) p;
+        arg = 3;
+    }
+    if (argc - arg < 2) {
+        fprintf(stderr, "Usage: %s [-z default|fast|small] <image1.png> <image2.png> [image3.png ...]\n", argv[0]);
         return 1;
     }
 
-    const char* file1 = argv[1];
-    const char* file2 = argv[2];
+    std::vector<Image> images(argc - arg);
+    bool ok = true;
 
-    // Load two PNGs
-    std::vector<uint8_t> pixels1, pixels2;
-    std::vector<RGB> palette1, palette2;
-    int width1, height1, width2, height2;
-
-    printf("Loading images...\n");
-    if (!load_png(file1, pixels1, palette1, width1, height1)) return 1;
-    if (!load_png(file2, pixels2, palette2, width2, height2)) return 1;
+    // Load the PNGs
+    printf("Loading %zu images...\n", images.size());
+    #pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+    for (int k = 0; k < (int) images.size(); k++) {
+        Image& image = images[k];
+        image.filename = argv[arg + k];
+        ok = load_png(image.filename, image.pixels, image.palette, image.width, image.height) && ok;
+    }
+    if (!ok) return 1;
 
     // Merge palettes and remap pixels
     std::vector<RGB> merged_palette;
-    std::vector<uint8_t> remapped_pixels1, remapped_pixels2;
-
     printf("Merging palettes and remapping pixels...\n");
-    merge_palettes_and_remap(
-        palette1, pixels1, width1, height1,
-        palette2, pixels2, width2, height2,
-        merged_palette, remapped_pixels1, remapped_pixels2
-    );
+    merge_palettes_and_remap(images, merged_palette);
 
     // Save the updated images with the new shared palette
     printf("Saving updated images...\n");
-    if (!save_png(file1, remapped_pixels1, merged_palette, width1, height1)) return 1;
-    if (!save_png(file2, remapped_pixels2, merged_palette, width2, height2)) return 1;
+    #pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+    for (int k = 0; k < (int) images.size(); k++) {
+        const Image& image = images[k];
+        ok = save_png(image.filename, image.pixels, merged_palette, image.width, image.height, profile) && ok;
+    }
+    if (!ok) return 1;
 
     printf("Updated images saved with remapped colors and shared palette.\n");
     return 0;
-}
\ No newline at end of file
+}
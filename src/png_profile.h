@@ -0,0 +1,156 @@
+// PNG encoder profiles shared by sffcli and merge_png
+//   default: libpng defaults
+//   fast   : zlib level 1, no filtering, for intermediate files
+//   small  : zlib level 9, and every row is trial-compressed with all five
+//            filters to keep the smallest, for files that ship
+// Set the profile with png_profile_apply() before png_write_info(), then write
+// the rows with png_profile_write_rows() in place of png_write_image()
+
+#ifndef PNG_PROFILE_H
+#define PNG_PROFILE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "png.h"
+
+typedef enum {
+    PNG_PROFILE_DEFAULT,
+    PNG_PROFILE_FAST,
+    PNG_PROFILE_SMALL
+} PngProfile;
+
+#define PNG_PROFILE_COUNT 3
+
+static inline const char* png_profile_name(PngProfile profile) {
+    switch (profile) {
+    case PNG_PROFILE_FAST: return "fast";
+    case PNG_PROFILE_SMALL: return "small";
+    default: return "default";
+    }
+}
+
+// Parse a profile name, returns -1 when it is unknown
+static inline int png_profile_parse(const char* name) {
+    for (int p = 0; p < PNG_PROFILE_COUNT; p++) {
+        if (strcmp(name, png_profile_name((PngProfile) p)) == 0) return p;
+    }
+    return -1;
+}
+
+static inline void png_profile_apply(png_structp png, PngProfile profile) {
+    switch (profile) {
+    case PNG_PROFILE_FAST:
+        png_set_compression_level(png, 1);
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+        break;
+    case PNG_PROFILE_SMALL:
+        // All filters stay enabled so libpng keeps the previous row around,
+        // png_profile_write_rows() then narrows it down to one filter per row.
+        // libpng would switch to Z_FILTERED for that, which loses on indexed sprites
+        png_set_compression_level(png, 9);
+        png_set_compression_mem_level(png, 9);
+        png_set_compression_strategy(png, Z_DEFAULT_STRATEGY);
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_ALL_FILTERS);
+        break;
+    default:
+        break;
+    }
+}
+
+static inline uint8_t png_profile_paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return (uint8_t) a;
+    return (uint8_t) (pb <= pc ? b : c);
+}
+
+// Apply PNG filter type f (0 = None ... 4 = Paeth) to row, prev is NULL for the first row
+static inline void png_profile_filter_row(int f, const uint8_t* row, const uint8_t* prev, size_t len, int bpp, uint8_t* out) {
+    for (size_t i = 0; i < len; i++) {
+        int a = i >= (size_t) bpp ? row[i - bpp] : 0;
+        int b = prev ? prev[i] : 0;
+        int c = prev && i >= (size_t) bpp ? prev[i - bpp] : 0;
+        switch (f) {
+        case 0: out[i] = row[i]; break;
+        case 1: out[i] = (uint8_t) (row[i] - a); break;
+        case 2: out[i] = (uint8_t) (row[i] - b); break;
+        case 3: out[i] = (uint8_t) (row[i] - ((a + b) >> 1)); break;
+        default: out[i] = (uint8_t) (row[i] - png_profile_paeth(a, b, c)); break;
+        }
+    }
+}
+
+// Write all rows of the image. The small profile deflates each row with every
+// filter in a scratch stream primed with the rows already chosen, and tells
+// libpng to use the filter that compressed best
+#define PNG_PROFILE_WINDOW 8192
+
+static inline void png_profile_write_rows(png_structp png, PngProfile profile, png_bytepp rows,
+    png_uint_32 width, png_uint_32 height, size_t rowBytes, int bpp) {
+    if (profile != PNG_PROFILE_SMALL || width < 2 || height < 2) {
+        png_write_image(png, rows);
+        return;
+    }
+
+    static const int filterFlags[5] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH };
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        png_write_image(png, rows);
+        return;
+    }
+    uLong bound = deflateBound(&zs, rowBytes);
+    // window holds the tail of the filtered rows written so far, then the
+    // candidate row and the deflate output
+    uint8_t* window = (uint8_t*) malloc(PNG_PROFILE_WINDOW + rowBytes * 2 + bound);
+    if (!window) {
+        deflateEnd(&zs);
+        png_write_image(png, rows);
+        return;
+    }
+    uint8_t* filtered = window + PNG_PROFILE_WINDOW;
+    uint8_t* chosen = filtered + rowBytes;
+    uint8_t* scratch = chosen + rowBytes;
+    size_t windowLen = 0;
+
+    for (png_uint_32 y = 0; y < height; y++) {
+        int best = 0;
+        uLong bestSize = 0;
+        for (int f = 0; f < 5; f++) {
+            png_profile_filter_row(f, rows[y], y > 0 ? rows[y - 1] : NULL, rowBytes, bpp, filtered);
+            deflateReset(&zs);
+            if (windowLen > 0) deflateSetDictionary(&zs, window + PNG_PROFILE_WINDOW - windowLen, (uInt) windowLen);
+            zs.next_in = filtered;
+            zs.avail_in = (uInt) rowBytes;
+            zs.next_out = scratch;
+            zs.avail_out = (uInt) bound;
+            deflate(&zs, Z_FINISH);
+            if (f == 0 || zs.total_out < bestSize) {
+                best = f;
+                bestSize = zs.total_out;
+                memcpy(chosen, filtered, rowBytes);
+            }
+        }
+        // libpng only allocates the previous row buffer if the filters that
+        // need it are still enabled when it writes the first row, so that
+        // row keeps the full set and libpng's own choice
+        if (y > 0) png_set_filter(png, PNG_FILTER_TYPE_BASE, filterFlags[best]);
+        png_write_row(png, rows[y]);
+
+        // slide the chosen row into the dictionary window
+        size_t keep = rowBytes >= PNG_PROFILE_WINDOW ? 0 : PNG_PROFILE_WINDOW - rowBytes;
+        if (keep > windowLen) keep = windowLen;
+        memmove(window + PNG_PROFILE_WINDOW - keep - (rowBytes < PNG_PROFILE_WINDOW ? rowBytes : PNG_PROFILE_WINDOW),
+            window + PNG_PROFILE_WINDOW - keep, keep);
+        size_t add = rowBytes < PNG_PROFILE_WINDOW ? rowBytes : PNG_PROFILE_WINDOW;
+        memcpy(window + PNG_PROFILE_WINDOW - add, chosen + rowBytes - add, add);
+        windowLen = keep + add;
+    }
+
+    deflateEnd(&zs);
+    free(window);
+}
+
+#endif // PNG_PROFILE_H
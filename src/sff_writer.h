@@ -0,0 +1,354 @@
+// SFF v2 writer used by sffcli --write-sff
+//   sff_encode_rle8(), sff_encode_rle5(), sff_encode_lz5() compress the palette
+//   indices of one sprite in the formats the readers decode (LZ5 only holds 5 bit
+//   colours, sprites with a colour of 32 or more can not use it)
+//   sff_pick_encoding() encodes a sprite in all of them and keeps the one with the
+//   lowest size x decode cost of the SffPolicy
+//   sff_write_v2() lays out the header, the sprite and palette headers, then the
+//   palettes and the sprite data in header order, all in the literal data block
+// Sprites and palettes with link >= 0 have no data of their own (size 0 in the header)
+
+#ifndef SFF_WRITER_H
+#define SFF_WRITER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+typedef enum {
+    SFF_POLICY_SIZE,        // smallest file
+    SFF_POLICY_BALANCED,    // smallest, with the slower decoders paying for their cost
+    SFF_POLICY_SPEED        // RLE8 unless another format is several times smaller
+} SffPolicy;
+
+#define SFF_POLICY_COUNT 3
+
+static inline const char* sff_policy_name(SffPolicy policy) {
+    switch (policy) {
+    case SFF_POLICY_SIZE: return "size";
+    case SFF_POLICY_SPEED: return "speed";
+    default: return "balanced";
+    }
+}
+
+// Parse a policy name, returns -1 when it is unknown
+static inline int sff_policy_parse(const char* name) {
+    for (int p = 0; p < SFF_POLICY_COUNT; p++) {
+        if (strcmp(name, sff_policy_name((SffPolicy) p)) == 0) return p;
+    }
+    return -1;
+}
+
+// Decode cost of a sprite format per encoded byte under a policy, in percent of
+// RLE8. 0 = not allowed. PNG10 only stays PNG10 when that is what the policy wants
+static inline int sff_policy_cost(SffPolicy policy, int format) {
+    static const int cost[SFF_POLICY_COUNT][4] = {
+        //  RLE8 RLE5  LZ5  PNG10
+        {    100,  100, 100, 100 },     // size
+        {    100,  120, 150, 300 },     // balanced
+        {    100,  200, 300,   0 },     // speed
+    };
+    switch (format) {
+    case 2: return cost[policy][0];
+    case 3: return cost[policy][1];
+    case 4: return cost[policy][2];
+    case 10: return cost[policy][3];
+    default: return 0;
+    }
+}
+
+// RLE8: a byte 0x40 | n followed by a colour is a run of n (1 to 63), any other byte
+// is one pixel of that colour
+static inline void sff_encode_rle8(const uint8_t* px, size_t n, std::vector<uint8_t>& out) {
+    out.clear();
+    for (size_t j = 0; j < n;) {
+        uint8_t c = px[j];
+        size_t run = 1;
+        while (j + run < n && px[j + run] == c && run < 63) run++;
+        if (run == 1 && (c & 0xC0) != 0x40) {
+            out.push_back(c);
+        } else {
+            out.push_back((uint8_t) (0x40 | run));
+            out.push_back(c);
+        }
+        j += run;
+    }
+}
+
+// RLE5: packets of a run (1 to 256) of any colour, then up to 127 literal bytes of a
+// 5 bit colour and a run of 1 to 8. The packet header is the run length - 1 and the
+// literal count, with bit 7 set and the colour after it when that is not 0
+static inline void sff_encode_rle5(const uint8_t* px, size_t n, std::vector<uint8_t>& out) {
+    out.clear();
+    std::vector<uint8_t> lits;
+    for (size_t j = 0; j < n;) {
+        uint8_t c = px[j];
+        size_t run = 1;
+        while (j + run < n && px[j + run] == c && run < 256) run++;
+        j += run;
+
+        lits.clear();
+        while (j < n && px[j] < 32 && lits.size() < 127) {
+            uint8_t c2 = px[j];
+            size_t r = 1;
+            while (j + r < n && px[j + r] == c2 && r < 256) r++;
+            // A long run is cheaper as the run of the next packet
+            if ((r + 7) / 8 > (c2 == 0 ? 2u : 3u)) break;
+            size_t m = r < 8 ? r : 8;
+            lits.push_back((uint8_t) (c2 | (m - 1) << 5));
+            j += m;
+        }
+        out.push_back((uint8_t) (run - 1));
+        if (c != 0) {
+            out.push_back((uint8_t) (0x80 | lits.size()));
+            out.push_back(c);
+        } else {
+            out.push_back((uint8_t) lits.size());
+        }
+        out.insert(out.end(), lits.begin(), lits.end());
+    }
+}
+
+#define SFF_LZ5_WINDOW 1024     // farthest back-reference
+#define SFF_LZ5_CHAIN 32        // match candidates tried per position
+
+// LZ5: a control byte flags each of the next 8 tokens as literal or back-reference.
+//   literal    (n << 5 | colour) for a run of 1 to 7, or colour, n - 8 for 8 to 263
+//   short ref  (rb << 6 | n - 1), distance - 1: 2 to 64 pixels up to 256 back. Every
+//              4th short ref has no distance byte, its distance - 1 is made of the top
+//              2 bits of it and the 3 short refs before, which are filled in afterwards
+//   long ref   (distance - 1 >> 8 << 6), distance - 1 & 0xFF, n - 3: 3 to 258 pixels
+//              up to 1024 back
+// Greedy: at every pixel the token that covers the most pixels per byte wins. Matches
+// come from hash chains over 3 pixel prefixes, exact since 3 colours fit in 15 bits.
+// Returns false when a colour does not fit in 5 bits
+static inline bool sff_encode_lz5(const uint8_t* px, size_t n, std::vector<uint8_t>& out) {
+    out.clear();
+    for (size_t j = 0; j < n; j++) {
+        if (px[j] >= 32) return false;
+    }
+    std::vector<int32_t> head(1 << 15, -1), prev(n, -1);
+    auto hash3 = [px](size_t p) { return px[p] << 10 | px[p + 1] << 5 | px[p + 2]; };
+    auto insert = [&](size_t p) {
+        if (p + 2 >= n) return;
+        int h = hash3(p);
+        prev[p] = head[h];
+        head[h] = (int32_t) p;
+    };
+
+    size_t ctPos = 0;
+    int cts = 8;            // tokens under the current control byte
+    int rbc = 0;            // short refs since the last one carrying rb
+    size_t shortPos[3] = {};
+    auto token = [&](bool ref) {
+        if (cts == 8) {
+            ctPos = out.size();
+            out.push_back(0);
+            cts = 0;
+        }
+        if (ref) out[ctPos] |= (uint8_t) (1 << cts);
+        cts++;
+    };
+
+    for (size_t j = 0; j < n;) {
+        uint8_t c = px[j];
+        size_t run = 1;
+        while (j + run < n && px[j + run] == c && run < 263) run++;
+
+        size_t bestLen = 0, bestDist = 0;
+        if (j + 2 < n) {
+            int k = 0;
+            for (int32_t cand = head[hash3(j)]; cand >= 0 && j - cand <= SFF_LZ5_WINDOW && k < SFF_LZ5_CHAIN; cand = prev[cand], k++) {
+                size_t m = 0;
+                while (j + m < n && px[cand + m] == px[j + m] && m < 258) m++;
+                if (m > bestLen) {
+                    bestLen = m;
+                    bestDist = j - cand;
+                    if (m == 258) break;
+                }
+            }
+        }
+
+        // Pixels covered and bytes spent by each candidate token, 0 pixels = not possible
+        size_t litLen = run, litBytes = run <= 7 ? 1 : 2;
+        size_t shortLen = bestDist <= 256 && bestLen >= 2 ? (bestLen < 64 ? bestLen : 64) : 0;
+        size_t shortBytes = rbc == 6 ? 1 : 2;
+        size_t longLen = bestLen >= 3 ? bestLen : 0;
+        size_t len = litLen;
+        int kind = 0;
+        if (shortLen * litBytes > len * shortBytes) {
+            len = shortLen;
+            kind = 1;
+        }
+        if (longLen * (kind == 1 ? shortBytes : litBytes) > len * 3) {
+            len = longLen;
+            kind = 2;
+        }
+
+        if (kind == 0) {
+            token(false);
+            if (run <= 7) {
+                out.push_back((uint8_t) (run << 5 | c));
+            } else {
+                out.push_back(c);
+                out.push_back((uint8_t) (run - 8));
+            }
+        } else if (kind == 1) {
+            token(true);
+            if (rbc < 6) {
+                shortPos[rbc / 2] = out.size();
+                out.push_back((uint8_t) (len - 1));
+                out.push_back((uint8_t) (bestDist - 1));
+                rbc += 2;
+            } else {
+                uint8_t rb = (uint8_t) (bestDist - 1);
+                for (int k = 0; k < 3; k++) {
+                    out[shortPos[k]] |= (uint8_t) (((rb >> (6 - 2 * k)) & 3) << 6);
+                }
+                out.push_back((uint8_t) ((rb & 3) << 6 | (len - 1)));
+                rbc = 0;
+            }
+        } else {
+            token(true);
+            size_t d = bestDist - 1;
+            out.push_back((uint8_t) (((d >> 8) & 3) << 6));
+            out.push_back((uint8_t) (d & 0xFF));
+            out.push_back((uint8_t) (len - 3));
+        }
+        for (size_t k = 0; k < len; k++) insert(j + k);
+        j += len;
+    }
+    if (out.empty()) out.push_back(0);
+    return true;
+}
+
+// Encode the indices of a sprite in the format with the lowest size x cost under
+// policy. png is the sprite's PNG10 data when it has some, kept when it wins.
+// Returns the format, out holds its data without the uncompressed length
+static inline int sff_pick_encoding(const uint8_t* px, size_t n, SffPolicy policy,
+    const uint8_t* png, size_t pngLen, std::vector<uint8_t>& out) {
+    std::vector<uint8_t> candidate;
+    int best = 2;
+    sff_encode_rle8(px, n, out);
+    uint64_t bestScore = (uint64_t) out.size() * sff_policy_cost(policy, 2);
+    for (int format = 3; format <= 4; format++) {
+        if (!sff_policy_cost(policy, format)) continue;
+        if (format == 3) {
+            sff_encode_rle5(px, n, candidate);
+        } else if (!sff_encode_lz5(px, n, candidate)) {
+            continue;
+        }
+        uint64_t score = (uint64_t) candidate.size() * sff_policy_cost(policy, format);
+        if (score < bestScore) {
+            bestScore = score;
+            best = format;
+            out.swap(candidate);
+        }
+    }
+    if (png && sff_policy_cost(policy, 10) && (uint64_t) pngLen * sff_policy_cost(policy, 10) < bestScore) {
+        out.assign(png, png + pngLen);
+        best = 10;
+    }
+    if (out.empty()) out.push_back(0);
+    return best;
+}
+
+typedef struct {
+    uint16_t group, number;
+    uint16_t width, height;
+    int16_t x, y;
+    int link;                   // sprite whose data this one shares, -1 = own data
+    uint8_t format;
+    uint8_t coldepth;
+    uint16_t palidx;
+    std::vector<uint8_t> data;  // as stored: the uncompressed length, then the encoded pixels
+} SffWriterSprite;
+
+typedef struct {
+    int16_t group, number;
+    int link;                   // palette with the same colours, -1 = own colours
+    const uint32_t* colors;     // 256 x 0x00BBGGRR
+} SffWriterPalette;
+
+static inline void sff_put16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static inline void sff_put32(uint8_t* p, uint32_t v) {
+    sff_put16(p, v & 0xFFFF);
+    sff_put16(p + 2, v >> 16);
+}
+
+#define SFF_V2_HEADER_SIZE 512
+
+static inline void sff_write_v2(const std::vector<SffWriterSprite>& sprites, const std::vector<SffWriterPalette>& palettes,
+    std::vector<uint8_t>& out) {
+    size_t spriteHeaders = SFF_V2_HEADER_SIZE;
+    size_t paletteHeaders = spriteHeaders + sprites.size() * 28;
+    size_t ldata = paletteHeaders + palettes.size() * 16;
+
+    // Offsets inside the literal data: the palettes, then the sprites in header order
+    std::vector<uint32_t> palOfs(palettes.size()), sprOfs(sprites.size());
+    size_t pos = 0;
+    for (size_t k = 0; k < palettes.size(); k++) {
+        palOfs[k] = palettes[k].link >= 0 ? palOfs[palettes[k].link] : (uint32_t) pos;
+        if (palettes[k].link < 0) pos += 1024;
+    }
+    for (size_t k = 0; k < sprites.size(); k++) {
+        sprOfs[k] = sprites[k].link >= 0 ? 0 : (uint32_t) pos;
+        if (sprites[k].link < 0) pos += sprites[k].data.size();
+    }
+    out.assign(ldata + pos, 0);
+
+    uint8_t* h = out.data();
+    memcpy(h, "ElecbyteSpr\0", 12);
+    h[12] = 0;                  // version 2.01
+    h[13] = 1;
+    h[14] = 0;
+    h[15] = 2;
+    h[23] = 2;                  // compatible with 2.00
+    sff_put32(h + 36, (uint32_t) spriteHeaders);
+    sff_put32(h + 40, (uint32_t) sprites.size());
+    sff_put32(h + 44, (uint32_t) paletteHeaders);
+    sff_put32(h + 48, (uint32_t) palettes.size());
+    sff_put32(h + 52, (uint32_t) ldata);
+    sff_put32(h + 56, (uint32_t) pos);
+    sff_put32(h + 60, (uint32_t) (ldata + pos));
+    sff_put32(h + 64, 0);       // no translated data
+
+    for (size_t k = 0; k < sprites.size(); k++) {
+        const SffWriterSprite& s = sprites[k];
+        uint8_t* p = out.data() + spriteHeaders + k * 28;
+        sff_put16(p, s.group);
+        sff_put16(p + 2, s.number);
+        sff_put16(p + 4, s.width);
+        sff_put16(p + 6, s.height);
+        sff_put16(p + 8, (uint16_t) s.x);
+        sff_put16(p + 10, (uint16_t) s.y);
+        sff_put16(p + 12, s.link >= 0 ? (uint16_t) s.link : 0);
+        p[14] = s.format;
+        p[15] = s.coldepth;
+        sff_put32(p + 16, sprOfs[k]);
+        sff_put32(p + 20, s.link >= 0 ? 0 : (uint32_t) s.data.size());
+        sff_put16(p + 24, s.palidx);
+        sff_put16(p + 26, 0);   // flags: literal data
+        if (s.link < 0 && !s.data.empty()) memcpy(out.data() + ldata + sprOfs[k], s.data.data(), s.data.size());
+    }
+    for (size_t k = 0; k < palettes.size(); k++) {
+        const SffWriterPalette& pal = palettes[k];
+        uint8_t* p = out.data() + paletteHeaders + k * 16;
+        sff_put16(p, (uint16_t) pal.group);
+        sff_put16(p + 2, (uint16_t) pal.number);
+        sff_put16(p + 4, 256);
+        sff_put16(p + 6, pal.link >= 0 ? (uint16_t) pal.link : 0);
+        sff_put32(p + 8, palOfs[k]);
+        sff_put32(p + 12, pal.link >= 0 ? 0 : 1024);
+        if (pal.link < 0) {
+            uint8_t* c = out.data() + ldata + palOfs[k];
+            for (int i = 0; i < 256; i++) sff_put32(c + i * 4, pal.colors[i] & 0xFFFFFF);
+        }
+    }
+}
+
+#endif // SFF_WRITER_H
@@ -0,0 +1,135 @@
+// libsffcli: sprites straight from an SFF file, without the PNG or atlas step of sffcli
+//   sffcli_open()          maps the file and reads its sprite headers and palettes,
+//                          no pixel is decoded yet
+//   sffcli_find_sprite()   (Group, Number) -> sprite index
+//   sffcli_sprite_info()   size, axis, palette and format of a sprite
+//   sffcli_decode_sprite() decodes one sprite into a buffer of the caller
+//   sffcli_palette()       colours of a palette index
+//   sffcli_close()
+//   sffcli_decode_batch()  the decoders on data the caller read, many sprites per call
+// Only the sprites asked for are ever decompressed. An open file is read-only, any
+// number of threads can decode from it at once. A decode makes no heap allocation,
+// but for the first PNG sprites of a thread while its libpng scratch block grows
+// Errors are printed to stderr and returned as -1 (NULL for sffcli_open)
+//
+// SffcliCache keeps decoded sprites for frames that show again, up to a budget of
+// bytes, least recently used out first. It is split in shards with a lock each, so
+// render and loader threads can use one cache at once
+//   sffcli_cache_acquire() the pixels of a sprite, decoded on a miss; they stay
+//                          valid until sffcli_cache_release()
+//   sffcli_cache_drop()    forgets the sprites of one file, before sffcli_close()
+//   sffcli_cache_stats()   hit, miss and eviction counters
+
+#ifndef SFFCLI_H
+#define SFFCLI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(SFFCLI_SHARED)
+#define SFFCLI_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define SFFCLI_API __attribute__((visibility("default")))
+#else
+#define SFFCLI_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SffcliFile SffcliFile;
+
+typedef struct {
+    uint16_t group, number;
+    uint16_t width, height;
+    int16_t x, y;           // axis, the sprite origin relative to its top left pixel
+    int palette;            // palette index, -1 for true colour sprites
+    int format;             // 0 raw, 1 PCX (SFF v1), 2 RLE8, 3 RLE5, 4 LZ5, 10 to 12 PNG
+    int bytesPerPixel;      // of the decoded pixels: 1 = palette indices, 4 = RGBA
+    int link;               // sprite whose pixels this one shares, -1 = its own
+} SffcliSprite;
+
+SFFCLI_API SffcliFile* sffcli_open(const char* filename);
+SFFCLI_API void sffcli_close(SffcliFile* sff);
+
+// 1 or 2
+SFFCLI_API int sffcli_version(const SffcliFile* sff);
+SFFCLI_API int sffcli_sprite_count(const SffcliFile* sff);
+SFFCLI_API int sffcli_palette_count(const SffcliFile* sff);
+
+// Index of sprite (group, number), -1 when there is none. The first sprite of a key wins
+SFFCLI_API int sffcli_find_sprite(const SffcliFile* sff, uint16_t group, uint16_t number);
+SFFCLI_API int sffcli_sprite_info(const SffcliFile* sff, int index, SffcliSprite* info);
+
+// Decode sprite index into pixels, width x height x bytesPerPixel bytes in rows
+// without padding. size is the size of the buffer, too small is an error
+SFFCLI_API int sffcli_decode_sprite(const SffcliFile* sff, int index, void* pixels, size_t size);
+
+// Palette index of palette (group, number), -1 when there is none
+SFFCLI_API int sffcli_find_palette(const SffcliFile* sff, uint16_t group, uint16_t number);
+
+// The 256 colours of palette palidx as R, G, B, A bytes, colour 0 is transparent
+SFFCLI_API int sffcli_palette(const SffcliFile* sff, int palidx, uint8_t rgba[1024]);
+
+// The decoders alone, for front ends that read SFF files themselves (go_sffcli built
+// with -tags sffcli_native). One call decodes a whole batch of sprites, their encoded
+// data back to back in one buffer and their pixels in another, so a caller needs
+// neither a pointer per sprite nor a call per sprite
+typedef struct {
+    size_t srcOffset, srcLen;   // encoded data in src, SFF v2 data without its length prefix
+    size_t pixelsOffset;        // width x height palette indices in pixels
+    uint16_t width, height;
+    uint16_t bpl;               // PCX: bytes per encoded line
+    uint8_t format;             // 1 PCX, 2 RLE8, 3 RLE5, 4 LZ5
+    int8_t result;              // set by the call: 0 or -1
+} SffcliDecodeJob;
+
+// Returns the number of jobs that failed
+SFFCLI_API int sffcli_decode_batch(SffcliDecodeJob* jobs, int count, const uint8_t* src, uint8_t* pixels);
+
+typedef struct SffcliCache SffcliCache;
+
+// sffcli_cache_acquire() flags
+#define SFFCLI_CACHE_CROP 1     // keep only the visible part of the sprite
+#define SFFCLI_CACHE_PREMULTIPLIED 2    // RGBA with the colours multiplied by alpha
+
+// Pixels of one cached sprite: width x height x bytesPerPixel bytes, the part of the
+// sprite at x, y (all of it, at 0, 0, unless cropped; 0 x 0 when cropped blank)
+typedef struct {
+    const uint8_t* pixels;
+    uint16_t x, y;
+    uint16_t width, height;
+    int bytesPerPixel;
+    SffcliSprite sprite;
+} SffcliPixels;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;           // pixel bytes held
+} SffcliCacheStats;
+
+SFFCLI_API SffcliCache* sffcli_cache_create(size_t budget);
+// No sprite may still be acquired
+SFFCLI_API void sffcli_cache_destroy(SffcliCache* cache);
+
+// Sprite (group, number) of sff. With palidx >= 0 an indexed sprite comes as RGBA
+// through that palette (colour 0 transparent), with -1 as it decodes. RGBA sprites,
+// true colour or expanded, are premultiplied with SFFCLI_CACHE_PREMULTIPLIED. NULL when
+// there is no such sprite or it does not decode. An acquired sprite is never evicted,
+// the cache may go over its budget while too many are held
+SFFCLI_API const SffcliPixels* sffcli_cache_acquire(SffcliCache* cache, const SffcliFile* sff,
+    uint16_t group, uint16_t number, int palidx, int flags);
+SFFCLI_API void sffcli_cache_release(SffcliCache* cache, const SffcliPixels* pixels);
+
+SFFCLI_API void sffcli_cache_drop(SffcliCache* cache, const SffcliFile* sff);
+SFFCLI_API void sffcli_cache_stats(SffcliCache* cache, SffcliCacheStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SFFCLI_H
@@ -0,0 +1,561 @@
+// GPU texture writer used by sffcli --texture
+//   texture_encode() turns one 8 bit image into a DDS (with the DX10 header) or KTX2
+//   file in memory, optionally with its full mip chain:
+//     R8     palette indices as they are, for a palette lookup in the shader.
+//            Mips keep the top left index of every 2 x 2, indices do not average
+//     RGBA8  uncompressed
+//     BC3    4 bpp colour (BC1 block) and interpolated alpha (BC4 block)
+//     BC7    mode 6 only: one RGBA line per block with 16 steps, 8 bpp
+//            RGBA8, BC3 and BC7 mips are 2 x 2 box filtered
+//   The blocks are encoded on several threads, one row of blocks at a time
+// Both compressors fit each block to its principal colour axis; they aim at fast
+// and predictable rather than at the best possible quality
+
+#ifndef TEXTURE_WRITER_H
+#define TEXTURE_WRITER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+typedef enum {
+    TEXTURE_R8,
+    TEXTURE_RGBA8,
+    TEXTURE_BC3,
+    TEXTURE_BC7
+} TextureFormat;
+
+typedef enum {
+    TEXTURE_DDS,
+    TEXTURE_KTX2
+} TextureContainer;
+
+static inline const char* texture_format_name(TextureFormat format) {
+    switch (format) {
+    case TEXTURE_R8: return "r8";
+    case TEXTURE_RGBA8: return "rgba8";
+    case TEXTURE_BC3: return "bc3";
+    default: return "bc7";
+    }
+}
+
+static inline bool texture_is_block(TextureFormat format) {
+    return format == TEXTURE_BC3 || format == TEXTURE_BC7;
+}
+
+// Bytes of one pixel, or of one 4 x 4 block
+static inline uint32_t texture_unit_bytes(TextureFormat format) {
+    switch (format) {
+    case TEXTURE_R8: return 1;
+    case TEXTURE_RGBA8: return 4;
+    default: return 16;
+    }
+}
+
+static inline size_t texture_level_bytes(TextureFormat format, uint32_t w, uint32_t h) {
+    if (texture_is_block(format)) return (size_t) ((w + 3) / 4) * ((h + 3) / 4) * 16;
+    return (size_t) w * h * texture_unit_bytes(format);
+}
+
+// Next mip level of an image with bpp 1 (nearest) or 4 (box filter)
+static inline void texture_downsample(const std::vector<uint8_t>& src, uint32_t w, uint32_t h, int bpp,
+    std::vector<uint8_t>& dst, uint32_t* dw, uint32_t* dh) {
+    *dw = w > 1 ? w / 2 : 1;
+    *dh = h > 1 ? h / 2 : 1;
+    dst.resize((size_t) *dw * *dh * bpp);
+    for (uint32_t y = 0; y < *dh; y++) {
+        uint32_t y0 = y * 2 < h ? y * 2 : h - 1, y1 = y * 2 + 1 < h ? y * 2 + 1 : y0;
+        for (uint32_t x = 0; x < *dw; x++) {
+            uint32_t x0 = x * 2 < w ? x * 2 : w - 1, x1 = x * 2 + 1 < w ? x * 2 + 1 : x0;
+            uint8_t* d = &dst[((size_t) y * *dw + x) * bpp];
+            if (bpp == 1) {
+                *d = src[(size_t) y0 * w + x0];
+                continue;
+            }
+            for (int c = 0; c < 4; c++) {
+                int sum = src[((size_t) y0 * w + x0) * 4 + c] + src[((size_t) y0 * w + x1) * 4 + c] +
+                    src[((size_t) y1 * w + x0) * 4 + c] + src[((size_t) y1 * w + x1) * 4 + c];
+                d[c] = (uint8_t) ((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+// The 4 x 4 RGBA block at (bx, by), edge pixels repeat past the image
+static inline void texture_fetch_block(const uint8_t* rgba, uint32_t w, uint32_t h, uint32_t bx, uint32_t by, uint8_t block[16][4]) {
+    for (int y = 0; y < 4; y++) {
+        uint32_t sy = by * 4 + y < h ? by * 4 + y : h - 1;
+        for (int x = 0; x < 4; x++) {
+            uint32_t sx = bx * 4 + x < w ? bx * 4 + x : w - 1;
+            memcpy(block[y * 4 + x], rgba + ((size_t) sy * w + sx) * 4, 4);
+        }
+    }
+}
+
+// Principal axis of the first channels of the pixels with weight: mean in mean,
+// unit direction in axis. Power iteration on the covariance
+static inline void texture_principal_axis(const uint8_t block[16][4], const bool* use, int channels, float mean[4], float axis[4]) {
+    float cov[4][4] = {};
+    int n = 0;
+    for (int c = 0; c < 4; c++) mean[c] = axis[c] = 0;
+    for (int i = 0; i < 16; i++) {
+        if (!use[i]) continue;
+        for (int c = 0; c < channels; c++) mean[c] += block[i][c];
+        n++;
+    }
+    if (n == 0) return;
+    for (int c = 0; c < channels; c++) mean[c] /= n;
+    for (int i = 0; i < 16; i++) {
+        if (!use[i]) continue;
+        for (int a = 0; a < channels; a++) {
+            for (int b = 0; b < channels; b++) cov[a][b] += (block[i][a] - mean[a]) * (block[i][b] - mean[b]);
+        }
+    }
+    float v[4] = { 1, 1, 1, 1 };
+    for (int it = 0; it < 8; it++) {
+        float r[4] = {}, len = 0;
+        for (int a = 0; a < channels; a++) {
+            for (int b = 0; b < channels; b++) r[a] += cov[a][b] * v[b];
+            len += r[a] * r[a];
+        }
+        if (len <= 0) break;
+        len = sqrtf(len);
+        for (int a = 0; a < channels; a++) v[a] = r[a] / len;
+    }
+    for (int c = 0; c < channels; c++) axis[c] = v[c];
+}
+
+// The pixels with the lowest and the highest projection on the axis
+static inline void texture_axis_extremes(const uint8_t block[16][4], const bool* use, int channels, const float mean[4], const float axis[4],
+    float lo[4], float hi[4]) {
+    float minp = 1e30f, maxp = -1e30f;
+    for (int i = 0; i < 16; i++) {
+        if (!use[i]) continue;
+        float p = 0;
+        for (int c = 0; c < channels; c++) p += (block[i][c] - mean[c]) * axis[c];
+        if (p < minp) minp = p;
+        if (p > maxp) maxp = p;
+    }
+    for (int c = 0; c < channels; c++) {
+        lo[c] = mean[c] + axis[c] * minp;
+        hi[c] = mean[c] + axis[c] * maxp;
+        lo[c] = lo[c] < 0 ? 0 : lo[c] > 255 ? 255 : lo[c];
+        hi[c] = hi[c] < 0 ? 0 : hi[c] > 255 ? 255 : hi[c];
+    }
+}
+
+static inline int texture_sq(int v) {
+    return v * v;
+}
+
+// BC1 colour part, always the 4 colour mode as BC3 reads it. Fully transparent
+// pixels do not take part in the fit
+static inline void texture_bc1_color(const uint8_t block[16][4], uint8_t out[8]) {
+    bool use[16];
+    bool any = false;
+    for (int i = 0; i < 16; i++) any |= use[i] = block[i][3] > 0;
+    if (!any) {
+        memset(out, 0, 8);
+        return;
+    }
+    float mean[4], axis[4], lo[4], hi[4];
+    texture_principal_axis(block, use, 3, mean, axis);
+    texture_axis_extremes(block, use, 3, mean, axis, lo, hi);
+    auto to565 = [](const float c[4]) {
+        return (uint16_t) (((int) (c[0] * 31 / 255 + 0.5f) << 11) | ((int) (c[1] * 63 / 255 + 0.5f) << 5) | (int) (c[2] * 31 / 255 + 0.5f));
+    };
+    uint16_t c0 = to565(hi), c1 = to565(lo);
+    if (c0 < c1) {
+        uint16_t t = c0;
+        c0 = c1;
+        c1 = t;
+    }
+    int pal[4][3];
+    for (int k = 0; k < 2; k++) {
+        uint16_t c = k == 0 ? c0 : c1;
+        pal[k][0] = ((c >> 11) & 31) * 255 / 31;
+        pal[k][1] = ((c >> 5) & 63) * 255 / 63;
+        pal[k][2] = (c & 31) * 255 / 31;
+    }
+    for (int c = 0; c < 3; c++) {
+        pal[2][c] = (2 * pal[0][c] + pal[1][c]) / 3;
+        pal[3][c] = (pal[0][c] + 2 * pal[1][c]) / 3;
+    }
+    uint32_t indices = 0;
+    for (int i = 0; i < 16; i++) {
+        int best = 0, bestErr = 1 << 30;
+        for (int k = 0; k < 4; k++) {
+            int err = texture_sq(block[i][0] - pal[k][0]) + texture_sq(block[i][1] - pal[k][1]) + texture_sq(block[i][2] - pal[k][2]);
+            if (err < bestErr) {
+                bestErr = err;
+                best = k;
+            }
+        }
+        indices |= (uint32_t) best << (i * 2);
+    }
+    out[0] = c0 & 0xFF;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xFF;
+    out[3] = c1 >> 8;
+    for (int b = 0; b < 4; b++) out[4 + b] = (indices >> (b * 8)) & 0xFF;
+}
+
+// BC4 block of one channel: the 8 step mode over min..max, and the 6 step mode
+// with exact 0 and 255 over the other values, whichever is closer
+static inline void texture_bc4(const uint8_t block[16][4], int channel, uint8_t out[8]) {
+    int bestErr = -1;
+    for (int mode = 0; mode < 2; mode++) {
+        int lo = 255, hi = 0;
+        for (int i = 0; i < 16; i++) {
+            int v = block[i][channel];
+            if (mode == 1 && (v == 0 || v == 255)) continue;
+            if (v < lo) lo = v;
+            if (v > hi) hi = v;
+        }
+        if (lo > hi) lo = hi = 0;
+        int a0, a1, pal[8];
+        if (mode == 0) {
+            a0 = hi;
+            a1 = lo;
+            if (a0 == a1) {
+                if (a1 > 0) a1--; else a0++;
+            }
+            pal[0] = a0;
+            pal[1] = a1;
+            for (int k = 1; k < 7; k++) pal[k + 1] = ((7 - k) * a0 + k * a1) / 7;
+        } else {
+            a0 = lo;
+            a1 = hi;
+            pal[0] = a0;
+            pal[1] = a1;
+            for (int k = 1; k < 5; k++) pal[k + 1] = ((5 - k) * a0 + k * a1) / 5;
+            pal[6] = 0;
+            pal[7] = 255;
+        }
+        uint64_t indices = 0;
+        int err = 0;
+        for (int i = 0; i < 16; i++) {
+            int best = 0, e = 1 << 30;
+            for (int k = 0; k < 8; k++) {
+                int d = texture_sq(block[i][channel] - pal[k]);
+                if (d < e) {
+                    e = d;
+                    best = k;
+                }
+            }
+            err += e;
+            indices |= (uint64_t) best << (i * 3);
+        }
+        if (bestErr < 0 || err < bestErr) {
+            bestErr = err;
+            out[0] = (uint8_t) a0;
+            out[1] = (uint8_t) a1;
+            for (int b = 0; b < 6; b++) out[2 + b] = (indices >> (b * 8)) & 0xFF;
+        }
+    }
+}
+
+static inline void texture_bc3_block(const uint8_t block[16][4], uint8_t out[16]) {
+    texture_bc4(block, 3, out);
+    texture_bc1_color(block, out + 8);
+}
+
+// Little endian bit writer of one BC7 block
+static inline void texture_put_bits(uint8_t out[16], int* pos, uint32_t value, int bits) {
+    for (int b = 0; b < bits; b++, (*pos)++) {
+        if (value >> b & 1) out[*pos >> 3] |= 1 << (*pos & 7);
+    }
+}
+
+// BC7 mode 6: 7 bit RGBA endpoints, a p-bit each, 4 bit indices. The endpoints start
+// at the ends of the block's principal RGBA axis and are refit by least squares to
+// the indices they give, as long as that lowers the error
+#define TEXTURE_BC7_REFINE 3
+
+// Endpoint k quantized to 7 bits and the p-bit that comes closer
+static inline void texture_bc7_quantize(const float end[4], int q[4], int* p) {
+    int bestErr = -1;
+    for (int pbit = 0; pbit < 2; pbit++) {
+        int t[4], err = 0;
+        for (int c = 0; c < 4; c++) {
+            float f = end[c] < 0 ? 0 : end[c] > 255 ? 255 : end[c];
+            int v = (int) ((f - pbit) / 2 + 0.5f);
+            t[c] = v < 0 ? 0 : v > 127 ? 127 : v;
+            err += texture_sq((t[c] << 1 | pbit) - (int) (f + 0.5f));
+        }
+        if (bestErr < 0 || err < bestErr) {
+            bestErr = err;
+            memcpy(q, t, sizeof(t));
+            *p = pbit;
+        }
+    }
+}
+
+static const int texture_bc7_weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+// Nearest of the 16 steps for every pixel, returns the total squared error
+static inline int texture_bc7_assign(const uint8_t block[16][4], const int e[2][4], const int p[2], int index[16]) {
+    int pal[16][4];
+    for (int c = 0; c < 4; c++) {
+        int c0 = e[0][c] << 1 | p[0], c1 = e[1][c] << 1 | p[1];
+        for (int k = 0; k < 16; k++) pal[k][c] = ((64 - texture_bc7_weights[k]) * c0 + texture_bc7_weights[k] * c1 + 32) >> 6;
+    }
+    int total = 0;
+    for (int i = 0; i < 16; i++) {
+        int best = 0, bestErr = 1 << 30;
+        for (int k = 0; k < 16; k++) {
+            int err = 0;
+            for (int c = 0; c < 4; c++) err += texture_sq(block[i][c] - pal[k][c]);
+            if (err < bestErr) {
+                bestErr = err;
+                best = k;
+            }
+        }
+        index[i] = best;
+        total += bestErr;
+    }
+    return total;
+}
+
+static inline void texture_bc7_block(const uint8_t block[16][4], uint8_t out[16]) {
+    bool use[16];
+    for (int i = 0; i < 16; i++) use[i] = true;
+    float mean[4], axis[4], ends[2][4];
+    texture_principal_axis(block, use, 4, mean, axis);
+    texture_axis_extremes(block, use, 4, mean, axis, ends[0], ends[1]);
+
+    int e[2][4], p[2], index[16];
+    texture_bc7_quantize(ends[0], e[0], &p[0]);
+    texture_bc7_quantize(ends[1], e[1], &p[1]);
+    int err = texture_bc7_assign(block, e, p, index);
+    for (int pass = 0; pass < TEXTURE_BC7_REFINE && err > 0; pass++) {
+        // Least squares endpoints for these indices: x = (1 - t) e0 + t e1
+        float aa = 0, ab = 0, bb = 0, ax[4] = {}, bx[4] = {};
+        for (int i = 0; i < 16; i++) {
+            float t = texture_bc7_weights[index[i]] / 64.0f;
+            aa += (1 - t) * (1 - t);
+            ab += (1 - t) * t;
+            bb += t * t;
+            for (int c = 0; c < 4; c++) {
+                ax[c] += (1 - t) * block[i][c];
+                bx[c] += t * block[i][c];
+            }
+        }
+        float det = aa * bb - ab * ab;
+        if (fabsf(det) < 1e-6f) break;
+        float fit[2][4];
+        for (int c = 0; c < 4; c++) {
+            fit[0][c] = (bb * ax[c] - ab * bx[c]) / det;
+            fit[1][c] = (aa * bx[c] - ab * ax[c]) / det;
+        }
+        int e2[2][4], p2[2], index2[16];
+        texture_bc7_quantize(fit[0], e2[0], &p2[0]);
+        texture_bc7_quantize(fit[1], e2[1], &p2[1]);
+        int err2 = texture_bc7_assign(block, e2, p2, index2);
+        if (err2 >= err) break;
+        err = err2;
+        memcpy(e, e2, sizeof(e));
+        memcpy(p, p2, sizeof(p));
+        memcpy(index, index2, sizeof(index));
+    }
+
+    // The first index is stored without its top bit, so it must be below 8
+    if (index[0] >= 8) {
+        for (int c = 0; c < 4; c++) {
+            int t = e[0][c];
+            e[0][c] = e[1][c];
+            e[1][c] = t;
+        }
+        int t = p[0];
+        p[0] = p[1];
+        p[1] = t;
+        for (int i = 0; i < 16; i++) index[i] = 15 - index[i];
+    }
+
+    memset(out, 0, 16);
+    int pos = 0;
+    texture_put_bits(out, &pos, 1 << 6, 7);
+    for (int c = 0; c < 4; c++) {
+        texture_put_bits(out, &pos, e[0][c], 7);
+        texture_put_bits(out, &pos, e[1][c], 7);
+    }
+    texture_put_bits(out, &pos, p[0], 1);
+    texture_put_bits(out, &pos, p[1], 1);
+    texture_put_bits(out, &pos, index[0], 3);
+    for (int i = 1; i < 16; i++) texture_put_bits(out, &pos, index[i], 4);
+}
+
+// Encode one RGBA level into BC3 or BC7 blocks, block rows spread over threads
+static inline void texture_compress(const uint8_t* rgba, uint32_t w, uint32_t h, TextureFormat format, int threads, uint8_t* out) {
+    uint32_t bw = (w + 3) / 4, bh = (h + 3) / 4;
+    std::atomic<uint32_t> next(0);
+    auto worker = [&]() {
+        uint8_t block[16][4];
+        for (uint32_t by; (by = next++) < bh;) {
+            for (uint32_t bx = 0; bx < bw; bx++) {
+                texture_fetch_block(rgba, w, h, bx, by, block);
+                uint8_t* dst = out + ((size_t) by * bw + bx) * 16;
+                if (format == TEXTURE_BC3) {
+                    texture_bc3_block(block, dst);
+                } else {
+                    texture_bc7_block(block, dst);
+                }
+            }
+        }
+    };
+    if (threads > (int) bh) threads = (int) bh;
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) pool.emplace_back(worker);
+    worker();
+    for (auto& th : pool) th.join();
+}
+
+static inline void texture_put16(std::vector<uint8_t>& out, size_t pos, uint16_t v) {
+    out[pos] = v & 0xFF;
+    out[pos + 1] = v >> 8;
+}
+
+static inline void texture_put32(std::vector<uint8_t>& out, size_t pos, uint32_t v) {
+    texture_put16(out, pos, v & 0xFFFF);
+    texture_put16(out, pos + 2, v >> 16);
+}
+
+static inline void texture_put64(std::vector<uint8_t>& out, size_t pos, uint64_t v) {
+    texture_put32(out, pos, (uint32_t) v);
+    texture_put32(out, pos + 4, (uint32_t) (v >> 32));
+}
+
+// DDS with the DX10 header, levels from the largest
+static inline void texture_write_dds(const std::vector<std::vector<uint8_t>>& levels, uint32_t w, uint32_t h, TextureFormat format,
+    std::vector<uint8_t>& out) {
+    static const uint32_t dxgi[4] = { 61, 28, 77, 98 };  // R8_UNORM, R8G8B8A8_UNORM, BC3_UNORM, BC7_UNORM
+    bool mips = levels.size() > 1;
+    out.assign(4 + 124 + 20, 0);
+    memcpy(out.data(), "DDS ", 4);
+    texture_put32(out, 4, 124);
+    texture_put32(out, 8, 0x1 | 0x2 | 0x4 | 0x1000 | (mips ? 0x20000 : 0) | (texture_is_block(format) ? 0x80000 : 0x8));
+    texture_put32(out, 12, h);
+    texture_put32(out, 16, w);
+    texture_put32(out, 20, texture_is_block(format) ? (uint32_t) levels[0].size() : w * texture_unit_bytes(format));
+    texture_put32(out, 28, (uint32_t) levels.size());
+    texture_put32(out, 76, 32);             // pixel format size
+    texture_put32(out, 80, 0x4);            // DDPF_FOURCC
+    memcpy(&out[84], "DX10", 4);
+    texture_put32(out, 108, 0x1000 | (mips ? 0x400008 : 0));   // texture, mipmap | complex
+    texture_put32(out, 128, dxgi[format]);
+    texture_put32(out, 132, 3);             // 2D texture
+    texture_put32(out, 140, 1);             // array size
+    for (const std::vector<uint8_t>& level : levels) out.insert(out.end(), level.begin(), level.end());
+}
+
+// KTX2 with a basic data format descriptor and a KTXwriter key, levels from the
+// smallest in the file as the format asks
+static inline void texture_write_ktx2(const std::vector<std::vector<uint8_t>>& levels, uint32_t w, uint32_t h, TextureFormat format,
+    std::vector<uint8_t>& out) {
+    static const uint8_t identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    static const uint32_t vkFormat[4] = { 9, 37, 137, 145 };   // R8_UNORM, R8G8B8A8_UNORM, BC3_UNORM_BLOCK, BC7_UNORM_BLOCK
+    static const char writer[] = "KTXwriter\0sffcli";
+
+    // Samples of the descriptor: bit offset, bit length, channel
+    uint32_t samples[4][3];
+    int numSamples = 0;
+    uint8_t model = 1;                      // RGBSDA
+    switch (format) {
+    case TEXTURE_R8:
+        samples[numSamples][0] = 0; samples[numSamples][1] = 8; samples[numSamples++][2] = 0;
+        break;
+    case TEXTURE_RGBA8:
+        for (int c = 0; c < 4; c++) {
+            samples[numSamples][0] = c * 8; samples[numSamples][1] = 8; samples[numSamples++][2] = c == 3 ? 15 : c;
+        }
+        break;
+    case TEXTURE_BC3:
+        model = 130;
+        samples[numSamples][0] = 0; samples[numSamples][1] = 64; samples[numSamples++][2] = 15;    // alpha
+        samples[numSamples][0] = 64; samples[numSamples][1] = 64; samples[numSamples++][2] = 0;    // colour
+        break;
+    default:
+        model = 134;
+        samples[numSamples][0] = 0; samples[numSamples][1] = 128; samples[numSamples++][2] = 0;
+        break;
+    }
+    uint32_t dfdLength = 4 + 24 + 16 * numSamples;
+    uint32_t kvdLength = (uint32_t) ((4 + sizeof(writer) + 3) & ~3u);
+    size_t levelIndex = 80;
+    size_t dfdOffset = levelIndex + levels.size() * 24;
+    size_t kvdOffset = dfdOffset + dfdLength;
+    size_t dataOffset = kvdOffset + kvdLength;
+    size_t align = texture_is_block(format) ? 16 : 4;
+
+    out.assign(dataOffset, 0);
+    memcpy(out.data(), identifier, 12);
+    texture_put32(out, 12, vkFormat[format]);
+    texture_put32(out, 16, 1);              // type size
+    texture_put32(out, 20, w);
+    texture_put32(out, 24, h);
+    texture_put32(out, 36, 1);              // faces
+    texture_put32(out, 40, (uint32_t) levels.size());
+    texture_put32(out, 48, (uint32_t) dfdOffset);
+    texture_put32(out, 52, dfdLength);
+    texture_put32(out, 56, (uint32_t) kvdOffset);
+    texture_put32(out, 60, kvdLength);
+
+    size_t d = dfdOffset;
+    texture_put32(out, d, dfdLength);
+    texture_put16(out, d + 8, 2);           // version, after the vendor and type word
+    texture_put16(out, d + 10, (uint16_t) (24 + 16 * numSamples));
+    out[d + 12] = model;
+    out[d + 13] = 1;                        // BT.709 primaries
+    out[d + 14] = 1;                        // linear, the values are used as they are
+    out[d + 15] = 0;                        // straight alpha
+    if (texture_is_block(format)) out[d + 16] = out[d + 17] = 3;
+    out[d + 20] = (uint8_t) texture_unit_bytes(format);
+    for (int k = 0; k < numSamples; k++) {
+        size_t s = d + 28 + k * 16;
+        texture_put16(out, s, (uint16_t) samples[k][0]);
+        out[s + 2] = (uint8_t) (samples[k][1] - 1);
+        out[s + 3] = (uint8_t) samples[k][2];
+        texture_put32(out, s + 12, samples[k][1] >= 32 ? 0xFFFFFFFFu : (1u << samples[k][1]) - 1);
+    }
+    texture_put32(out, kvdOffset, (uint32_t) sizeof(writer));
+    memcpy(&out[kvdOffset + 4], writer, sizeof(writer));
+
+    for (size_t k = levels.size(); k-- > 0;) {
+        while (out.size() % align) out.push_back(0);
+        texture_put64(out, levelIndex + k * 24, out.size());
+        texture_put64(out, levelIndex + k * 24 + 8, levels[k].size());
+        texture_put64(out, levelIndex + k * 24 + 16, levels[k].size());
+        out.insert(out.end(), levels[k].begin(), levels[k].end());
+    }
+}
+
+// Encode an image, 1 byte per pixel for R8 and 4 otherwise, into the container.
+// With mips every level down to 1 x 1 follows the image
+static inline void texture_encode(const uint8_t* pixels, uint32_t w, uint32_t h, TextureFormat format, bool mips, int threads,
+    TextureContainer container, std::vector<uint8_t>& out) {
+    int bpp = format == TEXTURE_R8 ? 1 : 4;
+    std::vector<std::vector<uint8_t>> levels;
+    std::vector<uint8_t> image(pixels, pixels + (size_t) w * h * bpp), next;
+    uint32_t lw = w, lh = h;
+    for (;;) {
+        if (texture_is_block(format)) {
+            levels.emplace_back(texture_level_bytes(format, lw, lh));
+            texture_compress(image.data(), lw, lh, format, threads, levels.back().data());
+        } else {
+            levels.push_back(image);
+        }
+        if (!mips || (lw == 1 && lh == 1)) break;
+        texture_downsample(image, lw, lh, bpp, next, &lw, &lh);
+        image.swap(next);
+    }
+    if (container == TEXTURE_DDS) {
+        texture_write_dds(levels, w, h, format, out);
+    } else {
+        texture_write_ktx2(levels, w, h, format, out);
+    }
+}
+
+#endif // TEXTURE_WRITER_H
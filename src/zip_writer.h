@@ -0,0 +1,211 @@
+// Minimal streaming ZIP writer used by sffcli -X
+//   zip_open()  creates the archive
+//   zip_add()   appends one complete entry, stored or raw deflated with zlib.
+//               Safe to call from several threads, the compression runs
+//               outside the lock and only the write is serialised
+//   zip_close() writes the central directory (ZIP64 records when there are
+//               more than 65535 entries or it starts beyond 4 GB) and closes
+// Entries carry a fixed 1980-01-01 timestamp, the archive content does not
+// depend on when it was written (the entry order does depend on the encoders)
+
+#ifndef ZIP_WRITER_H
+#define ZIP_WRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define ZIP_DOS_DATE 0x21   // 1980-01-01
+#define ZIP_DOS_TIME 0
+
+typedef struct {
+    std::string name;
+    uint32_t crc;
+    uint32_t compressedSize;
+    uint32_t size;
+    uint64_t offset;        // of the local header
+    uint16_t method;        // 0 = stored, 8 = deflated
+} ZipEntry;
+
+typedef struct {
+    FILE* f;
+    uint64_t offset;        // bytes written so far
+    std::vector<ZipEntry> entries;
+    std::mutex lock;
+    bool failed;
+} ZipWriter;
+
+static inline void zip_put16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static inline void zip_put32(uint8_t* p, uint32_t v) {
+    zip_put16(p, v & 0xFFFF);
+    zip_put16(p + 2, v >> 16);
+}
+
+static inline void zip_put64(uint8_t* p, uint64_t v) {
+    zip_put32(p, (uint32_t) v);
+    zip_put32(p + 4, (uint32_t) (v >> 32));
+}
+
+static inline int zip_write(ZipWriter* zw, const void* data, size_t len) {
+    if (len > 0 && fwrite(data, 1, len, zw->f) != len) {
+        zw->failed = true;
+        return -1;
+    }
+    zw->offset += len;
+    return 0;
+}
+
+static inline int zip_open(ZipWriter* zw, const char* filename) {
+    zw->f = fopen(filename, "wb");
+    zw->offset = 0;
+    zw->entries.clear();
+    zw->failed = false;
+    if (!zw->f) {
+        fprintf(stderr, "Error creating ZIP file %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Append one entry. With pack the data is compressed, and kept stored
+// anyway when that does not make it smaller
+static inline int zip_add(ZipWriter* zw, const char* name, const uint8_t* data, size_t len, bool pack) {
+    if (len > 0xFFFFFFFFu) {
+        fprintf(stderr, "ZIP entry %s is too large\n", name);
+        return -1;
+    }
+    uint32_t crc = (uint32_t) crc32(0, data, (uInt) len);
+    std::vector<uint8_t> packed;
+    if (pack && len > 0) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+            packed.resize(deflateBound(&zs, len));
+            zs.next_in = (Bytef*) data;
+            zs.avail_in = (uInt) len;
+            zs.next_out = packed.data();
+            zs.avail_out = (uInt) packed.size();
+            if (deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < len) {
+                packed.resize(zs.total_out);
+            } else {
+                packed.clear();
+            }
+            deflateEnd(&zs);
+        }
+    }
+
+    ZipEntry e;
+    e.name = name;
+    e.crc = crc;
+    e.size = (uint32_t) len;
+    e.method = packed.empty() ? 0 : 8;
+    e.compressedSize = packed.empty() ? (uint32_t) len : (uint32_t) packed.size();
+    const uint8_t* body = packed.empty() ? data : packed.data();
+
+    uint8_t h[30];
+    zip_put32(h, 0x04034b50);
+    zip_put16(h + 4, 20);           // version needed
+    zip_put16(h + 6, 0);            // flags
+    zip_put16(h + 8, e.method);
+    zip_put16(h + 10, ZIP_DOS_TIME);
+    zip_put16(h + 12, ZIP_DOS_DATE);
+    zip_put32(h + 14, e.crc);
+    zip_put32(h + 18, e.compressedSize);
+    zip_put32(h + 22, e.size);
+    zip_put16(h + 26, (uint16_t) e.name.size());
+    zip_put16(h + 28, 0);           // extra field length
+
+    std::lock_guard<std::mutex> lk(zw->lock);
+    if (zw->offset > 0xFFFFFFFFu) {
+        fprintf(stderr, "ZIP archive is larger than 4 GB\n");
+        zw->failed = true;
+        return -1;
+    }
+    e.offset = zw->offset;
+    if (zip_write(zw, h, sizeof(h)) != 0 || zip_write(zw, e.name.data(), e.name.size()) != 0 ||
+        zip_write(zw, body, e.compressedSize) != 0) {
+        fprintf(stderr, "Error writing ZIP entry %s\n", name);
+        return -1;
+    }
+    zw->entries.push_back(e);
+    return 0;
+}
+
+static inline int zip_close(ZipWriter* zw) {
+    if (!zw->f) return -1;
+    uint64_t cdOffset = zw->offset;
+    for (const ZipEntry& e : zw->entries) {
+        uint8_t h[46];
+        zip_put32(h, 0x02014b50);
+        zip_put16(h + 4, 20);       // version made by
+        zip_put16(h + 6, 20);       // version needed
+        zip_put16(h + 8, 0);
+        zip_put16(h + 10, e.method);
+        zip_put16(h + 12, ZIP_DOS_TIME);
+        zip_put16(h + 14, ZIP_DOS_DATE);
+        zip_put32(h + 16, e.crc);
+        zip_put32(h + 20, e.compressedSize);
+        zip_put32(h + 24, e.size);
+        zip_put16(h + 28, (uint16_t) e.name.size());
+        zip_put16(h + 30, 0);       // extra field length
+        zip_put16(h + 32, 0);       // comment length
+        zip_put16(h + 34, 0);       // disk number
+        zip_put16(h + 36, 0);       // internal attributes
+        zip_put32(h + 38, 0);       // external attributes
+        zip_put32(h + 42, (uint32_t) e.offset);
+        zip_write(zw, h, sizeof(h));
+        zip_write(zw, e.name.data(), e.name.size());
+    }
+    uint64_t cdSize = zw->offset - cdOffset;
+    uint64_t count = zw->entries.size();
+
+    bool zip64 = count > 0xFFFF || cdOffset > 0xFFFFFFFFu || cdSize > 0xFFFFFFFFu;
+    if (zip64) {
+        uint64_t eocd64 = zw->offset;
+        uint8_t r[56];
+        zip_put32(r, 0x06064b50);
+        zip_put64(r + 4, sizeof(r) - 12);
+        zip_put16(r + 12, 45);      // version made by
+        zip_put16(r + 14, 45);      // version needed
+        zip_put32(r + 16, 0);       // this disk
+        zip_put32(r + 20, 0);       // disk of the central directory
+        zip_put64(r + 24, count);
+        zip_put64(r + 32, count);
+        zip_put64(r + 40, cdSize);
+        zip_put64(r + 48, cdOffset);
+        zip_write(zw, r, sizeof(r));
+
+        uint8_t l[20];
+        zip_put32(l, 0x07064b50);
+        zip_put32(l + 4, 0);
+        zip_put64(l + 8, eocd64);
+        zip_put32(l + 16, 1);       // total disks
+        zip_write(zw, l, sizeof(l));
+    }
+
+    uint8_t h[22];
+    zip_put32(h, 0x06054b50);
+    zip_put16(h + 4, 0);
+    zip_put16(h + 6, 0);
+    zip_put16(h + 8, zip64 ? 0xFFFF : (uint16_t) count);
+    zip_put16(h + 10, zip64 ? 0xFFFF : (uint16_t) count);
+    zip_put32(h + 12, zip64 ? 0xFFFFFFFFu : (uint32_t) cdSize);
+    zip_put32(h + 16, zip64 ? 0xFFFFFFFFu : (uint32_t) cdOffset);
+    zip_put16(h + 20, 0);           // comment length
+    zip_write(zw, h, sizeof(h));
+
+    int rc = fclose(zw->f) == 0 && !zw->failed ? 0 : -1;
+    zw->f = NULL;
+    if (rc != 0) fprintf(stderr, "Error writing ZIP central directory\n");
+    return rc;
+}
+
+#endif // ZIP_WRITER_H